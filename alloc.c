@@ -0,0 +1,260 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the instrumented allocator, for building with
+ * -DALLOC_STATS (see alloc.h).
+ *
+ * Each block is allocated with a header in front of it holding its size, the
+ * site that allocated it and the operation it was allocated in, so freeing it
+ * is counted against both wherever it is freed. Sites put themselves on a
+ * list the first time they allocate; the counters are atomic, so threads
+ * allocate without taking a lock. alloc_report() writes the counts: what is
+ * still live at exit is what leaked, and the allocations counted against
+ * the lookups show whether the hot path allocates at all.
+ *
+ * Built without ALLOC_STATS, only alloc_report() is left, to say so.
+ */
+
+#define ALLOC_IMPL
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+#include "alloc.h"
+
+#ifdef ALLOC_STATS
+#include <stddef.h>
+
+typedef union AllocHeader AllocHeader; //What is in front of each block.
+union AllocHeader {
+	struct {
+		AllocSite *site; //The site that allocated the block.
+		size_t size; //The size asked for.
+		int op; //The operation it was allocated in.
+		void *base; //What to give back to free(): the header itself, or the start of an aligned block.
+	} block;
+	max_align_t align; //Keep the block behind it aligned for anything.
+};
+
+typedef struct AllocCounts AllocCounts; //What was allocated in an operation.
+struct AllocCounts {
+	atomic_long allocs;
+	atomic_long frees;
+	atomic_long bytes;
+	atomic_long live_bytes;
+};
+
+static const char *alloc_op_names[ALLOC_OPS] = {"other", "get", "put", "delete", "load", "save", "reset"}; //Names of the operations, indexed by operation.
+
+static _Atomic(AllocSite *) alloc_sites = NULL; //Every site that has allocated, newest first.
+static AllocCounts alloc_ops[ALLOC_OPS];
+static __thread int alloc_current_op = ALLOC_OP_OTHER; //The outermost operation the calling thread is in.
+
+
+/*
+ * Count a block as allocated and fill in its header.
+ *
+ * Returns: the block behind the header
+ */
+static void *alloc_account(AllocHeader *header, size_t size, AllocSite *site) {
+	if (!atomic_load_explicit(&site->registered, memory_order_acquire) && !atomic_exchange(&site->registered, 1)) {
+		site->next = atomic_load(&alloc_sites);
+		while (!atomic_compare_exchange_weak(&alloc_sites, &site->next, site)); //threads may register sites at once.
+	}
+	int op = alloc_current_op;
+	header->block.site = site;
+	header->block.size = size;
+	header->block.op = op;
+	header->block.base = header;
+	atomic_fetch_add_explicit(&site->allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&site->bytes, (long) size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&site->live_bytes, (long) size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_ops[op].allocs, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_ops[op].bytes, (long) size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_ops[op].live_bytes, (long) size, memory_order_relaxed);
+	return header + 1;
+}
+
+
+/*
+ * Count a block as freed, against the site and operation that allocated it.
+ */
+static void alloc_unaccount(AllocHeader *header) {
+	AllocSite *site = header->block.site;
+	long size = (long) header->block.size;
+	atomic_fetch_add_explicit(&site->frees, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&site->live_bytes, size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&alloc_ops[header->block.op].frees, 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&alloc_ops[header->block.op].live_bytes, size, memory_order_relaxed);
+}
+
+
+void *alloc_malloc(size_t size, AllocSite *site) {
+	if (size > (size_t) -1 - sizeof(AllocHeader)) return NULL;
+	AllocHeader *header = (AllocHeader *) malloc(sizeof(AllocHeader) + size);
+	return header == NULL ? NULL : alloc_account(header, size, site);
+}
+
+
+void *alloc_calloc(size_t count, size_t size, AllocSite *site) {
+	if (size != 0 && count > ((size_t) -1 - sizeof(AllocHeader)) / size) return NULL;
+	AllocHeader *header = (AllocHeader *) calloc(1, sizeof(AllocHeader) + count * size);
+	return header == NULL ? NULL : alloc_account(header, count * size, site);
+}
+
+
+/*
+ * Allocate a block aligned to align bytes, a power of two no smaller than the
+ * header. The header goes at the end of the first align bytes, so the block
+ * behind it is aligned as asked.
+ */
+void *alloc_aligned_alloc(size_t align, size_t size, AllocSite *site) {
+	if (align < sizeof(AllocHeader) || size > (size_t) -1 - align) return NULL;
+	char *base = (char *) aligned_alloc(align, align + size);
+	if (base == NULL) return NULL;
+	AllocHeader *header = (AllocHeader *) (base + align) - 1;
+	void *block = alloc_account(header, size, site);
+	header->block.base = base;
+	return block;
+}
+
+
+/*
+ * Resize a block. It counts as freed and allocated again, at the site that
+ * resized it. Aligned blocks cannot be resized.
+ */
+void *alloc_realloc(void *ptr, size_t size, AllocSite *site) {
+	if (ptr == NULL) return alloc_malloc(size, site);
+	if (size > (size_t) -1 - sizeof(AllocHeader)) return NULL;
+	AllocHeader *header = (AllocHeader *) ptr - 1;
+	if (header->block.base != header) return NULL;
+	AllocHeader old = *header;
+	header = (AllocHeader *) realloc(header, sizeof(AllocHeader) + size);
+	if (header == NULL) return NULL; //the block is left as it was.
+	alloc_unaccount(&old);
+	return alloc_account(header, size, site);
+}
+
+
+char *alloc_strdup(const char *s, AllocSite *site) {
+	size_t n = strlen(s) + 1;
+	char *copy = (char *) alloc_malloc(n, site);
+	if (copy != NULL) memcpy(copy, s, n);
+	return copy;
+}
+
+
+void alloc_free(void *ptr) {
+	if (ptr == NULL) return;
+	AllocHeader *header = (AllocHeader *) ptr - 1;
+	void *base = header->block.base;
+	alloc_unaccount(header);
+	free(base);
+}
+
+
+/*
+ * Enter an operation. Called by ALLOC_OP().
+ *
+ * Returns: the operation the thread was in, for alloc_op_leave()
+ */
+int alloc_op_enter(int op) {
+	int previous = alloc_current_op;
+	if (previous == ALLOC_OP_OTHER) alloc_current_op = op;
+	return previous;
+}
+
+
+/*
+ * Leave an operation, at the end of the block ALLOC_OP() was in.
+ */
+void alloc_op_leave(int *previous) {
+	alloc_current_op = *previous;
+}
+
+
+/*
+ * Order sites by the bytes they leave live, then by how many blocks they
+ * allocated, most first.
+ */
+static int alloc_site_compare(const void *a, const void *b) {
+	const AllocSite *x = *(AllocSite * const *) a, *y = *(AllocSite * const *) b;
+	long lx = atomic_load(&x->live_bytes), ly = atomic_load(&y->live_bytes);
+	if (lx != ly) return lx < ly ? 1 : -1;
+	long ax = atomic_load(&x->allocs), ay = atomic_load(&y->allocs);
+	return ax < ay ? 1 : ax > ay ? -1 : 0;
+}
+
+#endif
+
+
+/*
+ * Write the allocations counted so far, by operation and by call site. At
+ * exit, the blocks still live are the leaks.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: KB_OK, KB_INVALID if the chatbot was not built with ALLOC_STATS,
+ *          or KB_NOMEM if there was a memory allocation failure
+ */
+int alloc_report(FILE *f) {
+#ifdef ALLOC_STATS
+	fprintf(f, "%-10s %10s %10s %12s %10s %12s\n", "operation", "allocs", "frees", "bytes", "live", "live bytes");
+	for (int op = 0; op < ALLOC_OPS; op++) {
+		long allocs = atomic_load(&alloc_ops[op].allocs), frees = atomic_load(&alloc_ops[op].frees);
+		fprintf(f, "%-10s %10ld %10ld %12ld %10ld %12ld\n", alloc_op_names[op], allocs, frees,
+			atomic_load(&alloc_ops[op].bytes), allocs - frees, atomic_load(&alloc_ops[op].live_bytes));
+	}
+
+	int n = 0;
+	for (AllocSite *site = atomic_load(&alloc_sites); site != NULL; site = site->next)
+		n++;
+	AllocSite **sites = (AllocSite **) malloc((n + 1) * sizeof(AllocSite *));
+	if (sites == NULL) return KB_NOMEM;
+	n = 0;
+	for (AllocSite *site = atomic_load(&alloc_sites); site != NULL; site = site->next)
+		sites[n++] = site;
+	qsort(sites, n, sizeof(AllocSite *), alloc_site_compare);
+
+	fprintf(f, "\n%-40s %10s %10s %12s %10s %12s\n", "site", "allocs", "frees", "bytes", "live", "live bytes");
+	for (int i = 0; i < n; i++) {
+		char where[256];
+		snprintf(where, sizeof(where), "%s:%d %s", sites[i]->file, sites[i]->line, sites[i]->func);
+		long allocs = atomic_load(&sites[i]->allocs), frees = atomic_load(&sites[i]->frees);
+		fprintf(f, "%-40s %10ld %10ld %12ld %10ld %12ld\n", where, allocs, frees,
+			atomic_load(&sites[i]->bytes), allocs - frees, atomic_load(&sites[i]->live_bytes));
+	}
+	free(sites);
+	return fflush(f) != 0 || ferror(f) ? KB_IOERR : KB_OK;
+#else
+	(void) f;
+	return KB_INVALID;
+#endif
+}
+
+
+/*
+ * Get the totals of the allocations counted so far.
+ *
+ * Input:
+ *   op         - the operation, or -1 for all of them
+ *   allocs     - set to the number of blocks allocated
+ *   live_bytes - set to the bytes allocated and not freed yet
+ *
+ * Returns: KB_OK, or KB_INVALID if the chatbot was not built with ALLOC_STATS
+ */
+int alloc_totals(int op, long *allocs, long *live_bytes) {
+	*allocs = *live_bytes = 0;
+#ifdef ALLOC_STATS
+	for (int i = 0; i < ALLOC_OPS; i++) {
+		if (op >= 0 && i != op) continue;
+		*allocs += atomic_load(&alloc_ops[i].allocs);
+		*live_bytes += atomic_load(&alloc_ops[i].live_bytes);
+	}
+	return KB_OK;
+#else
+	(void) op;
+	return KB_INVALID;
+#endif
+}
@@ -0,0 +1,79 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file contains the instrumented allocator (see alloc.c). Built with
+ * -DALLOC_STATS, every file that includes it, last of its headers, has its
+ * malloc(), calloc(), realloc(), aligned_alloc(), strdup() and free()
+ * counted by call site and by the operation of the knowledge base they run
+ * in. Built without it, it changes nothing.
+ *
+ * A function carrying out an operation marks it with ALLOC_OP(op) at its
+ * start. Operations nest: allocations count towards the outermost, so what
+ * knowledge_import() stores with knowledge_put_batch() counts as a load.
+ */
+
+#ifndef _ALLOC_H
+#define _ALLOC_H
+#include <stdlib.h>
+#include <string.h>
+
+/* the operations allocations are counted by */
+#define ALLOC_OP_OTHER  0 //Anything outside the operations below.
+#define ALLOC_OP_GET    1
+#define ALLOC_OP_PUT    2
+#define ALLOC_OP_DELETE 3
+#define ALLOC_OP_LOAD   4
+#define ALLOC_OP_SAVE   5
+#define ALLOC_OP_RESET  6
+#define ALLOC_OPS       7
+
+#ifdef ALLOC_STATS
+#include <stdatomic.h>
+
+typedef struct AllocSite AllocSite; //A place in the code that allocates, with what it allocated.
+struct AllocSite {
+	const char *file;
+	int line;
+	const char *func;
+	atomic_int registered; //Set once the site is on the list of sites.
+	atomic_long allocs; //Blocks allocated here.
+	atomic_long frees; //Blocks allocated here and freed since.
+	atomic_long bytes; //Bytes allocated here.
+	atomic_long live_bytes; //Bytes allocated here and not freed yet.
+	AllocSite *next; //The site registered before this one.
+};
+
+/* functions defined in alloc.c */
+void *alloc_malloc(size_t size, AllocSite *site);
+void *alloc_calloc(size_t count, size_t size, AllocSite *site);
+void *alloc_realloc(void *ptr, size_t size, AllocSite *site);
+void *alloc_aligned_alloc(size_t align, size_t size, AllocSite *site);
+char *alloc_strdup(const char *s, AllocSite *site);
+void alloc_free(void *ptr);
+int alloc_op_enter(int op);
+void alloc_op_leave(int *previous);
+
+#ifndef ALLOC_IMPL
+
+/* the call site, a static of its own at each place that allocates */
+#define ALLOC_SITE() ({ static AllocSite alloc_site = { __FILE__, __LINE__, __func__ }; &alloc_site; })
+
+#define malloc(size) alloc_malloc((size), ALLOC_SITE())
+#define calloc(count, size) alloc_calloc((count), (size), ALLOC_SITE())
+#define realloc(ptr, size) alloc_realloc((ptr), (size), ALLOC_SITE())
+#define aligned_alloc(align, size) alloc_aligned_alloc((align), (size), ALLOC_SITE())
+#define strdup(s) alloc_strdup((s), ALLOC_SITE())
+#define free(ptr) alloc_free(ptr)
+
+#endif
+
+/* count the allocations up to the end of the enclosing block towards op */
+#define ALLOC_OP(op) int alloc_previous_op __attribute__ ((cleanup (alloc_op_leave), unused)) = alloc_op_enter(op)
+
+#else
+
+#define ALLOC_OP(op) do { } while (0)
+
+#endif
+
+#endif
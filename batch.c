@@ -0,0 +1,536 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the batch mode run by "chatbot --batch".
+ *
+ * In batch mode the chatbot reads lines from standard input and writes one
+ * response per line to standard output, without greeting or prompting. Runs
+ * of consecutive questions are answered together with knowledge_get_many(),
+ * up to BATCH_QUESTIONS at a time; any other line is carried out with
+ * chatbot_handle_line() once the questions before it are answered, so the
+ * responses come out in the order of the input. A question the chatbot cannot answer
+ * is reported, but not learned, as there is nobody to ask for the answer.
+ * With "--memo N", a question whose response the memo holds is not looked up
+ * again (see memo.c), but its response still waits for those before it.
+ *
+ * With "--threads N", questions are answered by N threads. The input is cut
+ * into chunks of BATCH_CHUNK_LINES lines, which are shared out between the
+ * threads; a thread that runs out of chunks steals from the others. Each
+ * chunk's responses are collected in its own buffer and written out in input
+ * order, so the output is byte for byte the same as with one thread. Only
+ * questions run in parallel: any other line may change the knowledge, so the
+ * chunks before it are finished and written before it runs, alone.
+ */
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+#include "trace.h"
+#include "alloc.h"
+
+#define BATCH_QUESTIONS 256 //Maximum number of questions answered together.
+#define BATCH_CHUNK_LINES 1024 //Number of lines in a chunk of work for --threads.
+#define BATCH_CHUNKS_PER_THREAD 8 //Number of chunks read ahead for each thread, so they can balance the work.
+
+/* Delimiters for splitting input to words, as in chatbot.c */
+static const char *delimiters = " ?\t\n";
+
+typedef struct BatchQuestion BatchQuestion; //A question waiting to be answered.
+struct BatchQuestion {
+	char line[MAX_INPUT]; //The input, split into words in place.
+	char entity[MAX_INPUT];
+	char response[MAX_RESPONSE];
+	const char *filler; //"is" or "are" as asked, or NULL.
+	char key[MAX_INPUT]; //The line reduced by memo_key(), empty if its response is not to be kept in the memo.
+	unsigned int generation; //The generation memo_get() gave for the key.
+	int query; //Index of its query in queries, or -1 if the memo answered it.
+};
+
+typedef struct Batch Batch;
+struct Batch {
+	int count; //Number of questions waiting.
+	int queried; //Number of them to look up, those the memo did not answer.
+	chat_memo_t *memo; //The memo of the session, or NULL.
+	BatchQuestion questions[BATCH_QUESTIONS];
+	kb_query_t queries[BATCH_QUESTIONS];
+};
+
+typedef struct OutBuf OutBuf; //A growing buffer of text, such as responses waiting to be written.
+struct OutBuf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+typedef struct Chunk Chunk; //Lines of input answered by one thread.
+struct Chunk {
+	OutBuf in; //The lines, one after another, each with its newline.
+	OutBuf out; //The responses to the lines.
+	int done; //Set once out is complete.
+};
+
+typedef struct Deque Deque; //Chunks waiting for a thread. The owner takes from the bottom, thieves from the top.
+struct Deque {
+	pthread_mutex_t lock;
+	int *items; //Indexes of the chunks.
+	int top;
+	int bottom;
+};
+
+typedef struct Pool Pool;
+struct Pool {
+	kb_t *kb;
+	int threads;
+	pthread_t *tids;
+	Deque *deques; //One for each thread.
+	Chunk *chunks;
+	int generation; //Advanced each time chunks are handed out.
+	int stop; //Set to end the threads.
+	pthread_mutex_t lock; //Protects generation, stop and the done flags.
+	pthread_cond_t work; //Signalled when chunks are handed out.
+	pthread_cond_t ready; //Signalled when a chunk is done.
+};
+
+typedef struct Worker Worker;
+struct Worker {
+	Pool *pool;
+	int id;
+	Batch *batch;
+	chat_session_t *session; //Chunks hold only questions, so it never waits for a reply.
+};
+
+
+/*
+ * Append text to an output buffer.
+ *
+ * Returns: 1 if successful, 0 if there was a memory allocation failure
+ */
+static int out_append(OutBuf *out, const char *text, size_t len) {
+	if (out->len + len > out->size) {
+		size_t size = out->size ? out->size : 4096;
+		while (size < out->len + len) size *= 2;
+		char *grown = (char *) realloc(out->data, size);
+		if (grown == NULL) return 0;
+		out->data = grown;
+		out->size = size;
+	}
+	memcpy(out->data + out->len, text, len);
+	out->len += len;
+	return 1;
+}
+
+
+/*
+ * Append one response, followed by a newline, to an output buffer.
+ */
+static void out_line(OutBuf *out, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+static void out_line(OutBuf *out, const char *format, ...) {
+	char line[MAX_RESPONSE + 2 * MAX_INPUT];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	if (len < 0) return;
+	if ((size_t) len > sizeof(line) - 2) len = sizeof(line) - 2;
+	line[len++] = '\n';
+	out_append(out, line, len);
+}
+
+
+/*
+ * Determine whether a line is a question, without splitting it, by looking
+ * at its first word as chatbot_split() would find it.
+ *
+ * Returns:
+ *   1, if the line is a question (which never changes the knowledge)
+ *   0, if it is anything else
+ *   -1, if it has no words
+ */
+static int batch_is_question(const char *line) {
+	char word[MAX_INTENT];
+	size_t start = strspn(line, delimiters);
+	size_t len = strcspn(line + start, delimiters);
+	if (len == 0) return -1;
+	if (len >= sizeof(word)) return 0;
+	memcpy(word, line + start, len);
+	while (len > 0 && ispunct(word[len - 1])) len--;
+	word[len] = '\0';
+	return chatbot_is_question(word);
+}
+
+
+/*
+ * Answer the questions waiting in a batch.
+ *
+ * Input:
+ *   kb    - the knowledge base
+ *   batch - the questions, emptied
+ *   out   - receives the responses
+ */
+static void batch_flush(kb_t *kb, Batch *batch, OutBuf *out) {
+	TRACE_BEGIN(dispatch);
+	knowledge_get_many(kb, batch->queries, batch->queried);
+	TRACE_END(TRACE_DISPATCH, dispatch);
+	TRACE_BEGIN(format);
+	for (int i = 0; i < batch->count; i++) {
+		BatchQuestion *q = &batch->questions[i];
+		kb_query_t *query = q->query >= 0 ? &batch->queries[q->query] : NULL;
+		if (query == NULL || query->status == KB_OK)
+			out_line(out, "%s", q->response);
+		else if (q->filler != NULL)
+			out_line(out, "Hmm, I don't know. %s %s %s?", query->intent, q->filler, q->entity);
+		else
+			out_line(out, "Hmm, I don't know. %s %s?", query->intent, q->entity);
+		if (query != NULL && query->status == KB_OK && q->key[0] != '\0')
+			memo_put(batch->memo, q->key, q->generation, q->response);
+	}
+	TRACE_END(TRACE_FORMAT, format);
+	batch->count = 0;
+	batch->queried = 0;
+}
+
+
+/*
+ * Handle one line of input: queue it if it is a question with an entity (with
+ * its response, if the memo holds it), else answer the questions queued
+ * before it, then pass it to the session.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   session - the chat session, which may be waiting for a reply
+ *   batch   - the questions waiting
+ *   text    - the line
+ *   len     - the length of the line
+ *   out     - receives the responses
+ *
+ * Returns: 1 if the line ends the chatbot, 0 otherwise
+ */
+static int batch_line(kb_t *kb, chat_session_t *session, Batch *batch, const char *text, size_t len, OutBuf *out) {
+	BatchQuestion *q = &batch->questions[batch->count]; //use the next free question, in case it is one.
+	char line[MAX_INPUT]; //the line as it came, for the session.
+	char *inv[MAX_INPUT];
+	TRACE_REQUEST();
+	if (len >= MAX_INPUT) len = MAX_INPUT - 1;
+	memcpy(line, text, len);
+	line[len] = '\0';
+	if (chatbot_session_pending(session) == CHAT_PENDING_NONE) {
+		q->key[0] = '\0';
+		if (batch->memo != NULL && memo_key(line, q->key, MAX_INPUT) > 0
+			&& memo_get(batch->memo, kb, q->key, q->response, MAX_RESPONSE, &q->generation)) {
+			/* queue the response, to be written after those of the questions before it */
+			q->query = -1;
+			if (++batch->count == BATCH_QUESTIONS)
+				batch_flush(kb, batch, out);
+			return 0;
+		}
+		memcpy(q->line, line, len + 1);
+		TRACE_BEGIN(split);
+		int inc = chatbot_split(q->line, inv);
+		TRACE_END(TRACE_SPLIT, split);
+		if (inc < 1)
+			return 0;
+
+		int start;
+		if (chatbot_is_question(inv[0]) && (start = chatbot_question_entity(inc, inv, q->entity, MAX_INPUT)) > 0) {
+			/* queue the question */
+			q->query = batch->queried;
+			kb_query_t *query = &batch->queries[batch->queried++];
+			batch->count++;
+			query->intent = inv[0];
+			query->entity = q->entity;
+			query->response = q->response;
+			query->n = MAX_RESPONSE;
+			q->filler = start == 2 ? inv[1] : NULL;
+			if (batch->count == BATCH_QUESTIONS)
+				batch_flush(kb, batch, out);
+			return 0;
+		}
+	}
+
+	/* anything else, including a reply to the session, waits for the questions before it */
+	char output[MAX_RESPONSE];
+	batch_flush(kb, batch, out);
+	int done = chatbot_handle_line(session, line, output, MAX_RESPONSE);
+	if (output[0] != '\0')
+		out_line(out, "%s", output);
+	return done;
+}
+
+
+/*
+ * Answer every line of a chunk.
+ */
+static void batch_chunk(kb_t *kb, chat_session_t *session, Batch *batch, Chunk *chunk) {
+	for (size_t at = 0; at < chunk->in.len; ) {
+		const char *line = chunk->in.data + at;
+		size_t len = strchr(line, '\n') - line + 1; //each line of a chunk ends with a newline.
+		batch_line(kb, session, batch, line, len, &chunk->out);
+		at += len;
+	}
+	batch_flush(kb, batch, &chunk->out);
+}
+
+
+/*
+ * Take a chunk to answer: the newest of the thread's own, or else the
+ * oldest of another thread's.
+ *
+ * Returns: the index of the chunk, or -1 if there are none left
+ */
+static int pool_take(Pool *pool, int id) {
+	for (int k = 0; k < pool->threads; k++) {
+		Deque *deque = &pool->deques[(id + k) % pool->threads];
+		int chunk = -1;
+		pthread_mutex_lock(&deque->lock);
+		if (deque->top < deque->bottom)
+			chunk = k == 0 ? deque->items[--deque->bottom] : deque->items[deque->top++];
+		pthread_mutex_unlock(&deque->lock);
+		if (chunk >= 0) return chunk;
+	}
+	return -1;
+}
+
+
+/*
+ * A thread of the pool. Answers chunks each time they are handed out,
+ * until the pool stops.
+ */
+static void *pool_thread(void *arg) {
+	Worker *worker = (Worker *) arg;
+	Pool *pool = worker->pool;
+	int seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->stop) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		int index;
+		while ((index = pool_take(pool, worker->id)) >= 0) {
+			Chunk *chunk = &pool->chunks[index];
+			worker->batch->count = 0;
+			worker->batch->queried = 0;
+			batch_chunk(pool->kb, worker->session, worker->batch, chunk);
+			pthread_mutex_lock(&pool->lock);
+			chunk->done = 1;
+			pthread_cond_broadcast(&pool->ready);
+			pthread_mutex_unlock(&pool->lock);
+		}
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/*
+ * Hand out chunks to the threads, then write their responses in order as
+ * they are done.
+ *
+ * Input:
+ *   count - the number of chunks filled in
+ *   out   - the file to write to
+ */
+static void pool_run(Pool *pool, int count, FILE *out) {
+	for (int t = 0; t < pool->threads; t++) { //each thread starts with a run of neighbouring chunks.
+		Deque *deque = &pool->deques[t];
+		pthread_mutex_lock(&deque->lock);
+		deque->top = deque->bottom = 0;
+		for (int i = (t + 1) * count / pool->threads - 1; i >= t * count / pool->threads; i--)
+			deque->items[deque->bottom++] = i; //pushed last to first, so the owner pops them in order.
+		pthread_mutex_unlock(&deque->lock);
+	}
+	pthread_mutex_lock(&pool->lock);
+	for (int i = 0; i < count; i++)
+		pool->chunks[i].done = 0;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work);
+	for (int i = 0; i < count; i++) { //the reordering: chunk i is written only after every chunk before it.
+		while (!pool->chunks[i].done)
+			pthread_cond_wait(&pool->ready, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		fwrite(pool->chunks[i].out.data, 1, pool->chunks[i].out.len, out);
+		pool->chunks[i].out.len = 0;
+		pool->chunks[i].in.len = 0;
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Run batch mode with a pool of threads.
+ *
+ * Returns: the exit status of the program
+ */
+static int batch_parallel(kb_t *kb, FILE *in, FILE *out, int threads, int memo) {
+	int nchunks = threads * BATCH_CHUNKS_PER_THREAD;
+	Pool pool;
+	memset(&pool, 0, sizeof(pool));
+	pool.kb = kb;
+	pool.threads = threads;
+	pool.tids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+	pool.deques = (Deque *) calloc(threads, sizeof(Deque));
+	pool.chunks = (Chunk *) calloc(nchunks, sizeof(Chunk));
+	Worker *workers = (Worker *) calloc(threads, sizeof(Worker));
+	Batch *batch = (Batch *) malloc(sizeof(Batch)); //for the lines run alone.
+	chat_session_t *session = chatbot_session_create(kb); //for the lines run alone, which may ask for a reply.
+	int ok = pool.tids && pool.deques && pool.chunks && workers && batch && session && chatbot_session_set_memo(session, memo) == KB_OK;
+	if (ok) batch->memo = chatbot_session_memo(session);
+	int locks = 0; //deques whose lock was initialised.
+	for (; ok && locks < threads; locks++) {
+		pool.deques[locks].items = (int *) malloc(nchunks * sizeof(int));
+		if (pool.deques[locks].items == NULL) {
+			ok = 0;
+			break;
+		}
+		pthread_mutex_init(&pool.deques[locks].lock, NULL);
+	}
+	for (int t = 0; ok && t < threads; t++) { //each thread's batch and session, made before any thread starts.
+		workers[t].pool = &pool;
+		workers[t].id = t;
+		workers[t].batch = (Batch *) malloc(sizeof(Batch));
+		workers[t].session = chatbot_session_create(kb);
+		ok = workers[t].batch != NULL && workers[t].session != NULL && chatbot_session_set_memo(workers[t].session, memo) == KB_OK;
+		if (ok) workers[t].batch->memo = chatbot_session_memo(workers[t].session);
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.ready, NULL);
+	int started = 0;
+	for (; ok && started < threads; started++) {
+		if (pthread_create(&pool.tids[started], NULL, pool_thread, &workers[started]) != 0) {
+			ok = 0;
+			break; //only the threads started are joined.
+		}
+	}
+
+	char line[MAX_INPUT];
+	int filled = 0; //chunks filled, the last one possibly partly.
+	int lines = 0; //lines in the last chunk.
+	int done = 0;
+	while (ok && !done) {
+		TRACE_BEGIN(read);
+		int eof = fgets(line, MAX_INPUT, in) == NULL;
+		TRACE_END(TRACE_READ, read);
+		int kind = eof ? 0 : chatbot_session_pending(session) != CHAT_PENDING_NONE ? 0 : batch_is_question(line); //a reply to the session runs alone.
+		if (kind < 0)
+			continue; //no words, no response.
+		if (kind > 0) {
+			/* add the question to the current chunk */
+			if (filled == 0 || lines == BATCH_CHUNK_LINES) {
+				if (filled == nchunks) { //every chunk is full, answer them before reading on.
+					pool_run(&pool, filled, out);
+					filled = 0;
+				}
+				filled++;
+				lines = 0;
+			}
+			Chunk *chunk = &pool.chunks[filled - 1];
+			size_t len = strlen(line);
+			int newline = len > 0 && line[len - 1] == '\n';
+			if (!out_append(&chunk->in, line, len) || (!newline && !out_append(&chunk->in, "\n", 1)))
+				ok = 0;
+			lines++;
+			continue;
+		}
+		/* the end of the input, or a line to run alone once the questions before it are answered */
+		pool_run(&pool, filled, out);
+		filled = 0;
+		if (eof)
+			break;
+		OutBuf single = { NULL, 0, 0 };
+		batch->count = 0;
+		batch->queried = 0;
+		done = batch_line(kb, session, batch, line, strlen(line), &single);
+		fwrite(single.data, 1, single.len, out);
+		free(single.data);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+	for (int t = 0; t < started; t++)
+		pthread_join(pool.tids[t], NULL);
+	for (int i = 0; pool.chunks && i < nchunks; i++) {
+		free(pool.chunks[i].in.data);
+		free(pool.chunks[i].out.data);
+	}
+	for (int t = 0; t < locks; t++) {
+		free(pool.deques[t].items);
+		pthread_mutex_destroy(&pool.deques[t].lock);
+	}
+	for (int t = 0; workers && t < threads; t++) {
+		free(workers[t].batch);
+		chatbot_session_free(workers[t].session);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	pthread_cond_destroy(&pool.work);
+	pthread_cond_destroy(&pool.ready);
+	free(pool.tids);
+	free(pool.deques);
+	free(pool.chunks);
+	free(workers);
+	free(batch);
+	chatbot_session_free(session);
+	if (!ok) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Run the chatbot in batch mode.
+ *
+ * Input:
+ *   kb      - the knowledge base
+ *   in      - the file to read lines from
+ *   out     - the file to write responses to
+ *   threads - the number of threads answering questions
+ *   memo    - the number of responses each thread keeps in its memo, 0 for none
+ *
+ * Returns: the exit status of the program
+ */
+int batch_main(kb_t *kb, FILE *in, FILE *out, int threads, int memo) {
+	if (threads > 1) {
+		return batch_parallel(kb, in, out, threads, memo);
+	}
+	Batch *batch = (Batch *) malloc(sizeof(Batch));
+	chat_session_t *session = chatbot_session_create(kb);
+	if (batch == NULL || session == NULL || chatbot_session_set_memo(session, memo) != KB_OK) {
+		fprintf(stderr, "Out of memory\n");
+		free(batch);
+		chatbot_session_free(session);
+		return 1;
+	}
+	batch->count = 0;
+	batch->queried = 0;
+	batch->memo = chatbot_session_memo(session);
+	OutBuf responses = { NULL, 0, 0 };
+	char line[MAX_INPUT];
+	int done = 0;
+	while (!done) {
+		TRACE_BEGIN(read);
+		if (fgets(line, MAX_INPUT, in) == NULL)
+			break;
+		TRACE_END(TRACE_READ, read);
+		done = batch_line(kb, session, batch, line, strlen(line), &responses);
+		fwrite(responses.data, 1, responses.len, out);
+		responses.len = 0;
+	}
+	batch_flush(kb, batch, &responses);
+	fwrite(responses.data, 1, responses.len, out);
+	free(responses.data);
+	free(batch);
+	chatbot_session_free(session);
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the benchmark run by "chatbot --bench FILE".
+ *
+ * The benchmark reads a knowledge base, then times knowledge_get() for every
+ * entity in it, first with plain responses and then with compressed ones, so
+ * the memory saved by compression can be weighed against the time it costs.
+ *
+ * It also asks for the entities in a random order, one at a time and in
+ * batches with knowledge_get_many(). In table order, neighbouring lookups
+ * share cache lines; in a random order every lookup misses the cache once the
+ * knowledge base is larger than it, which is where batching pays off.
+ *
+ * Last, it replicates the knowledge base to each NUMA node (see numa.c) and
+ * times lookups from each node in its own replica and in the others, which
+ * is what replication saves. On a machine with one node there is nothing to
+ * compare.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "knowledge.h"
+#include "alloc.h"
+
+#define BENCH_MIN_OPS 1000000 //Minimum number of lookups timed in each mode.
+#define BENCH_BATCH 256 //Number of questions passed to each knowledge_get_many() call.
+
+typedef struct BenchKey BenchKey; //A question asked during the benchmark.
+struct BenchKey {
+	const char *intent;
+	const char *entity;
+	const Response *response;
+};
+
+typedef struct BenchNode BenchNode; //Lookups timed from one NUMA node, see bench_numa_node().
+struct BenchNode {
+	HashTable **replicas; //The replica of each node, NULL for a node that has none.
+	int nodes; //Number of nodes.
+	int node; //The node the lookups run on.
+	const BenchKey *keys;
+	int count;
+	int rounds;
+	double *ns; //Receives nanoseconds per lookup in the replica of each node, 0 if it was not timed.
+};
+
+static double bench_now() {
+	// Returns a monotonic time in nanoseconds.
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_collect(HashTable *ht, BenchKey *keys) {
+	// Fills keys with every entity in the knowledge base, returns how many.
+	int count = 0;
+	for (int i = 0; i < ht->size; i++) {
+		if (ht->items[i].responses != NULL) {
+			keys[count].intent = intent_name(ht->items[i].intent);
+			keys[count++].entity = node_entity(&ht->items[i]);
+		}
+		for (LinkedList *l = ht->obuckets[i]; l; l = l->next) {
+			keys[count].intent = intent_name(l->item.intent);
+			keys[count++].entity = node_entity(&l->item);
+		}
+	}
+	return count;
+}
+
+static double bench_get(kb_t *kb, BenchKey *keys, int count, int rounds) {
+	// Times knowledge_get() over all keys, returns nanoseconds per lookup.
+	char response[MAX_RESPONSE];
+	double start = bench_now();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			knowledge_get(kb, keys[i].intent, keys[i].entity, response, MAX_RESPONSE);
+	return (bench_now() - start) / ((double) rounds * count);
+}
+
+static void bench_shuffle(BenchKey *keys, int count) {
+	// Puts the keys in a random order, the same on every run.
+	unsigned long long state = 88172645463325252ULL;
+	for (int i = count - 1; i > 0; i--) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		int j = (int) (state % (unsigned long long) (i + 1));
+		BenchKey tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+static double bench_get_many(kb_t *kb, BenchKey *keys, int count, int rounds) {
+	// Times knowledge_get_many() over all keys, BENCH_BATCH at a time, returns nanoseconds per lookup.
+	static char responses[BENCH_BATCH][MAX_RESPONSE];
+	kb_query_t queries[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; i++) {
+		queries[i].response = responses[i];
+		queries[i].n = MAX_RESPONSE;
+	}
+	double start = bench_now();
+	for (int r = 0; r < rounds; r++)
+		for (int first = 0; first < count; first += BENCH_BATCH) {
+			int n = count - first < BENCH_BATCH ? count - first : BENCH_BATCH;
+			for (int i = 0; i < n; i++) {
+				queries[i].intent = keys[first + i].intent;
+				queries[i].entity = keys[first + i].entity;
+			}
+			knowledge_get_many(kb, queries, n);
+		}
+	return (bench_now() - start) / ((double) rounds * count);
+}
+
+static double bench_decode(HashTable *ht, BenchKey *keys, int count, int rounds) {
+	// Times copying out (and decompressing) each response alone, returns nanoseconds per response.
+	char response[MAX_RESPONSE];
+	for (int i = 0; i < count; i++) {
+		Node *item = ht_search(ht, intent_tag(keys[i].intent), keys[i].entity);
+		keys[i].response = item ? item->responses : NULL;
+	}
+	double start = bench_now();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			if (keys[i].response) response_copy(ht->responses, keys[i].response, response, MAX_RESPONSE);
+	return (bench_now() - start) / ((double) rounds * count);
+}
+
+static double bench_search(HashTable *ht, const BenchKey *keys, int count, int rounds) {
+	// Times looking up every key in a table and copying out its response, returns nanoseconds per lookup.
+	char response[MAX_RESPONSE];
+	double start = bench_now();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++) {
+			Node *item = ht_search(ht, intent_tag(keys[i].intent), keys[i].entity);
+			if (item) response_copy(ht->responses, item->responses, response, MAX_RESPONSE);
+		}
+	return (bench_now() - start) / ((double) rounds * count);
+}
+
+static void *bench_numa_node(void *arg) {
+	// Times lookups from one node in the replica of every node, a thread of its own.
+	BenchNode *b = (BenchNode *) arg;
+	if (!numa_run_on(b->node)) return NULL;
+	for (int r = 0; r < b->nodes; r++)
+		if (b->replicas[r] != NULL) b->ns[r] = bench_search(b->replicas[r], b->keys, b->count, b->rounds);
+	return NULL;
+}
+
+static void bench_numa(const char *filename, const BenchKey *keys, int count, int rounds) {
+	// Replicates the knowledge base to each NUMA node, then prints the lookup time from each node in its own replica and in the others.
+	if (numa_nodes() <= 1) { //nothing to compare, so the knowledge base is not read a second time.
+		printf("numa:                1 node, nothing to replicate\n");
+		return;
+	}
+	FILE *f = fopen(filename, "r");
+	kb_t *kb = f ? kb_create() : NULL;
+	int copies = kb && knowledge_read(kb, f) >= 0 ? knowledge_replicate(kb) : KB_NOMEM;
+	if (f) fclose(f);
+	HashTable **replicas = kb ? atomic_load(&kb->replicas) : NULL;
+	if (replicas == NULL) {
+		if (copies < 0) printf("numa:                could not replicate (%d)\n", copies);
+		else printf("numa:                %d nodes, nothing to replicate\n", numa_nodes());
+		kb_free(kb);
+		return;
+	}
+	int nodes = numa_nodes();
+	BenchNode *b = (BenchNode *) calloc(nodes, sizeof(BenchNode));
+	double *ns = (double *) calloc((size_t) nodes * nodes, sizeof(double));
+	pthread_t thread;
+	for (int n = 0; b != NULL && ns != NULL && n < nodes; n++) { //one node at a time, so they do not share the interconnect.
+		b[n] = (BenchNode) { replicas, nodes, n, keys, count, rounds, ns + (size_t) n * nodes };
+		if (replicas[n] == NULL || pthread_create(&thread, NULL, bench_numa_node, &b[n]) != 0) continue;
+		pthread_join(thread, NULL);
+		double remote = 0;
+		int others = 0;
+		for (int r = 0; r < nodes; r++)
+			if (r != n && b[n].ns[r] > 0) {
+				remote += b[n].ns[r];
+				others++;
+			}
+		if (b[n].ns[n] <= 0) continue;
+		char label[32];
+		snprintf(label, sizeof(label), "numa node %d:", n);
+		if (others == 0) printf("%-21slocal %.1f ns/op\n", label, b[n].ns[n]);
+		else printf("%-21slocal %.1f ns/op, remote %.1f ns/op (%.2fx)\n",
+			label, b[n].ns[n], remote / others, remote / others / b[n].ns[n]);
+	}
+	free(b);
+	free(ns);
+	kb_free(kb);
+}
+
+/*
+ * Run the benchmark.
+ *
+ * Input:
+ *   filename - the knowledge base to read
+ *
+ * Returns: the exit status of the program
+ */
+int bench_main(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "File %s not found\n", filename);
+		return 1;
+	}
+	kb_t *kb = kb_create();
+	int result = kb ? knowledge_read(kb, f) : KB_NOMEM;
+	fclose(f);
+	if (result < 0) {
+		fprintf(stderr, "Could not read %s\n", filename);
+		kb_free(kb);
+		return 1;
+	}
+
+	BenchKey *keys = (BenchKey *) malloc((kb->ht->count + 1) * sizeof(BenchKey));
+	if (keys == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		kb_free(kb);
+		return 1;
+	}
+	int count = bench_collect(kb->ht, keys);
+	int rounds = count ? BENCH_MIN_OPS / count + 1 : 0;
+	size_t raw, stored;
+
+	printf("knowledge base:      %s (%d entities)\n", filename, count);
+
+	knowledge_memory(kb, &raw, &stored);
+	double plain_get = bench_get(kb, keys, count, rounds);
+	double plain_copy = bench_decode(kb->ht, keys, count, rounds);
+	printf("plain responses:     %zu bytes, get %.1f ns/op, copy %.1f ns/op\n", stored, plain_get, plain_copy);
+
+	BenchKey *shuffled = (BenchKey *) malloc((count + 1) * sizeof(BenchKey));
+	if (shuffled != NULL) {
+		memcpy(shuffled, keys, count * sizeof(BenchKey));
+		bench_shuffle(shuffled, count);
+		double random_get = bench_get(kb, shuffled, count, rounds);
+		double random_many = bench_get_many(kb, shuffled, count, rounds);
+		printf("random order:        get %.1f ns/op, get_many %.1f ns/op (batches of %d, %.2fx)\n",
+			random_get, random_many, BENCH_BATCH, random_many > 0 ? random_get / random_many : 0.0);
+		bench_numa(filename, shuffled, count, rounds);
+		free(shuffled);
+	}
+
+	double start = bench_now();
+	if (knowledge_compress(kb, 1) != KB_OK) {
+		fprintf(stderr, "Out of memory\n");
+		free(keys);
+		kb_free(kb);
+		return 1;
+	}
+	double train = bench_now() - start;
+	knowledge_memory(kb, &raw, &stored);
+	double packed_get = bench_get(kb, keys, count, rounds);
+	double packed_decode = bench_decode(kb->ht, keys, count, rounds);
+	printf("compressed:          %zu bytes (dictionary %d bytes, trained in %.2f ms)\n",
+		stored, kb->ht->responses->dict ? kb->ht->responses->dict->len : 0, train / 1e6);
+	printf("compression ratio:   %.2f\n", stored ? (double) raw / stored : 0.0);
+	printf("compressed get:      %.1f ns/op\n", packed_get);
+	printf("decode:              %.1f ns/op (%+.1f ns/op over plain)\n", packed_decode, packed_decode - plain_copy);
+
+	free(keys);
+	kb_free(kb);
+	return 0;
+}
@@ -1,103 +1,206 @@
-/*
- * INF1002 (C Language) Group Project.
- *
- * This file contains the definitions and function prototypes for all of
- * features of the INF1002 chatbot.
- */
-
-#ifndef _CHAT1002_H
-#define _CHAT1002_H
-#define CAPACITY 1001 // Size of the Hash Table
-#include <stdio.h>
-
-/* the maximum number of characters we expect in a line of input (including the terminating null)  */
-#define MAX_INPUT    256
-
-/* the maximum number of characters allowed in the name of an intent (including the terminating null)  */
-#define MAX_INTENT   32
-
-/* the maximum number of characters allowed in the name of an entity (including the terminating null)  */
-#define MAX_ENTITY   64
-
-/* the maximum number of characters allowed in a response (including the terminating null) */
-#define MAX_RESPONSE 256
-
-/* return codes for knowledge_get() and knowledge_put() */
-#define KB_OK        0
-#define KB_NOTFOUND -1
-#define KB_INVALID  -2
-#define KB_NOMEM    -3
-
-/* Custom names for the chatbot and end user */
-#define BOT_NAME "Chatbot"
-#define USER_NAME "User"
-
-/* Delimiters for splitting input to words */
-const char *delimiters = " ?\t\n";
-
-typedef struct node_struct Node; //Create a data structure Node to store key, intent, entity, responses from user.
-struct node_struct {
-char *key; //Stores key which is used to search for a particular node.
-char *intent; //Stores intent
-char *entity; //Stores entity name
-char *responses; //Stores responses
-};
-
-typedef struct LinkedList LinkedList; //Create LinkedList data structure to handle collisions from hashtable.
-struct LinkedList {
-    Node* item; //Stores a Node pointer.
-    LinkedList* next; //Stores address of next item in the linkedlist.
-};
-
-typedef struct HashTable HashTable; //Hashtable data structure. Hashtable is a array of pointers, makes it easy to search up nodes.
-struct HashTable{
-    Node** items; //Pointer to a Node Pointer.
-    int size; //Size of the hash table.
-    int count; //Number of items in hashtable
-    LinkedList** obuckets; //Stores linkedlist in case of collision.
-};
-
-/* functions defined in main.c */
-int compare_token(const char *token1, const char *token2);
-void prompt_user(char *buf, int n, const char *format, ...);
-
-/* functions defined in chatbot.c */
-const char *chatbot_botname();
-const char *chatbot_username();
-int chatbot_main(int inc, char *inv[], char *response, int n);
-int chatbot_is_exit(const char *intent);
-int chatbot_do_exit(int inc, char *inv[], char *response, int n);
-int chatbot_is_load(const char *intent);
-int chatbot_do_load(int inc, char *inv[], char *response, int n);
-int chatbot_is_question(const char *intent);
-int chatbot_do_question(int inc, char *inv[], char *response, int n);
-int chatbot_is_reset(const char *intent);
-int chatbot_do_reset(int inc, char *inv[], char *response, int n);
-int chatbot_is_save(const char *intent);
-int chatbot_do_save(int inc, char *inv[], char *response, int n);
-
-/* functions defined in knowledge.c */
-int knowledge_get(const char *intent, const char *entity, char *response, int n);
-int knowledge_put(const char *intent, const char *entity, const char *response);
-void knowledge_reset();
-int knowledge_read(FILE *f);
-void knowledge_write(FILE *f);
-const char* intent_convert(const char *intent);
-
-/* functions defined in hashtable.c */
-unsigned int hash_function(char *key, size_t len);
-static LinkedList* allocate_memory_list ();
-static LinkedList* linkedlist_insert(LinkedList* list, Node* item);
-static void free_linkedlist(LinkedList* list);
-static LinkedList** create_overflow_buckets(HashTable* table);
-static void free_overflow_buckets(HashTable* table);
-Node* create_item(char* key, const char* intent, const char* entity, const char* responses);
-HashTable* create_table(int size);
-void free_item(Node* item);
-void free_table(HashTable* table);
-void handle_collision(HashTable* table, unsigned long index, Node* item);
-int ht_insert(HashTable* table, char* key, const char* intent, const char* entity, const char* response);
-Node* ht_search(HashTable* table, char* key);
-void ht_delete(HashTable* table, char* key);
-
-#endif
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file contains the definitions and function prototypes for all of
+ * features of the INF1002 chatbot.
+ *
+ * The chatbot is built as the library libchat1002. All of its state lives in
+ * a knowledge base context (kb_t) passed to every function, so a program may
+ * hold any number of independent knowledge bases, and different knowledge
+ * bases may be used from different threads at the same time.
+ *
+ * Knowledge bases may be layered: kb_create_layered() builds a small
+ * knowledge base on top of a shared, read only base. Lookups fall through to
+ * the base, while writes and deletions only touch the layer, so many tenants
+ * can share one copy of a large common knowledge base.
+ */
+
+#ifndef _CHAT1002_H
+#define _CHAT1002_H
+#include <stdio.h>
+
+/* the maximum number of characters we expect in a line of input (including the terminating null)  */
+#define MAX_INPUT    256
+
+/* the maximum number of characters allowed in the name of an intent (including the terminating null)  */
+#define MAX_INTENT   32
+
+/* the maximum number of characters allowed in the name of an entity (including the terminating null)  */
+#define MAX_ENTITY   64
+
+/* the maximum number of characters allowed in a response (including the terminating null) */
+#define MAX_RESPONSE 256
+
+/* return codes for knowledge_get(), knowledge_put() and the other knowledge_*() functions */
+#define KB_RUNNING   1
+#define KB_OK        0
+#define KB_NOTFOUND -1
+#define KB_INVALID  -2
+#define KB_NOMEM    -3
+#define KB_READONLY -4
+#define KB_IOERR    -5
+#define KB_CORRUPT  -6
+
+/* file formats for knowledge_import() and knowledge_export(), see kb_format() */
+#define KB_FORMAT_INI   0
+#define KB_FORMAT_CSV   1
+#define KB_FORMAT_JSONL 2
+#define KB_FORMAT_FROZEN 3 //A frozen image, read with knowledge_load_frozen(); not a format of knowledge_import() and knowledge_export().
+
+/* formats for trace_write() */
+#define TRACE_FORMAT_CHROME    0
+#define TRACE_FORMAT_HISTOGRAM 1
+
+/* an entry given to knowledge_put_batch() or knowledge_delete_batch() */
+typedef struct kb_entry {
+	const char *intent;
+	const char *entity;
+	const char *response;
+	int status;          /* set to the result of storing this entry, as knowledge_put() would return */
+} kb_entry_t;
+
+/* a question given to knowledge_get_many() */
+typedef struct kb_query {
+	const char *intent;
+	const char *entity;
+	char *response;      /* buffer to receive the response */
+	int n;               /* the size of the response buffer */
+	int status;          /* set to the result of the lookup, as knowledge_get() would return */
+} kb_query_t;
+
+/* figures reported by knowledge_stats() */
+typedef struct kb_stats {
+	long entries;          /* entries in the knowledge base's own table */
+	size_t resident_bytes; /* memory taken by the responses, and the stubs of those evicted */
+	size_t budget;         /* the limit set by knowledge_set_budget(), 0 if there is none */
+	size_t floor_bytes;    /* what the responses would take with every one evicted, the least budget accepted */
+	long spilled;          /* responses evicted to the spill file */
+	size_t spilled_bytes;  /* their size */
+	long evictions;        /* responses evicted since the knowledge base was created */
+	long refaults;         /* evicted responses brought back by lookups since then */
+	double seconds;        /* seconds since then */
+} kb_stats_t;
+
+/* Custom names for the chatbot and end user */
+#define BOT_NAME "Chatbot"
+#define USER_NAME "User"
+
+/* A knowledge base. Its contents are private to the library. */
+typedef struct kb kb_t;
+
+/* A conversation with one user, on top of a knowledge base. Its contents are private to the library. */
+typedef struct chat_session chat_session_t;
+
+/* what a session is waiting for the user to answer, see chatbot_session_pending() */
+#define CHAT_PENDING_NONE      0
+#define CHAT_PENDING_ANSWER    1
+#define CHAT_PENDING_OVERWRITE 2
+
+/* A watch that reloads a knowledge base whenever its file changes. */
+typedef struct kb_watch kb_watch_t;
+
+/* A cache of the responses to the questions a session was asked most recently, see memo.c. */
+typedef struct chat_memo chat_memo_t;
+
+/* functions defined in chatbot.c */
+int compare_token(const char *token1, const char *token2);
+const char *chatbot_botname();
+const char *chatbot_username();
+chat_session_t *chatbot_session_create(kb_t *kb);
+void chatbot_session_free(chat_session_t *session);
+int chatbot_session_pending(const chat_session_t *session);
+int chatbot_session_set_memo(chat_session_t *session, int entries);
+chat_memo_t *chatbot_session_memo(const chat_session_t *session);
+int chatbot_split(char *line, char *inv[]);
+int chatbot_handle_line(chat_session_t *session, char *line, char *response, int n);
+int chatbot_main(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_exit(const char *intent);
+int chatbot_do_exit(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_load(const char *intent);
+int chatbot_do_load(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_question(const char *intent);
+int chatbot_question_entity(int inc, char *inv[], char *entity, int n);
+int chatbot_do_question(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_reset(const char *intent);
+int chatbot_do_reset(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_save(const char *intent);
+int chatbot_do_save(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_forget(const char *intent);
+int chatbot_do_forget(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_stats(const char *intent);
+int chatbot_do_stats(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_freeze(const char *intent);
+int chatbot_do_freeze(chat_session_t *session, int inc, char *inv[], char *response, int n);
+int chatbot_is_verify(const char *intent);
+int chatbot_do_verify(chat_session_t *session, int inc, char *inv[], char *response, int n);
+
+/* functions defined in knowledge.c */
+kb_t *kb_create();
+kb_t *kb_create_layered(kb_t *base);
+void kb_free(kb_t *kb);
+int knowledge_get(kb_t *kb, const char *intent, const char *entity, char *response, int n);
+int knowledge_get_many(kb_t *kb, kb_query_t *queries, int count);
+int knowledge_put(kb_t *kb, const char *intent, const char *entity, const char *response);
+int knowledge_put_batch(kb_t *kb, kb_entry_t *entries, int count);
+int knowledge_delete(kb_t *kb, const char *intent, const char *entity);
+int knowledge_delete_batch(kb_t *kb, kb_entry_t *entries, int count);
+int knowledge_alias(kb_t *kb, const char *alias, const char *entity);
+int knowledge_unalias(kb_t *kb, const char *alias);
+void knowledge_reset(kb_t *kb);
+int knowledge_read(kb_t *kb, FILE *f);
+int knowledge_read_verified(kb_t *kb, FILE *f, int *verified);
+int knowledge_reload(kb_t *kb, FILE *f);
+int knowledge_write(kb_t *kb, FILE *f);
+int knowledge_write_delta(kb_t *kb, FILE *f);
+int knowledge_compress(kb_t *kb, int compress);
+unsigned int knowledge_generation(kb_t *kb);
+void knowledge_memory(kb_t *kb, size_t *raw_bytes, size_t *stored_bytes);
+
+/* functions defined in dump.c */
+int kb_format(const char *filename);
+int knowledge_import(kb_t *kb, FILE *f, int format);
+int knowledge_export(kb_t *kb, FILE *f, int format);
+
+/* functions defined in loaddir.c */
+int knowledge_read_dir(kb_t *kb, const char *path, int *files, int *failed, int *unverified);
+
+/* functions defined in frozen.c */
+int knowledge_freeze(kb_t *kb, FILE *f, size_t *index_bytes);
+int knowledge_load_frozen(kb_t *kb, FILE *f);
+
+/* functions defined in numa.c */
+int knowledge_replicate(kb_t *kb);
+
+/* functions defined in spill.c */
+int knowledge_set_budget(kb_t *kb, size_t bytes);
+void knowledge_stats(kb_t *kb, kb_stats_t *stats);
+
+/* functions defined in save.c */
+int knowledge_save(kb_t *kb, const char *filename, int delta);
+int knowledge_save_status(kb_t *kb, int *job, long *done, long *total);
+
+/* functions defined in trace.c */
+void trace_start();
+int trace_write(FILE *f, int format);
+void trace_free();
+
+/* functions defined in alloc.c */
+int alloc_report(FILE *f);
+int alloc_totals(int op, long *allocs, long *live_bytes);
+
+/* functions defined in memo.c */
+chat_memo_t *memo_create(int entries);
+void memo_free(chat_memo_t *memo);
+int memo_key(const char *line, char *key, int n);
+int memo_get(chat_memo_t *memo, kb_t *kb, const char *key, char *response, int n, unsigned int *generation);
+void memo_put(chat_memo_t *memo, const char *key, unsigned int generation, const char *response);
+void memo_stats(const chat_memo_t *memo, long *hits, long *misses);
+
+/* functions defined in verify.c */
+int knowledge_verify(FILE *f, long *entries, unsigned int *checksum);
+
+/* functions defined in watch.c */
+kb_watch_t *kb_watch(kb_t *kb, const char *filename);
+void kb_unwatch(kb_watch_t *watch);
+
+#endif
@@ -10,6 +10,8 @@
  * works as described here.
  *
  * Input parameters:
+ *   session  - the chat session: the knowledge base the chatbot answers from,
+ *              and what the chatbot is waiting for the user to answer, if anything
  *   inc      - the number of words in the question
  *   inv      - an array of pointers to each word in the question
  *   response - a buffer to receive the response
@@ -21,8 +23,10 @@
  *
  * If the second word may be a part of speech that makes sense for the intent.
  *    - for WHAT, WHERE and WHO, it may be "is" or "are".
- *    - for SAVE, it may be "as" or "to".
- *    - for LOAD, it may be "from".
+ *    - for SAVE and FREEZE, it may be "as" or "to".
+ *    - for LOAD, it may be "from", or "dir" to load every .ini file of a directory.
+ *    - for FORGET, it is a question word, which may be followed by "is" or "are".
+ * STATS may be followed by "alloc", for the allocations counted (see alloc.c).
  * The word is otherwise ignored and may be omitted.
  *
  * The remainder of the input (including the second word, if it is not one of the
@@ -35,15 +39,41 @@
  * The behaviour of the other functions is described individually in a comment
  * immediately before the function declaration.
  *
+ * Some intents ask the user something back: a question the chatbot cannot
+ * answer asks for the answer, and saving over an existing file asks whether
+ * to overwrite it. Nothing waits for the user to reply; the chatbot notes
+ * what it asked in the session, and chatbot_handle_line() takes the user's
+ * next line as the reply. So no function here ever blocks on input, and one
+ * program may serve any number of sessions.
+ *
  * You can rename the chatbot and the user by changing chatbot_botname() and
  * chatbot_username(), respectively. The main loop will print the strings
  * returned by these functions at the start of each line.
  */
 
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "chat1002.h"
-#include "knowledge.c" //uncomment this line if you have error.
+#include "trace.h"
+#include "alloc.h"
+
+/* Delimiters for splitting input to words */
+static const char *delimiters = " ?\t\n";
+
+/* A conversation with one user. */
+struct chat_session {
+	kb_t *kb; //The knowledge base the chatbot answers from.
+	int pending; //What the chatbot asked the user, CHAT_PENDING_NONE if nothing.
+	char intent[MAX_INTENT]; //The question the chatbot could not answer, for CHAT_PENDING_ANSWER.
+	char entity[MAX_INPUT];
+	char filename[MAX_INPUT]; //The file to overwrite, for CHAT_PENDING_OVERWRITE.
+	int delta; //Whether to save only the delta, for CHAT_PENDING_OVERWRITE.
+	chat_memo_t *memo; //Responses to the questions asked most recently, or NULL, see chatbot_session_set_memo().
+};
+
+static int chatbot_save_file(kb_t *kb, const char *filename, int delta, char *response, int n);
 
 /*
  * Get the name of the chatbot from chat1002.h
@@ -69,6 +99,200 @@ const char *chatbot_username() {
 }
 
 
+/*
+ * Start a conversation.
+ *
+ * Input:
+ *   kb - the knowledge base the chatbot answers from, which must outlive the session
+ *
+ * Returns: the session, or NULL if there was a memory allocation failure
+ */
+chat_session_t *chatbot_session_create(kb_t *kb) {
+	chat_session_t *session = (chat_session_t *) calloc(1, sizeof(chat_session_t));
+	if (session != NULL) {
+		session->kb = kb;
+		session->pending = CHAT_PENDING_NONE;
+	}
+	return session;
+}
+
+
+/*
+ * End a conversation. The knowledge base is not freed.
+ */
+void chatbot_session_free(chat_session_t *session) {
+	if (session != NULL) memo_free(session->memo);
+	free(session);
+}
+
+
+/*
+ * Keep the responses to the questions the session is asked most recently,
+ * so a question asked again is answered without looking it up, as long as
+ * the knowledge base has not changed since (see memo.c).
+ *
+ * Input:
+ *   entries - the number of responses to keep, or 0 to keep none
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+int chatbot_session_set_memo(chat_session_t *session, int entries) {
+	memo_free(session->memo);
+	session->memo = memo_create(entries);
+	return session->memo != NULL || entries <= 0 ? KB_OK : KB_NOMEM;
+}
+
+
+/*
+ * Get the memo of a session, for callers that answer its questions
+ * themselves (as batch mode does).
+ *
+ * Returns: the memo, or NULL if the session keeps no responses
+ */
+chat_memo_t *chatbot_session_memo(const chat_session_t *session) {
+	return session->memo;
+}
+
+
+/*
+ * Find out whether the chatbot is waiting for the user to answer it.
+ *
+ * Returns:
+ *   CHAT_PENDING_NONE, if the next line is handled as usual
+ *   CHAT_PENDING_ANSWER, if the next line is the answer to a question the chatbot could not answer
+ *   CHAT_PENDING_OVERWRITE, if the next line says whether to overwrite a file
+ */
+int chatbot_session_pending(const chat_session_t *session) {
+	return session->pending;
+}
+
+
+/*
+ * Split a line of input into words, removing trailing punctuation from each.
+ *
+ * Input:
+ *   line - the line, modified in place
+ *   inv  - an array of MAX_INPUT pointers to receive the words
+ *
+ * Returns: the number of words
+ */
+int chatbot_split(char *line, char *inv[]) {
+	int inc = 0;
+	char *save; //strtok_r() keeps its place here, so threads can split lines at once.
+	inv[inc] = strtok_r(line, delimiters, &save);
+	while (inv[inc] != NULL) {
+
+		/* remove trailing punctuation */
+		int len = strlen(inv[inc]);
+		while (len > 0 && ispunct(inv[inc][len - 1])) {
+			inv[inc][len - 1] = '\0';
+			len--;
+		}
+
+		/* go to the next word */
+		inc++;
+		inv[inc] = strtok_r(NULL, delimiters, &save);
+	}
+	return inc;
+}
+
+
+/*
+ * Take the user's answer to a question the chatbot could not answer.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after learning)
+ */
+static int chatbot_do_answer(chat_session_t *session, char *line, char *response, int n) {
+	char *nl = strchr(line, '\n'); //the answer is the line as typed.
+	if (nl != NULL)
+		*nl = '\0';
+	if (strlen(line) < 1) {
+		snprintf(response, n, "Invalid answer!");
+		return 0;
+	}
+	// inserts into chat bot's knowledge base (hashtable)
+	int result = knowledge_put(session->kb, session->intent, session->entity, line);
+	if (result == KB_OK) {
+		snprintf(response, n, "Thank you!");
+	} else if (result == KB_READONLY) {
+		snprintf(response, n, "My knowledge is shared and cannot be changed");
+	} else {
+		snprintf(response, n, "Out of Memory");
+	}
+	return 0;
+}
+
+
+/*
+ * Take the user's answer to whether to overwrite a file when saving.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after saving knowledge)
+ */
+static int chatbot_do_overwrite(chat_session_t *session, const char *line, char *response, int n) {
+	switch (line[strspn(line, delimiters)]) {
+		case 'N':
+		case 'n':
+			snprintf(response, n, "My knowledge is not saved as the file provided exists");
+			return 0;
+		case 'y':
+		case 'Y':
+			return chatbot_save_file(session->kb, session->filename, session->delta, response, n);
+		default:
+			snprintf(response, n, "I do not understand the response, therefore my knowledge is not saved.");
+			return 0;
+	}
+}
+
+
+/*
+ * Handle a line of input from the user. If the chatbot asked the user
+ * something, the line is the reply; else, if it is a question the session's
+ * memo holds the response to, that is the response; else it is split into
+ * words and passed to chatbot_main().
+ *
+ * Input:
+ *   session  - the chat session
+ *   line     - the line, modified in place
+ *   response - a buffer to receive the response, empty if there is nothing to say
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   0, if the chatbot should continue chatting
+ *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
+ */
+int chatbot_handle_line(chat_session_t *session, char *line, char *response, int n) {
+	int pending = session->pending;
+	session->pending = CHAT_PENDING_NONE; //whatever the line is, it settles what was asked.
+	if (pending == CHAT_PENDING_ANSWER)
+		return chatbot_do_answer(session, line, response, n);
+	if (pending == CHAT_PENDING_OVERWRITE)
+		return chatbot_do_overwrite(session, line, response, n);
+
+	char key[MAX_INPUT]; //the line reduced to the key of its response in the memo.
+	unsigned int generation = 0;
+	int memo = session->memo != NULL && memo_key(line, key, MAX_INPUT) > 0;
+	if (memo && memo_get(session->memo, session->kb, key, response, n, &generation))
+		return 0;
+
+	char *inv[MAX_INPUT];
+	TRACE_BEGIN(split);
+	int inc = chatbot_split(line, inv);
+	TRACE_END(TRACE_SPLIT, split);
+	if (inc < 1) {
+		response[0] = '\0';
+		return 0;
+	}
+	TRACE_BEGIN(dispatch);
+	int done = chatbot_main(session, inc, inv, response, n);
+	TRACE_END(TRACE_DISPATCH, dispatch);
+	if (memo && session->pending == CHAT_PENDING_NONE) //answered, rather than asking for the answer.
+		memo_put(session->memo, key, generation, response);
+	return done;
+}
+
+
 /*
  * Get a response to user input.
  *
@@ -79,26 +303,33 @@ const char *chatbot_username() {
  *   0, if the chatbot should continue chatting
  *   1, if the chatbot should stop (i.e. it detected the EXIT intent)
  */
-int chatbot_main(int inc, char *inv[], char *response, int n) {
+int chatbot_main(chat_session_t *session, int inc, char *inv[], char *response, int n) {
 
 	/* check for empty input */
 	if (inc < 1) {
-		snprintf(response, n, "");
+		response[0] = '\0';
 		return 0;
 	}
 
 	/* look for an intent and invoke the corresponding do_* function */
-	hashtable_callup();
 	if (chatbot_is_exit(inv[0]))
-		return chatbot_do_exit(inc, inv, response, n);
+		return chatbot_do_exit(session, inc, inv, response, n);
 	else if (chatbot_is_load(inv[0]))
-		return chatbot_do_load(inc, inv, response, n);
+		return chatbot_do_load(session, inc, inv, response, n);
 	else if (chatbot_is_question(inv[0]))
-		return chatbot_do_question(inc, inv, response, n);
+		return chatbot_do_question(session, inc, inv, response, n);
 	else if (chatbot_is_reset(inv[0]))
-		return chatbot_do_reset(inc, inv, response, n);
+		return chatbot_do_reset(session, inc, inv, response, n);
 	else if (chatbot_is_save(inv[0]))
-		return chatbot_do_save(inc, inv, response, n);
+		return chatbot_do_save(session, inc, inv, response, n);
+	else if (chatbot_is_forget(inv[0]))
+		return chatbot_do_forget(session, inc, inv, response, n);
+	else if (chatbot_is_stats(inv[0]))
+		return chatbot_do_stats(session, inc, inv, response, n);
+	else if (chatbot_is_freeze(inv[0]))
+		return chatbot_do_freeze(session, inc, inv, response, n);
+	else if (chatbot_is_verify(inv[0]))
+		return chatbot_do_verify(session, inc, inv, response, n);
 	else {
 		snprintf(response, n, "I don't understand \"%s\".", inv[0]);
 		return 0;
@@ -133,7 +364,7 @@ int chatbot_is_exit(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after a question)
  */
-int chatbot_do_exit(int inc, char *inv[], char *response, int n) {
+int chatbot_do_exit(chat_session_t *session, int inc, char *inv[], char *response, int n) {
 
 	snprintf(response, n, "Goodbye!");
 	return 1;
@@ -165,7 +396,8 @@ int chatbot_is_load(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after loading knowledge)
  */
-int chatbot_do_load(int inc, char *inv[], char *response, int n) {
+int chatbot_do_load(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	kb_t *kb = session->kb;
 	// checks input is less that 2 words
 	if (inc < 2) {
 		snprintf(response, n, "%s", "Please enter a valid filename!");
@@ -174,29 +406,56 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n) {
 
 	int startindex = 1;
 
-	FILE * fp;
-	char * filename = inv[startindex];
-	int inifound = 0;
-	char * checkini = strchr(filename, '.');
-	// check if word contains the "." keyword
-	if (checkini != NULL){
-		// checks if word contains the ".ini" keyword
-		if(!compare_token(checkini, ".ini")){
-			inifound = 1;
+	// "load dir PATH" reads every .ini file of the directory
+	if (inc >= 3 && compare_token(inv[startindex], "dir") == 0) {
+		int files, failed, unverified;
+		int result = knowledge_read_dir(kb, inv[startindex + 1], &files, &failed, &unverified);
+		if (result == KB_NOTFOUND){
+			snprintf(response, n, "Directory %s not found", inv[startindex + 1]);
+		} else if (result == KB_NOMEM){
+			snprintf(response, n, "Out of Memory");
+		} else if (result == KB_READONLY){
+			snprintf(response, n, "My knowledge is shared and cannot be changed");
+		} else {
+			int len = snprintf(response, n, "Read %d responses from %d files in %s", result, files, inv[startindex + 1]);
+			if (failed > 0 && len >= 0 && len < n)
+				len += snprintf(response + len, n - len, ", %d could not be read or are damaged", failed);
+			if (unverified > 0 && len >= 0 && len < n)
+				snprintf(response + len, n - len, ", %d have no checksum and are unverified", unverified);
 		}
+		return 0;
 	}
-	if (!inifound){
+
+	FILE * fp;
+	char * filename = inv[startindex];
+	// checks if the file is .ini, .csv or .jsonl
+	int format = kb_format(filename);
+	if (format < 0){
 		snprintf(response, n, "%s", "Please enter a valid filename!");
 		return 0;
 	}
+	// a frozen knowledge base is read only, it can only be a base
+	if (format == KB_FORMAT_FROZEN){
+		snprintf(response, n, "%s is frozen. Start me with --base %s to answer from it.", filename, filename);
+		return 0;
+	}
 	fp = fopen(filename, "r");
 	// checks if file exists
 	if (fp != NULL) {
-		int result = knowledge_read(fp);
+		int verified = 1; //only ini files have a checksum.
+		int result = format == KB_FORMAT_INI ? knowledge_read_verified(kb, fp, &verified) : knowledge_import(kb, fp, format);
 		fclose(fp);
 		// check if hashtable is full
 		if (result == KB_NOMEM){
 			snprintf(response, n, "Out of Memory");
+		} else if (result == KB_IOERR){
+			snprintf(response, n, "I could not read %s", filename);
+		} else if (result == KB_CORRUPT){
+			snprintf(response, n, "%s does not match its checksum, it may be damaged. I did not keep anything from it.", filename);
+		} else if (result == KB_READONLY){
+			snprintf(response, n, "My knowledge is shared and cannot be changed");
+		} else if (!verified){
+			snprintf(response, n, "Read %d responses from %s, unverified: it has no checksum for all of it.", result, filename);
 		} else {
 			snprintf(response, n, "Read %d responses from %s", result, filename);
 		}
@@ -229,6 +488,40 @@ int chatbot_is_question(const char *intent) {
 }
 
 
+/*
+ * Find the entity of a question.
+ *
+ * inv[0] contains the the question word.
+ * inv[1] may contain "is" or "are"; if so, it is skipped.
+ * The remainder of the words, separated by single spaces, form the entity.
+ *
+ * Input:
+ *   inc    - the number of words in the question
+ *   inv    - an array of pointers to each word in the question
+ *   entity - a buffer to receive the entity
+ *   n      - the size of the entity buffer
+ *
+ * Returns:
+ *   the index of the first word of the entity (1 or 2)
+ *   0, if the question has no entity
+ */
+int chatbot_question_entity(int inc, char *inv[], char *entity, int n) {
+	int startindex = 1;
+	if (inc > 1 && (compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0)) {
+		startindex = 2;
+	}
+	if (inc <= startindex) {
+		return 0;
+	}
+	int len = 0;
+	entity[0] = '\0';
+	for (int i = startindex; i < inc && len < n; i++) {
+		len += snprintf(entity + len, n - len, i == startindex ? "%s" : " %s", inv[i]);
+	}
+	return startindex;
+}
+
+
 /*
  * Answer a question.
  *
@@ -242,82 +535,36 @@ int chatbot_is_question(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after a question)
  */
-int chatbot_do_question(int inc, char *inv[], char *response, int n) {
+int chatbot_do_question(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	kb_t *kb = session->kb;
 
 	int result = 100;
 	int startindex = 1;
-	char * entity;
-	char * fillerword = calloc(1, 4);
-	entity = calloc(1, MAX_ENTITY);
-	if (entity == NULL){
-		snprintf(response, n, "Out of memory\n");
-		return 1;
-	}
-
-
-	//checks if input is more than 1 word
-	if (inc > 1) {
-		//checks if second word of input contains the keywords "is" or "are"
-		if (compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0){
-            startindex = 2;
-			//checks if input contains less than 3 words
-			if (startindex == 2 && inc < 3){
-				snprintf(response, n, "Please ask a question with an entity.");
-				free(entity);
-				free(fillerword);
-				return 0;
-			}
-			strcpy(fillerword, inv[1]);
-		} 
-		// is to get the entity
-        for(int i = startindex; i < inc; i++){
-                strcat(entity, inv[i]);
-			if (i != sizeof(inv - 1)){
-				strcat(entity, " ");
-                }
-			}
-			entity[strlen(entity)-1] = '\0';
-			result = knowledge_get(inv[0], entity, response, n);
+	char entity[MAX_INPUT]; //the entity is made of words of the input, so it is never longer than the input.
+	char fillerword[4] = "";
+
+	//the entity is the rest of the input, after "is" or "are" if present
+	startindex = chatbot_question_entity(inc, inv, entity, MAX_INPUT);
+	if (startindex > 0) {
+		if (startindex == 2) {
+			snprintf(fillerword, sizeof(fillerword), "%s", inv[1]);
 		}
-	 else {
+		result = knowledge_get(kb, inv[0], entity, response, n);
+	} else {
 		snprintf(response, n, "Please ask a question with an entity.");
 	}
 
 	if (result == KB_NOTFOUND) {
-		// Rebuild question to be displayed
-		char *entityquestion;
-		entityquestion = calloc(1, MAX_ENTITY);
-		if (entityquestion == NULL){
-			snprintf(response, n, "Out of memory\n");
-		}
-		strcpy(entityquestion, entity);
-		char ans[MAX_RESPONSE];
-		// repeats the user's questions
+		// ask the user for the answer, which comes with their next line
 		if (strlen(fillerword)){
-            prompt_user(ans, MAX_RESPONSE, "Hmm, I don't know. %s %s %s?", inv[0], fillerword, entityquestion);
+			snprintf(response, n, "Hmm, I don't know. %s %s %s?", inv[0], fillerword, entity);
 		} else {
-		    prompt_user(ans, MAX_RESPONSE, "Hmm, I don't know. %s %s?", inv[0], entityquestion);
-		}
-		if (strlen(ans) < 1){
-			snprintf(response, n, "Invalid answer!");	
-			free(entityquestion);
-			free(fillerword);
-			free(entity);
-			return 0;
+			snprintf(response, n, "Hmm, I don't know. %s %s?", inv[0], entity);
 		}
-		// inserts into chat bot's knowledge base (hashtable)
-		result = knowledge_put(inv[0], entity , ans);
-		if (result == KB_OK){
-			snprintf(response, n, "Thank you!");
-		} else if (result == KB_NOMEM) {
-			snprintf(response, n, "Out of Memory");
-		} else if (result == KB_INVALID) {
-			snprintf(response, n, "Out of Memory");
-		}
-		free(entityquestion);
-		free(fillerword);
+		session->pending = CHAT_PENDING_ANSWER;
+		snprintf(session->intent, MAX_INTENT, "%s", inv[0]);
+		snprintf(session->entity, MAX_INPUT, "%s", entity);
 	}
-	free(entity);
 	return 0;
 
 }
@@ -350,13 +597,272 @@ int chatbot_is_reset(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after beign reset)
  */
-int chatbot_do_reset(int inc, char *inv[], char *response, int n) {
-	knowledge_reset();
+int chatbot_do_reset(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	kb_t *kb = session->kb;
+	knowledge_reset(kb);
 	snprintf(response, MAX_RESPONSE, "Chatbot has been reset");
 	return 0;
 }
 
 
+/*
+ * Determine whether an intent is FORGET.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "forget"
+ *  0, otherwise
+ */
+int chatbot_is_forget(const char *intent) {
+	return compare_token(intent, "forget") == 0;
+}
+
+
+/*
+ * Forget the answer to a question, as in "forget what is SIT".
+ *
+ * inv[1] contains the question word; the rest of the words are as for
+ * chatbot_do_question().
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after forgetting)
+ */
+int chatbot_do_forget(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	kb_t *kb = session->kb;
+	char entity[MAX_INPUT];
+	int startindex = inc > 1 && chatbot_is_question(inv[1]) ? chatbot_question_entity(inc - 1, inv + 1, entity, MAX_INPUT) : 0;
+	if (startindex == 0) {
+		snprintf(response, n, "Please tell me what to forget, such as \"forget what is SIT\".");
+		return 0;
+	}
+
+	//the question as it was asked, with "is" or "are" if present
+	char question[MAX_INPUT + MAX_INTENT + 8];
+	if (startindex == 2) {
+		snprintf(question, sizeof(question), "%s %s %s", inv[1], inv[2], entity);
+	} else {
+		snprintf(question, sizeof(question), "%s %s", inv[1], entity);
+	}
+
+	switch (knowledge_delete(kb, inv[1], entity)) {
+		case KB_OK:
+			snprintf(response, n, "I have forgotten %s.", question);
+			break;
+		case KB_NOTFOUND:
+			snprintf(response, n, "I did not know %s anyway.", question);
+			break;
+		case KB_READONLY:
+			snprintf(response, n, "My knowledge is shared and cannot be changed");
+			break;
+		default:
+			snprintf(response, n, "I don't have enough memory to forget %s.", question);
+	}
+	return 0;
+}
+
+
+/*
+ * Determine whether an intent is STATS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "stats"
+ *  0, otherwise
+ */
+int chatbot_is_stats(const char *intent) {
+	return compare_token(intent, "stats") == 0;
+}
+
+
+/*
+ * Report how much memory the knowledge takes, how often responses are
+ * evicted to the spill file and brought back from it, and how many questions
+ * the session's memo answered, if it has one. "stats alloc" reports
+ * the allocations counted instead, and writes them in full to stderr.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+int chatbot_do_stats(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	if (inc > 1 && compare_token(inv[1], "alloc") == 0) {
+		long allocs, live_bytes, get_allocs, get_bytes;
+		if (alloc_totals(-1, &allocs, &live_bytes) != KB_OK) {
+			snprintf(response, n, "I was not built to count allocations.");
+			return 0;
+		}
+		alloc_totals(ALLOC_OP_GET, &get_allocs, &get_bytes);
+		alloc_report(stderr);
+		snprintf(response, n, "%ld blocks allocated, %ld bytes of them live; %ld allocated answering questions.",
+			allocs, live_bytes, get_allocs);
+		return 0;
+	}
+
+	kb_stats_t stats;
+	knowledge_stats(session->kb, &stats);
+	double seconds = stats.seconds > 1 ? stats.seconds : 1;
+	int len;
+	if (stats.budget == 0) {
+		len = snprintf(response, n, "I know %ld entries, their responses take %zu bytes.", stats.entries, stats.resident_bytes);
+	} else {
+		len = snprintf(response, n, "I know %ld entries, their responses take %zu of %zu bytes (%zu at the least); %ld (%zu bytes) are spilled to disk. "
+			"%ld evictions (%.1f/s), %ld refaults (%.1f/s).",
+			stats.entries, stats.resident_bytes, stats.budget, stats.floor_bytes, stats.spilled, stats.spilled_bytes,
+			stats.evictions, stats.evictions / seconds, stats.refaults, stats.refaults / seconds);
+	}
+	if (session->memo != NULL && len >= 0 && len < n) {
+		long hits, misses;
+		memo_stats(session->memo, &hits, &misses);
+		snprintf(response + len, n - len, " The memo answered %ld of %ld questions (%.1f%%).",
+			hits, hits + misses, hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+	}
+	return 0;
+}
+
+
+/*
+ * Determine whether an intent is FREEZE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "freeze"
+ *  0, otherwise
+ */
+int chatbot_is_freeze(const char *intent) {
+	return compare_token(intent, "freeze") == 0;
+}
+
+
+/*
+ * Freeze the chatbot's knowledge into a read only image ("freeze as
+ * FILE.kbf"), for "chatbot --base FILE.kbf" to answer from. Unlike saving,
+ * this waits for the image to be written, and overwrites the file.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after freezing)
+ */
+int chatbot_do_freeze(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	int startindex = inc > 1 && (compare_token(inv[1], "as") == 0 || compare_token(inv[1], "to") == 0) ? 2 : 1;
+	if (inc <= startindex || kb_format(inv[startindex]) != KB_FORMAT_FROZEN) {
+		snprintf(response, n, "Please give me a .kbf file to freeze my knowledge into, as in \"freeze as base.kbf\".");
+		return 0;
+	}
+	char *filename = inv[startindex];
+	FILE *f = fopen(filename, "wb");
+	size_t index_bytes = 0;
+	int result = f != NULL ? knowledge_freeze(session->kb, f, &index_bytes) : KB_IOERR;
+	if (f != NULL && fclose(f) != 0 && result >= 0) result = KB_IOERR;
+	if (result < 0 && f != NULL) remove(filename);
+	if (result == KB_NOMEM) {
+		snprintf(response, n, "I don't have enough memory to freeze my knowledge.");
+	} else if (result < 0) {
+		snprintf(response, n, "I could not write to %s", filename);
+	} else {
+		snprintf(response, n, "I froze %d entries into %s, with %.1f bits of index per entry. Start me with --base %s to answer from it.",
+			result, filename, result > 0 ? index_bytes * 8.0 / result : 0.0, filename);
+	}
+	return 0;
+}
+
+
+/*
+ * Determine whether an intent is VERIFY.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "verify"
+ *  0, otherwise
+ */
+int chatbot_is_verify(const char *intent) {
+	return compare_token(intent, "verify") == 0;
+}
+
+
+/*
+ * Check a saved ini file against the checksum it ends with ("verify FILE"),
+ * without loading it, so a large file can be checked before it is shipped.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after verifying)
+ */
+int chatbot_do_verify(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	if (inc < 2 || kb_format(inv[1]) != KB_FORMAT_INI) {
+		snprintf(response, n, "Please give me a .ini file to verify, as in \"verify base.ini\".");
+		return 0;
+	}
+	char *filename = inv[1];
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		snprintf(response, n, "File %s not found", filename);
+		return 0;
+	}
+	long entries;
+	unsigned int checksum;
+	int result = knowledge_verify(f, &entries, &checksum);
+	fclose(f);
+	if (result == KB_OK) {
+		snprintf(response, n, "%s is intact: %ld lines, CRC-32 %08x.", filename, entries, checksum);
+	} else if (result == KB_NOTFOUND) {
+		snprintf(response, n, "%s has no checksum for all of its %ld lines, so I cannot tell whether it is whole (CRC-32 %08x).", filename, entries, checksum);
+	} else if (result == KB_CORRUPT) {
+		snprintf(response, n, "%s is damaged: it does not match its checksum.", filename);
+	} else if (result == KB_NOMEM) {
+		snprintf(response, n, "Out of Memory");
+	} else {
+		snprintf(response, n, "I could not read %s", filename);
+	}
+	return 0;
+}
+
+
+/*
+ * Report how the latest background save is going ("save status").
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting)
+ */
+static int chatbot_do_save_status(kb_t *kb, char *response, int n) {
+	int job = 0;
+	long done, total;
+	switch (knowledge_save_status(kb, &job, &done, &total)) {
+		case KB_RUNNING:
+			snprintf(response, n, "Save %d is running, %ld of at most %ld entries written.", job, done, total);
+			break;
+		case KB_OK:
+			snprintf(response, n, "Save %d is done, %ld entries written.", job, done);
+			break;
+		case KB_IOERR:
+			snprintf(response, n, "Save %d failed, the file was not changed.", job);
+			break;
+		case KB_NOMEM:
+			snprintf(response, n, "Save %d ran out of memory, the file was not changed.", job);
+			break;
+		default:
+			snprintf(response, n, "I have not saved anything yet.");
+	}
+	return 0;
+}
+
+
 /*
  * Determine whether an intent is SAVE.
  *
@@ -381,23 +887,34 @@ int chatbot_is_save(const char *intent) {
  * Returns:
  *   0 (the chatbot always continues chatting after saving knowledge)
  */
-int chatbot_do_save(int inc, char *inv[], char *response, int n) {
+int chatbot_do_save(chat_session_t *session, int inc, char *inv[], char *response, int n) {
+	kb_t *kb = session->kb;
 	//checks the input if is has less than 2 words
 	if (inc < 2) {
 		snprintf(response, n, "%s", "Please enter a valid filename!");
 		return 0;
 	}
+	//"save status" reports how the latest save is going
+	if (inc == 2 && compare_token(inv[1], "status") == 0) {
+		return chatbot_do_save_status(kb, response, n);
+	}
 	int startindex = 1;
+	int delta = 0;
+	//"save delta as" only saves what this knowledge base changes from its base
+	if (compare_token(inv[1], "delta") == 0) {
+		delta = 1;
+		startindex = 2;
+	}
 	//checks the second item of the input if it contains the "as" keyword
-	if (compare_token(inv[1], "as") != 0 && compare_token(inv[1], "to") != 0){
+	if (inc <= startindex || (compare_token(inv[startindex], "as") != 0 && compare_token(inv[startindex], "to") != 0)){
 		snprintf(response, n, "%s", "Please enter a valid filename!");
 		return 0;
 	} else {
-		startindex = 2;
+		startindex++;
 	}
 
 	//checks the input if it contains the keyword "as" and if the amount of words in the input in less than 3
-	if (startindex == 2 && inc < 3) {
+	if (inc <= startindex) {
 		snprintf(response, n, "%s", "Please enter a valid filename!");
 		return 0;
 	}
@@ -409,51 +926,91 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n) {
 		return 0;
 	}
 
-	//checks if filename contains the keyword ".ini"
-	int inifound = 0;
-	char * checkini = strchr(filename, '.');
-	if (checkini != NULL){
-		if(!compare_token(checkini, ".ini")){
-			inifound = 1;
-		}
-	}
-
-	//as above
-	if (!inifound){
+	//checks if the file is .ini, .csv or .jsonl
+	if (kb_format(filename) < 0){
 		snprintf(response, n, "%s", "Please enter a valid filename!");
 		return 0;
 	}
+	if (kb_format(filename) == KB_FORMAT_FROZEN){
+		snprintf(response, n, "Ask me to \"freeze as %s\" to write a frozen knowledge base.", filename);
+		return 0;
+	}
 
 	FILE * file;
 	file = fopen(filename, "r");
 	//checks if file exists
 	if (file != NULL) {
-		char ans[3];
-		//asks user if he/she wants to overwrite the file
-		prompt_user(ans, 3, "%s is present. Do you want to overwrite it? [Y/N]", filename);
 		fclose(file);
+		//asks user if he/she wants to overwrite the file, the answer comes with their next line
+		snprintf(response, n, "%s is present. Do you want to overwrite it? [Y/N]", filename);
+		session->pending = CHAT_PENDING_OVERWRITE;
+		snprintf(session->filename, MAX_INPUT, "%s", filename);
+		session->delta = delta;
+		return 0;
+	}
+	return chatbot_save_file(kb, filename, delta, response, n);
 
-		switch (ans[0]) {
-			case 'N':
-			case 'n':
-				snprintf(response, n, "My knowledge is not saved as the file provided exists");
-				return 0;
-			case 'y':
-			case 'Y':
-				break;
-			default:
-				snprintf(response, n, "I do not understand the response, therefore my knowledge is not saved.");
-				return 0;
+}
 
-		}
+
+/*
+ * Start saving the knowledge to a file, and say so.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   filename - the file
+ *   delta    - 1 to save only what differs from the shared base
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after saving knowledge)
+ */
+static int chatbot_save_file(kb_t *kb, const char *filename, int delta, char *response, int n) {
+	//saves a snapshot of the knowledge base in the background, in the format of the file
+	int job = knowledge_save(kb, filename, delta);
+	if (job == KB_NOMEM) {
+		snprintf(response, n, "I don't have enough memory to save my knowledge.");
+		return 0;
 	}
-	//creates / overwrites the knowledge base (.ini)
-	file = fopen(filename, "w");
-	knowledge_write(file);
-	fclose(file);
-	
-	snprintf(response, n, "My knowledge has been saved to %s", filename);
+	if (job < 0) {
+		snprintf(response, n, "I could not write to %s", filename);
+		return 0;
+	}
+
+	snprintf(response, n, "I am saving my knowledge to %s (save %d). Ask \"save status\" to see how it goes.", filename, job);
 
 	return 0;
 
 }
+
+
+/*
+ * Utility function for comparing string case-insensitively.
+ *
+ * Input:
+ *   token1 - the first token
+ *   token2 - the second token
+ *
+ * Returns:
+ *   as strcmp()
+ */
+int compare_token(const char *token1, const char *token2) {
+
+	int i = 0;
+	while (token1[i] != '\0' && token2[i] != '\0') {
+		if (toupper(token1[i]) < toupper(token2[i]))
+			return -1;
+		else if (toupper(token1[i]) > toupper(token2[i]))
+			return 1;
+		i++;
+	}
+
+	if (token1[i] == '\0' && token2[i] == '\0')
+		return 0;
+	else if (token1[i] == '\0')
+		return -1;
+	else
+		return 1;
+
+}
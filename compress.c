@@ -0,0 +1,337 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the optional compression of stored responses.
+ *
+ * Responses are compressed one at a time as small blocks, using a shared
+ * dictionary trained from the responses of the knowledge base. The block
+ * format is a simple LZ77 variant (in the style of LZ4): each sequence is a
+ * token byte holding the literal length and match length, the literals, then
+ * a 2 byte offset pointing back into the dictionary or the output decoded so
+ * far. Decoding only copies bytes, so it is cheap enough to run on every
+ * knowledge_get() hit.
+ *
+ * dict_train() builds a dictionary from the responses.
+ * dict_compress() compresses a response using the dictionary.
+ * dict_decompress() decompresses a response using the dictionary.
+ * dict_load() rebuilds a dictionary from its bytes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "alloc.h"
+
+#define DICT_KMER      8     //Length of the substrings counted when training.
+#define DICT_SEGMENT   48    //Length of the segments copied into the dictionary.
+#define DICT_KMER_BITS 16    //Size of the table used to count substrings.
+#define LZ_HASH_BITS   12    //Size of the hash table used to find matches.
+#define LZ_MIN_MATCH   4     //Shortest match worth encoding.
+#define LZ_MAX_OFFSET  65535 //Furthest a match can point back.
+#define LZ_MAX_DEPTH   32    //Number of candidates checked for each position.
+#define LZ_STACK_PREV  1024  //Responses up to this long are compressed without allocating.
+
+static unsigned int lz_hash(const char *p) {
+    // Hashes the 4 bytes at p, used to find earlier occurrences of them.
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned int kmer_hash(const char *p) {
+    // Hashes the DICT_KMER bytes at p into the table used to count them.
+    return hash_function((char*) p, DICT_KMER) & ((1u << DICT_KMER_BITS) - 1);
+}
+
+typedef struct Segment Segment; //A candidate piece of a response to be copied into the dictionary.
+struct Segment {
+    const char *text; //Start of the segment.
+    int len; //Length of the segment.
+    unsigned int score; //How often its substrings appear in other responses.
+};
+
+static int compare_segment(const void *a, const void *b) {
+    // Sorts segments from the highest score to the lowest.
+    unsigned int sa = ((const Segment*) a)->score, sb = ((const Segment*) b)->score;
+    return (sa < sb) - (sa > sb);
+}
+
+static unsigned int score_segment(const unsigned int *counts, const char *text, int len) {
+    // Scores a segment by how many times its substrings repeat across responses.
+    unsigned int score = 0;
+    for (int i = 0; i + DICT_KMER <= len; i++) {
+        unsigned int c = counts[kmer_hash(text + i)];
+        if (c > 1) score += c - 1;
+    }
+    return score;
+}
+
+static void dict_index(Dictionary *dict) {
+    // Builds the match finder chains over the dictionary, so compressing a response does not have to.
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++) dict->head[i] = -1;
+    for (int i = 0; i + LZ_MIN_MATCH <= dict->len; i++) {
+        unsigned int h = lz_hash(dict->data + i);
+        dict->prev[i] = dict->head[h];
+        dict->head[h] = i;
+    }
+}
+
+Dictionary *dict_train(const char **texts, const size_t *lens, int count, int size) {
+    /*Trains a dictionary of at most size bytes from count responses.
+
+    Every substring of DICT_KMER bytes is counted once per response it appears in. Segments of each response are then
+    scored by how common their substrings are, and the best segments are copied into the dictionary, most common last
+    so the shortest offsets point at them. Substrings already covered by the dictionary stop counting, so it does not
+    fill up with copies of the same boilerplate.
+
+    Returns NULL if out of memory or if the responses share nothing worth putting in a dictionary.*/
+    if (size > LZ_MAX_OFFSET) size = LZ_MAX_OFFSET;
+    unsigned int *counts = (unsigned int*) calloc (1u << DICT_KMER_BITS, sizeof(unsigned int));
+    unsigned int *seen = (unsigned int*) calloc (1u << DICT_KMER_BITS, sizeof(unsigned int)); //Last response that counted each substring.
+    int nsegments = 0, capacity = 1024;
+    Segment *segments = (Segment*) malloc (capacity * sizeof(Segment));
+    if (counts == NULL || seen == NULL || segments == NULL) {
+        free(counts);
+        free(seen);
+        free(segments);
+        return NULL;
+    }
+
+    for (int t = 0; t < count; t++) {
+        for (size_t i = 0; i + DICT_KMER <= lens[t]; i++) {
+            unsigned int h = kmer_hash(texts[t] + i);
+            if (seen[h] == (unsigned int) t + 1) continue; //Count each substring once per response.
+            seen[h] = t + 1;
+            counts[h]++;
+        }
+    }
+
+    for (int t = 0; t < count; t++) {
+        /*Split each response into overlapping segments and keep those worth anything.*/
+        for (size_t i = 0; i + DICT_KMER <= lens[t]; i += DICT_SEGMENT / 2) {
+            int len = lens[t] - i < DICT_SEGMENT ? (int) (lens[t] - i) : DICT_SEGMENT;
+            unsigned int score = score_segment(counts, texts[t] + i, len);
+            if (score == 0) continue;
+            if (nsegments == capacity) {
+                Segment *grown = (Segment*) realloc (segments, 2 * capacity * sizeof(Segment));
+                if (grown == NULL) break;
+                segments = grown;
+                capacity *= 2;
+            }
+            segments[nsegments].text = texts[t] + i;
+            segments[nsegments].len = len;
+            segments[nsegments].score = score;
+            nsegments++;
+        }
+    }
+    qsort(segments, nsegments, sizeof(Segment), compare_segment);
+
+    char *data = (char*) malloc (size);
+    int used = 0;
+    for (int i = 0; data != NULL && i < nsegments && used < size; i++) {
+        /*Rescore with the counts left after earlier picks, skipping segments that are already covered.*/
+        int len = segments[i].len;
+        if (len > size - used) len = size - used;
+        if (len < DICT_KMER || score_segment(counts, segments[i].text, len) == 0) continue;
+        for (int k = 0; k + DICT_KMER <= len; k++) counts[kmer_hash(segments[i].text + k)] = 0;
+        used += len;
+        memcpy(data + size - used, segments[i].text, len); //Fill from the back, most common segments end up last.
+    }
+    free(counts);
+    free(seen);
+    free(segments);
+
+    if (data == NULL || used == 0) {
+        free(data);
+        return NULL;
+    }
+    Dictionary *dict = (Dictionary*) malloc (sizeof(Dictionary));
+    if (dict == NULL) {
+        free(data);
+        return NULL;
+    }
+    memmove(data, data + size - used, used); //Move the used part to the start of the buffer.
+    dict->data = data;
+    dict->len = used;
+    dict->head = (int*) malloc ((1 << LZ_HASH_BITS) * sizeof(int));
+    dict->prev = (int*) malloc (used * sizeof(int));
+    if (dict->head == NULL || dict->prev == NULL) {
+        free_dictionary(dict);
+        return NULL;
+    }
+    dict_index(dict);
+    return dict;
+}
+
+Dictionary *dict_load(const char *data, int len) {
+    /*Builds a dictionary from the bytes of one trained earlier, as kept in a frozen image (see frozen.c).
+    Returns NULL if out of memory.*/
+    Dictionary *dict = (Dictionary*) calloc (1, sizeof(Dictionary));
+    if (dict == NULL) return NULL;
+    dict->data = (char*) malloc (len);
+    dict->len = len;
+    dict->head = (int*) malloc ((1 << LZ_HASH_BITS) * sizeof(int));
+    dict->prev = (int*) malloc (len * sizeof(int));
+    if (dict->data == NULL || dict->head == NULL || dict->prev == NULL) {
+        free_dictionary(dict);
+        return NULL;
+    }
+    memcpy(dict->data, data, len);
+    dict_index(dict);
+    return dict;
+}
+
+void free_dictionary(Dictionary *dict) {
+    // Frees a dictionary returned by dict_train().
+    if (dict == NULL) return;
+    free(dict->data);
+    free(dict->head);
+    free(dict->prev);
+    free(dict);
+}
+
+static char *lz_put_length(char *op, size_t len) {
+    // Writes the part of a length that did not fit in its 4 bits of the token.
+    while (len >= 255) {
+        *op++ = (char) 255;
+        len -= 255;
+    }
+    *op++ = (char) len;
+    return op;
+}
+
+static char *lz_put_sequence(char *op, const char *literals, size_t nliterals, size_t offset, size_t mlen) {
+    // Writes one sequence: token, literals, and the match if mlen is not 0.
+    size_t m = mlen ? mlen - LZ_MIN_MATCH : 0;
+    *op++ = (char) (((nliterals < 15 ? nliterals : 15) << 4) | (m < 15 ? m : 15));
+    if (nliterals >= 15) op = lz_put_length(op, nliterals - 15);
+    memcpy(op, literals, nliterals);
+    op += nliterals;
+    if (mlen == 0) return op;
+    *op++ = (char) (offset & 0xff);
+    *op++ = (char) (offset >> 8);
+    if (m >= 15) op = lz_put_length(op, m - 15);
+    return op;
+}
+
+size_t dict_compress_bound(size_t len) {
+    // Largest possible size of len bytes after compression.
+    return len + len / 255 + 16;
+}
+
+static size_t lz_match(const Dictionary *dict, size_t dlen, const char *src, size_t end, size_t cand, size_t pos) {
+    /*Length of the match between position cand and position pos of the dictionary followed by src, pos being in src.
+    A match starting in the dictionary may run on into src.*/
+    size_t l = 0;
+    if (cand < dlen) {
+        const char *d = dict->data + cand, *p = src + (pos - dlen);
+        size_t limit = dlen - cand < end - pos ? dlen - cand : end - pos;
+        while (l < limit && d[l] == p[l]) l++;
+        if (l < dlen - cand) return l;
+    }
+    while (pos + l < end && src[cand + l - dlen] == src[pos + l - dlen]) l++;
+    return l;
+}
+
+size_t dict_compress(const Dictionary *dict, const char *src, size_t len, char *dst) {
+    /*Compresses len bytes of src into dst, which must hold dict_compress_bound(len) bytes.
+    The dictionary and src are treated as one buffer, so matches may point into either. Positions in src are
+    chained in tables of their own, which fall through to the chains dict_index() built over the dictionary,
+    so the dictionary is searched where it is rather than copied for every response.
+    Returns the compressed size, or 0 if out of memory.*/
+    size_t dlen = dict ? dict->len : 0;
+    int stack_prev[LZ_STACK_PREV];
+    int *prev = len <= LZ_STACK_PREV ? stack_prev : (int*) malloc (len * sizeof(int)); //Chains of the positions in src.
+    int head[1 << LZ_HASH_BITS]; //Latest position in src for each hash, where set is marked.
+    unsigned char set[(1 << LZ_HASH_BITS) / 8];
+    if (prev == NULL) return 0;
+    memset(set, 0, sizeof(set));
+
+    size_t end = dlen + len, pos = dlen, anchor = dlen;
+    char *op = dst;
+    while (pos + LZ_MIN_MATCH <= end) {
+        unsigned int h = lz_hash(src + pos - dlen);
+        int first = set[h >> 3] & (1 << (h & 7)) ? head[h] : dlen ? dict->head[h] : -1;
+        size_t best = 0, best_offset = 0;
+        int depth = 0;
+        for (int cand = first; cand >= 0 && depth < LZ_MAX_DEPTH; cand = (size_t) cand >= dlen ? prev[cand - dlen] : dict->prev[cand], depth++) {
+            if (pos - cand > LZ_MAX_OFFSET) break;
+            size_t l = lz_match(dict, dlen, src, end, cand, pos);
+            if (l > best) {
+                best = l;
+                best_offset = pos - cand;
+            }
+        }
+        prev[pos - dlen] = first;
+        head[h] = pos;
+        set[h >> 3] |= 1 << (h & 7);
+        if (best < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        op = lz_put_sequence(op, src + anchor - dlen, pos - anchor, best_offset, best);
+        for (size_t i = pos + 1; i < pos + best && i + LZ_MIN_MATCH <= end; i++) { //Index the matched bytes for later matches.
+            unsigned int hi = lz_hash(src + i - dlen);
+            prev[i - dlen] = set[hi >> 3] & (1 << (hi & 7)) ? head[hi] : dlen ? dict->head[hi] : -1;
+            head[hi] = i;
+            set[hi >> 3] |= 1 << (hi & 7);
+        }
+        pos += best;
+        anchor = pos;
+    }
+    op = lz_put_sequence(op, src + anchor - dlen, end - anchor, 0, 0); //The last sequence only has literals.
+    if (prev != stack_prev) free(prev);
+    return op - dst;
+}
+
+static size_t lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t len) {
+    // Reads the rest of a length whose 4 bits in the token were all set.
+    if (len != 15) return len;
+    unsigned char b;
+    do {
+        if (*ip >= iend) break;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+size_t dict_decompress(const Dictionary *dict, const char *src, size_t len, char *dst, size_t n) {
+    /*Decompresses len bytes of src into dst, writing at most n bytes.
+    Decoding stops as soon as dst is full, so a short buffer only costs what it receives.
+    Returns the number of bytes written.*/
+    const unsigned char *ip = (const unsigned char*) src, *iend = ip + len;
+    size_t dlen = dict ? dict->len : 0;
+    size_t out = 0;
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t nliterals = lz_get_length(&ip, iend, token >> 4);
+        if (nliterals > (size_t) (iend - ip)) nliterals = iend - ip;
+        size_t copy = nliterals < n - out ? nliterals : n - out;
+        memcpy(dst + out, ip, copy);
+        out += copy;
+        ip += nliterals;
+        if (ip + 2 > iend || out == n) break;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = lz_get_length(&ip, iend, token & 15) + LZ_MIN_MATCH;
+        if (offset == 0 || offset > dlen + out) break; //Corrupt input.
+        if (mlen > n - out) mlen = n - out;
+        size_t from = dlen + out - offset; //Position in dictionary followed by output.
+        if (from < dlen) { //Copy the part of the match that lies in the dictionary.
+            size_t copy = dlen - from < mlen ? dlen - from : mlen;
+            memcpy(dst + out, dict->data + from, copy);
+            out += copy;
+            from += copy;
+            mlen -= copy;
+        }
+        if (mlen > 0 && out - (from - dlen) >= mlen) { //The rest lies in the output and does not overlap it.
+            memcpy(dst + out, dst + from - dlen, mlen);
+            out += mlen;
+        } else {
+            for (size_t i = 0; i < mlen; i++) //Byte by byte, since the match repeats its own output.
+                dst[out++] = dst[from++ - dlen];
+        }
+    }
+    return out;
+}
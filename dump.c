@@ -0,0 +1,552 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements importing and exporting knowledge as CSV and JSON Lines.
+ *
+ * A CSV file has one entry per row: intent,entity,response. Fields holding a
+ * comma, a quote or a line break are put in quotes, with each quote inside
+ * them doubled, as in RFC 4180. A first row of intent,entity,response is a
+ * header and is skipped. A JSON Lines file has one object per line, with the
+ * string members "intent", "entity" and "response"; other members are
+ * ignored. Rows that cannot be parsed are skipped, as knowledge_read() skips
+ * lines without an '='.
+ *
+ * knowledge_import() reads the file DUMP_CHUNK bytes at a time and parses each
+ * record in one pass, decoding its fields into a second buffer of the same
+ * size, which the entries point into until they are stored with
+ * knowledge_put_batch() at most DUMP_BATCH at a time. Memory use therefore
+ * does not grow with the file, only with its longest record. A record cut off
+ * by the end of a chunk is parsed again once the rest of it has been read.
+ *
+ * knowledge_export() writes each row as kb_write() walks the table, so
+ * nothing is gathered before it is written either.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knowledge.h"
+#include "alloc.h"
+
+#define DUMP_ROW   1 //A record with all its fields was parsed.
+#define DUMP_SKIP  0 //A blank or invalid record was passed over.
+#define DUMP_MORE -1 //The record goes on past the data read so far.
+
+#define DUMP_SLACK 16 //Extra bytes of decoded fields, for the terminator of a last record without a line break.
+#define DUMP_JSON_OVERHEAD 40 //Bytes of a JSON Lines row besides what a CSV row has, used to presize the table.
+
+typedef struct DumpReader DumpReader; //The state of an import.
+struct DumpReader {
+	FILE *f;
+	char *buf; //The data read from the file.
+	size_t size; //The size of buf; out is DUMP_SLACK bytes larger.
+	size_t len; //Bytes of buf holding data.
+	size_t pos; //Where the next record starts in buf.
+	int eof; //Set once the rest of the file is in buf.
+	char *out; //The decoded fields of the entries waiting. Fields never take more room than the records they come from.
+	size_t used; //Bytes of out in use.
+	int count; //Number of entries waiting.
+	kb_entry_t entries[DUMP_BATCH];
+};
+
+
+/*
+ * Find the format of a knowledge file from its extension, in any case.
+ *
+ * Input:
+ *   filename - the name of the file
+ *
+ * Returns:
+ *   KB_FORMAT_INI, KB_FORMAT_CSV or KB_FORMAT_JSONL, for a name ending in .ini, .csv or .jsonl
+ *   KB_FORMAT_FROZEN, for a name ending in .kbf (see knowledge_freeze())
+ *   KB_INVALID, for any other name
+ */
+int kb_format(const char *filename) {
+	const char *dot = strrchr(filename, '.');
+	if (dot == NULL) return KB_INVALID;
+	if (compare_token(dot, ".ini") == 0) return KB_FORMAT_INI;
+	if (compare_token(dot, ".csv") == 0) return KB_FORMAT_CSV;
+	if (compare_token(dot, ".jsonl") == 0) return KB_FORMAT_JSONL;
+	if (compare_token(dot, ".kbf") == 0) return KB_FORMAT_FROZEN;
+	return KB_INVALID;
+}
+
+
+/*
+ * Parse a CSV record.
+ *
+ * Input:
+ *   r - the import, whose record at pos is parsed
+ *
+ * Output:
+ *   fields - the intent, the entity and the response, decoded into out
+ *
+ * Returns: DUMP_ROW, DUMP_SKIP if the record is blank or has other than three fields, or DUMP_MORE
+ */
+static int dump_csv_record(DumpReader *r, char *fields[3]) {
+	const char *p = r->buf + r->pos;
+	const char *end = r->buf + r->len;
+	char *o = r->out + r->used;
+	int count = 0;
+	for (;;) {
+		char *field = o;
+		if (p < end && *p == '"') { //a quoted field, up to a quote that is not doubled.
+			p++;
+			for (;;) {
+				const char *quote = memchr(p, '"', end - p);
+				if (quote == NULL && !r->eof) return DUMP_MORE;
+				if (quote == NULL) quote = end; //an unterminated quote runs to the end of the file.
+				memcpy(o, p, quote - p);
+				o += quote - p;
+				p = quote < end ? quote + 1 : end;
+				if (p == end && !r->eof) return DUMP_MORE; //the quote may be doubled in the next chunk.
+				if (p == end || *p != '"') break;
+				*o++ = '"';
+				p++;
+			}
+		}
+		while (p < end && *p != ',' && *p != '\n') *o++ = *p++; //an unquoted field, or anything after the closing quote.
+		if (p == end && !r->eof) return DUMP_MORE;
+		int last = p == end || *p == '\n';
+		if (last && o > field && p[-1] == '\r') o--; //the line ends with \r\n.
+		*o++ = '\0';
+		if (count < 3) fields[count] = field;
+		count++;
+		if (p < end) p++; //past the comma or line break.
+		if (last) break;
+	}
+	r->pos = p - r->buf;
+	if (count != 3) return DUMP_SKIP;
+	r->used = o - r->out;
+	return DUMP_ROW;
+}
+
+
+/*
+ * Skip JSON whitespace.
+ *
+ * Returns: the first other character, or end
+ */
+static const char *dump_json_space(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	return p;
+}
+
+
+/*
+ * Read the four hex digits of a \u escape.
+ *
+ * Returns: their value, or -1 if they are not four hex digits
+ */
+static long dump_json_hex(const char *p, const char *end) {
+	if (end - p < 4) return -1;
+	long value = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+		if (digit < 0) return -1;
+		value = value * 16 + digit;
+	}
+	return value;
+}
+
+
+/*
+ * Decode a JSON string, without its quotes, to UTF-8. The decoded string and
+ * its terminator are never longer than the JSON string with its quotes.
+ *
+ * Input:
+ *   p   - the opening quote, advanced past the closing quote
+ *   end - the end of the line
+ *   o   - where the decoded string goes, advanced past its terminator
+ *
+ * Returns: 0, or -1 if the string is invalid or holds \u0000
+ */
+static int dump_json_string(const char **p, const char *end, char **o) {
+	const char *in = *p + 1;
+	char *out = *o;
+	while (in < end && *in != '"') {
+		unsigned char c = (unsigned char) *in++;
+		if (c != '\\') {
+			if (c < 0x20) return -1; //control characters must be escaped.
+			*out++ = (char) c;
+			continue;
+		}
+		if (in == end) return -1;
+		long code;
+		switch (*in++) {
+			case '"': *out++ = '"'; break;
+			case '\\': *out++ = '\\'; break;
+			case '/': *out++ = '/'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u':
+				code = dump_json_hex(in, end);
+				in += 4;
+				if (code >= 0xD800 && code < 0xDC00) { //a high surrogate, which the low one must follow.
+					long low = end - in >= 6 && in[0] == '\\' && in[1] == 'u' ? dump_json_hex(in + 2, end) : -1;
+					if (low < 0xDC00 || low > 0xDFFF) return -1;
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					in += 6;
+				} else if (code <= 0 || (code >= 0xDC00 && code < 0xE000)) {
+					return -1;
+				}
+				if (code < 0x80) {
+					*out++ = (char) code;
+				} else if (code < 0x800) {
+					*out++ = (char) (0xC0 | code >> 6);
+					*out++ = (char) (0x80 | (code & 0x3F));
+				} else if (code < 0x10000) {
+					*out++ = (char) (0xE0 | code >> 12);
+					*out++ = (char) (0x80 | ((code >> 6) & 0x3F));
+					*out++ = (char) (0x80 | (code & 0x3F));
+				} else {
+					*out++ = (char) (0xF0 | code >> 18);
+					*out++ = (char) (0x80 | ((code >> 12) & 0x3F));
+					*out++ = (char) (0x80 | ((code >> 6) & 0x3F));
+					*out++ = (char) (0x80 | (code & 0x3F));
+				}
+				break;
+			default: return -1;
+		}
+	}
+	if (in == end) return -1;
+	*out++ = '\0';
+	*p = in + 1;
+	*o = out;
+	return 0;
+}
+
+
+/*
+ * Skip a JSON value that is not kept, which may hold objects and arrays.
+ *
+ * Returns: the character after the value, or NULL if it does not end on this line
+ */
+static const char *dump_json_skip(const char *p, const char *end) {
+	int depth = 0;
+	while (p < end) {
+		if (*p == '"') {
+			for (p++; p < end && *p != '"'; p++)
+				if (*p == '\\' && p + 1 < end) p++;
+			if (p == end) return NULL;
+		} else if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']' || *p == ',') {
+			if (depth == 0) return p;
+			if (*p != ',') depth--;
+		}
+		p++;
+	}
+	return depth == 0 ? p : NULL;
+}
+
+
+/*
+ * Parse a JSON Lines record.
+ *
+ * Input:
+ *   r - the import, whose record at pos is parsed
+ *
+ * Output:
+ *   fields - the intent, the entity and the response, decoded into out
+ *
+ * Returns: DUMP_ROW, DUMP_SKIP if the line is blank or is not an object with the three members, or DUMP_MORE
+ */
+static int dump_json_record(DumpReader *r, char *fields[3]) {
+	static const char *members[3] = { "intent", "entity", "response" };
+	const char *p = r->buf + r->pos;
+	const char *end = r->buf + r->len;
+	const char *eol = memchr(p, '\n', end - p); //JSON strings cannot hold a raw line break, so the record is the line.
+	if (eol == NULL && !r->eof) return DUMP_MORE;
+	if (eol == NULL) eol = end;
+	r->pos = eol < end ? eol + 1 - r->buf : r->len;
+
+	char *o = r->out + r->used;
+	fields[0] = fields[1] = fields[2] = NULL;
+	p = dump_json_space(p, eol);
+	if (p == eol || *p++ != '{') return DUMP_SKIP;
+	p = dump_json_space(p, eol);
+	if (p < eol && *p == '}') return DUMP_SKIP;
+	for (;;) {
+		/* a member: its name, then its value */
+		if (p == eol || *p != '"') return DUMP_SKIP;
+		char *name = o;
+		if (dump_json_string(&p, eol, &o) < 0) return DUMP_SKIP;
+		int member = 0;
+		while (member < 3 && strcmp(name, members[member]) != 0) member++;
+		o = name; //the name is not kept.
+		p = dump_json_space(p, eol);
+		if (p == eol || *p++ != ':') return DUMP_SKIP;
+		p = dump_json_space(p, eol);
+		if (member < 3) {
+			fields[member] = o;
+			if (p == eol || *p != '"' || dump_json_string(&p, eol, &o) < 0) return DUMP_SKIP;
+		} else if ((p = dump_json_skip(p, eol)) == NULL) {
+			return DUMP_SKIP;
+		}
+		p = dump_json_space(p, eol);
+		if (p == eol) return DUMP_SKIP;
+		if (*p == '}') break;
+		if (*p++ != ',') return DUMP_SKIP;
+		p = dump_json_space(p, eol);
+	}
+	if (dump_json_space(p + 1, eol) != eol || fields[0] == NULL || fields[1] == NULL || fields[2] == NULL) return DUMP_SKIP;
+	r->used = o - r->out;
+	return DUMP_ROW;
+}
+
+
+/*
+ * Store the entries waiting, and empty the buffer of decoded fields.
+ *
+ * Returns: the number of entries stored, or KB_NOMEM or KB_READONLY if they could not be
+ */
+static int dump_flush(kb_t *kb, DumpReader *r) {
+	int count = r->count;
+	r->count = 0;
+	r->used = 0;
+	if (count == 0) return 0;
+	int stored = knowledge_put_batch(kb, r->entries, count);
+	for (int i = 0; stored >= 0 && i < count; i++)
+		if (r->entries[i].status == KB_NOMEM) stored = KB_NOMEM; //entries with an unknown intent are skipped, not errors.
+	return stored;
+}
+
+
+/*
+ * Read the next chunk of the file after the record being parsed, which is
+ * moved to the start of the buffer. The buffers are doubled if the record
+ * fills them. The entries waiting must have been stored.
+ *
+ * Returns: 0, or KB_NOMEM or KB_IOERR
+ */
+static int dump_fill(DumpReader *r) {
+	r->len -= r->pos;
+	memmove(r->buf, r->buf + r->pos, r->len);
+	r->pos = 0;
+	if (r->len == r->size) {
+		char *buf = (char *) realloc(r->buf, r->size * 2);
+		if (buf == NULL) return KB_NOMEM;
+		r->buf = buf;
+		char *out = (char *) realloc(r->out, r->size * 2 + DUMP_SLACK);
+		if (out == NULL) return KB_NOMEM;
+		r->out = out;
+		r->size *= 2;
+	}
+	size_t got = fread(r->buf + r->len, 1, r->size - r->len, r->f);
+	r->len += got;
+	if (got == 0) {
+		if (ferror(r->f)) return KB_IOERR;
+		r->eof = 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Import knowledge from a CSV or JSON Lines file, adding to (or overwriting)
+ * what the knowledge base already knows, as knowledge_read() does for INI
+ * files. Fields may be of any length and hold any character; an entity with
+ * an '=' or a response with line breaks is escaped when saved to an INI file
+ * (see kb_write()), so it loads back as it was imported.
+ *
+ * Input:
+ *   f      - the file
+ *   format - KB_FORMAT_CSV or KB_FORMAT_JSONL
+ *
+ * Returns:
+ *   the number of entries stored
+ *   KB_INVALID, if the format is not one of those
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_READONLY, if the knowledge base is shared as a base
+ *   KB_IOERR, if the file could not be read; the entries before the error are kept
+ */
+int knowledge_import(kb_t *kb, FILE *f, int format) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (format != KB_FORMAT_CSV && format != KB_FORMAT_JSONL) {
+		return KB_INVALID;
+	}
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	DumpReader *r = (DumpReader *) calloc(1, sizeof(DumpReader));
+	if (r == NULL) {
+		return KB_NOMEM;
+	}
+	r->f = f;
+	r->size = DUMP_CHUNK;
+	r->buf = (char *) malloc(r->size);
+	r->out = (char *) malloc(r->size + DUMP_SLACK);
+	int result = r->buf && r->out ? 0 : KB_NOMEM;
+	long start = ftell(f); //presize the table from the size of the file, if it has one, as knowledge_read() does.
+	if (result == 0 && start >= 0 && fseek(f, 0, SEEK_END) == 0) {
+		long end = ftell(f);
+		fseek(f, start, SEEK_SET);
+		int estimate = format == KB_FORMAT_CSV ? READ_LINE_ESTIMATE : READ_LINE_ESTIMATE + DUMP_JSON_OVERHEAD;
+		pthread_mutex_lock(&kb->lock);
+		if (end > start && kb->ht != NULL) ht_reserve(kb->ht, (int) ((end - start) / estimate));
+		pthread_mutex_unlock(&kb->lock);
+	}
+
+	int stored = 0;
+	int first = 1; //set until the first record, which may be a header.
+	while (result >= 0 && !(r->eof && r->pos == r->len)) {
+		char *fields[3];
+		size_t used = r->used;
+		int got = format == KB_FORMAT_CSV ? dump_csv_record(r, fields) : dump_json_record(r, fields);
+		if (got == DUMP_MORE) { //store what was parsed, then read on.
+			result = dump_flush(kb, r);
+			if (result >= 0) {
+				stored += result;
+				result = dump_fill(r);
+			}
+			continue;
+		}
+		if (got == DUMP_ROW && first && format == KB_FORMAT_CSV &&
+			strcmp(fields[0], "intent") == 0 && strcmp(fields[1], "entity") == 0 && strcmp(fields[2], "response") == 0) {
+			r->used = used; //the header.
+		} else if (got == DUMP_ROW) {
+			kb_entry_t *entry = &r->entries[r->count++];
+			entry->intent = fields[0];
+			entry->entity = fields[1];
+			entry->response = fields[2];
+			if (r->count == DUMP_BATCH) {
+				result = dump_flush(kb, r);
+				stored += result > 0 ? result : 0;
+			}
+		}
+		first = 0;
+	}
+	if (result >= 0) {
+		result = dump_flush(kb, r); //store what is left.
+		stored += result > 0 ? result : 0;
+	}
+	free(r->buf);
+	free(r->out);
+	free(r);
+	if (result < 0) {
+		return result;
+	}
+	if (kb->compress) knowledge_compress(kb, 1); //retrain the dictionary on the new knowledge, as knowledge_read() does.
+	return stored;
+}
+
+
+/*
+ * Write a field of a CSV row, in quotes if it needs them.
+ */
+static void dump_csv_field(FILE *f, const char *field) {
+	if (field[strcspn(field, ",\"\r\n")] == '\0') {
+		fputs(field, f);
+		return;
+	}
+	putc('"', f);
+	for (const char *quote; (quote = strchr(field, '"')) != NULL; field = quote + 1) {
+		fwrite(field, 1, quote + 1 - field, f); //up to and including the quote, which is then doubled.
+		putc('"', f);
+	}
+	fputs(field, f);
+	putc('"', f);
+}
+
+
+/*
+ * Write a JSON string, in quotes, escaping quotes, backslashes and control
+ * characters.
+ */
+static void dump_json_field(FILE *f, const char *field) {
+	static const char hex[] = "0123456789abcdef";
+	putc('"', f);
+	for (;;) {
+		size_t plain = 0;
+		while ((unsigned char) field[plain] >= 0x20 && field[plain] != '"' && field[plain] != '\\') plain++;
+		fwrite(field, 1, plain, f);
+		field += plain;
+		if (*field == '\0') break;
+		char escape[7] = { '\\', *field, 0 };
+		switch (*field) {
+			case '\b': escape[1] = 'b'; break;
+			case '\f': escape[1] = 'f'; break;
+			case '\n': escape[1] = 'n'; break;
+			case '\r': escape[1] = 'r'; break;
+			case '\t': escape[1] = 't'; break;
+			case '"': case '\\': break;
+			default: //other control characters.
+				memcpy(escape + 1, "u00", 3);
+				escape[4] = hex[(unsigned char) *field >> 4];
+				escape[5] = hex[*field & 0xF];
+		}
+		fputs(escape, f);
+		field++;
+	}
+	putc('"', f);
+}
+
+
+/*
+ * Write one entry as a row of a CSV or JSON Lines file. Called by kb_write().
+ *
+ * Input:
+ *   f        - the file
+ *   format   - KB_FORMAT_CSV or KB_FORMAT_JSONL
+ *   intent   - the name of the intent
+ *   entity   - the entity
+ *   response - the response
+ */
+void dump_row(FILE *f, int format, const char *intent, const char *entity, const char *response) {
+	if (format == KB_FORMAT_CSV) {
+		fputs(intent, f);
+		putc(',', f);
+		dump_csv_field(f, entity);
+		putc(',', f);
+		dump_csv_field(f, response);
+		putc('\n', f);
+	} else {
+		fputs("{\"intent\":\"", f);
+		fputs(intent, f);
+		fputs("\",\"entity\":", f);
+		dump_json_field(f, entity);
+		fputs(",\"response\":", f);
+		dump_json_field(f, response);
+		fputs("}\n", f);
+	}
+}
+
+
+/*
+ * Export the knowledge base to a CSV or JSON Lines file, with a row for each
+ * entry. A layered knowledge base is written merged with its base, as it
+ * answers questions. CSV files start with the header row
+ * intent,entity,response.
+ *
+ * Input:
+ *   f      - the file
+ *   format - KB_FORMAT_CSV or KB_FORMAT_JSONL
+ *
+ * Returns:
+ *   the number of entries written
+ *   KB_INVALID, if the format is not one of those
+ *   KB_IOERR, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_export(kb_t *kb, FILE *f, int format) {
+	ALLOC_OP(ALLOC_OP_SAVE);
+	if (format != KB_FORMAT_CSV && format != KB_FORMAT_JSONL) {
+		return KB_INVALID;
+	}
+	WriteProgress progress = { 0, NULL, -1 }; //only counts the entries.
+	pthread_mutex_lock(&kb->lock);
+	int result = kb_write(kb, f, format, 0, &progress);
+	pthread_mutex_unlock(&kb->lock);
+	if (result != KB_OK) {
+		return result;
+	}
+	if (fflush(f) != 0 || ferror(f)) {
+		return KB_IOERR;
+	}
+	return (int) progress.done; //tables hold at most INT_MAX entries.
+}
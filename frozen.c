@@ -0,0 +1,781 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements frozen knowledge bases. "freeze as FILE.kbf" and
+ * "chatbot --freeze IN OUT.kbf" write a knowledge base as an image that
+ * "chatbot --base FILE.kbf" reads back as a read only base, with a layer on
+ * top of it for what the chatbot learns meanwhile.
+ *
+ * Most knowledge bases never change between deploys, yet a table that may
+ * change pays for empty slots, overflow buckets, and a block of its own for
+ * each long entity and each response. A frozen table has none of these. Its
+ * items lie one after another, in the order of a minimal perfect hash of
+ * their keys built as PTHash builds one: each key is hashed to a bucket, and
+ * the buckets, largest first, each get the smallest pilot that sends all of
+ * their keys to positions no other key has taken. Looking up a key is then
+ * one hash, one pilot, one item and one compare. A pilot takes a byte, and
+ * the rare pilots too large for one are kept apart; with three keys per
+ * bucket, the index takes about 3 bits per key. There are a few more
+ * positions than items, so the pilots stay small; the keys sent past the
+ * last item are remapped to the items left over.
+ *
+ * The image is the table itself, with offsets in place of pointers, so it
+ * is read in one block and its pointers fixed up in one pass. It is meant
+ * for machines of the kind that wrote it: one with another size of Node
+ * refuses it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "knowledge.h"
+#include "alloc.h"
+
+#define FROZEN_MAGIC "KBFROZEN"
+#define FROZEN_VERSION 1
+#define FROZEN_LOAD 0.99 //Items per position.
+#define FROZEN_BUCKET_KEYS 3.0 //Keys per bucket: the pilots take 8 / FROZEN_BUCKET_KEYS bits per key, larger buckets take longer to build.
+#define FROZEN_OVERFLOW 255 //Pilot byte of a bucket whose pilot is in the overflow pairs.
+#define FROZEN_DENSE_KEYS 0.6 //Share of the keys hashed to the dense buckets, which are built first.
+#define FROZEN_DENSE_BUCKETS 0.3 //Share of the buckets that are dense.
+#define FROZEN_SEEDS 16 //Seeds tried before giving up on building the index.
+#define FROZEN_MAX_PILOT (1u << 24) //Pilots tried for a bucket before trying another seed.
+#define FROZEN_ALIGN 64 //Alignment of the items in the image, a cache line.
+_Static_assert(FROZEN_ALIGN == CACHE_LINE, "images are read into blocks from cache_aligned_alloc()");
+
+typedef struct FrozenHeader FrozenHeader; //The start of an image.
+struct FrozenHeader {
+	char magic[8]; //FROZEN_MAGIC.
+	unsigned int version; //FROZEN_VERSION.
+	unsigned int node_size; //sizeof(Node) where the image was written.
+	unsigned long long count; //Number of items.
+	unsigned long long seed; //See Frozen.
+	unsigned long long slots;
+	unsigned long long buckets;
+	unsigned long long overflows; //Number of pilots in the overflow pairs.
+	unsigned int compress; //Set if the responses may be compressed with the dictionary.
+	unsigned long long responses; //Number of distinct responses.
+	unsigned long long response_bytes; //Bytes of response text.
+	unsigned long long raw_bytes; //Bytes the responses take uncompressed.
+	unsigned long long pilots_at; //Offsets of each part of the image, in this order.
+	unsigned long long overflow_at;
+	unsigned long long remap_at;
+	unsigned long long items_at;
+	unsigned long long responses_at;
+	unsigned long long strings_at; //Entities too long to fit in their item.
+	unsigned long long dict_at; //The dictionary, up to the end of the image.
+	unsigned long long size; //Size of the image.
+};
+
+typedef struct FrozenKey FrozenKey; //A key of the index being built.
+struct FrozenKey {
+	unsigned long long hash;
+	unsigned long long bucket;
+	Node *item; //The item of the key, in the table being frozen.
+};
+
+
+/*
+ * Scramble the bits of a 64 bit number (the finalizer of MurmurHash3).
+ */
+static inline unsigned long long frozen_mix(unsigned long long x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+
+/*
+ * Map a 64 bit number evenly onto 0 to n - 1, without a division.
+ */
+static inline unsigned long long frozen_range(unsigned long long x, unsigned long long n) {
+	return (unsigned long long) (((unsigned __int128) x * n) >> 64);
+}
+
+
+/*
+ * Hash a key, the intent tag followed by the entity, to 64 bits: the 32 bits
+ * of key_hash() are too few to tell millions of keys apart.
+ */
+static unsigned long long frozen_hash(unsigned long long seed, int intent, const char *entity, size_t len) {
+	unsigned long long h = frozen_mix(seed ^ ((unsigned long long) intent << 56) ^ len);
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		unsigned long long word;
+		memcpy(&word, entity + i, 8);
+		h = frozen_mix(h ^ word);
+	}
+	unsigned long long tail = 0;
+	memcpy(&tail, entity + i, len - i);
+	return frozen_mix(h ^ tail ^ 0x9e3779b97f4a7c15ULL);
+}
+
+
+/*
+ * Get the bucket of a hash. Most hashes go to a few dense buckets, which are
+ * placed first while most positions are free, so the sparse buckets left
+ * for last are small and find their pilots quickly.
+ */
+static inline unsigned long long frozen_bucket(const Frozen *fz, unsigned long long hash) {
+	unsigned long long spread = hash * 0x9e3779b97f4a7c15ULL;
+	if (hash < fz->dense_hash) return frozen_range(spread, fz->dense_buckets);
+	return fz->dense_buckets + frozen_range(spread, fz->buckets - fz->dense_buckets);
+}
+
+
+/*
+ * Get the position a pilot sends a hash to.
+ */
+static inline unsigned long long frozen_position(unsigned long long hash, unsigned long long pilot, unsigned long long slots) {
+	return frozen_range(frozen_mix(hash + pilot * 0x9e3779b97f4a7c15ULL), slots);
+}
+
+
+/*
+ * Get the item of a hash in a frozen table.
+ *
+ * Returns: the index of the only item the key of the hash can be
+ */
+static inline unsigned long long frozen_slot(const Frozen *fz, unsigned long long hash, unsigned long long count) {
+	unsigned long long bucket = frozen_bucket(fz, hash);
+	unsigned long long pilot = fz->pilots[bucket];
+	if (pilot == FROZEN_OVERFLOW) { //look for it among the overflow pairs.
+		unsigned long long low = 0, high = fz->overflows;
+		while (low + 1 < high) {
+			unsigned long long middle = (low + high) / 2;
+			if (fz->overflow[2 * middle] <= bucket) low = middle;
+			else high = middle;
+		}
+		pilot = fz->overflow[2 * low + 1];
+	}
+	unsigned long long position = frozen_position(hash, pilot, fz->slots);
+	return position < count ? position : fz->remap[position - count];
+}
+
+
+/*
+ * Fill in the number of positions and buckets of an index.
+ */
+static void frozen_layout(Frozen *fz, unsigned long long slots, unsigned long long buckets) {
+	fz->slots = slots;
+	fz->buckets = buckets;
+	fz->dense_buckets = (unsigned long long) (buckets * FROZEN_DENSE_BUCKETS);
+	fz->dense_hash = (unsigned long long) (FROZEN_DENSE_KEYS * 18446744073709551616.0);
+	if (fz->dense_buckets == 0) fz->dense_hash = 0; //too few buckets to have dense ones.
+}
+
+
+/*
+ * Check whether an item of a frozen table holds a key.
+ */
+static inline int frozen_matches(const Node *item, unsigned long long hash, int intent, const char *entity, size_t len) {
+	return item->hash == (unsigned int) hash && item->intent == intent && item->len == len && memcmp(node_entity(item), entity, len) == 0;
+}
+
+
+Node *frozen_search(HashTable *table, int intent, const char *entity) {
+	/*Looks up a key in a frozen table: the index gives the only item that can hold it.*/
+	if (table->count == 0) return NULL;
+	size_t len = strlen(entity);
+	unsigned long long hash = frozen_hash(table->frozen->seed, intent, entity, len);
+	Node *item = &table->items[frozen_slot(table->frozen, hash, table->count)];
+	return frozen_matches(item, hash, intent, entity, len) ? item : NULL;
+}
+
+
+void frozen_search_batch(HashTable *table, HtEntry *keys, int count, Node **results) {
+	/*Looks up many keys in a frozen table, HT_SEARCH_GROUP at a time as ht_search_batch() does: hash each key and
+	prefetch its pilot, then find its item and prefetch it, then compare.*/
+	const Frozen *fz = table->frozen;
+	unsigned long long hashes[HT_SEARCH_GROUP], slots[HT_SEARCH_GROUP];
+	for (int first = 0; first < count; first += HT_SEARCH_GROUP) {
+		int last = first + HT_SEARCH_GROUP < count ? first + HT_SEARCH_GROUP : count;
+		if (table->count == 0) {
+			for (int i = first; i < last; i++) results[i] = NULL;
+			continue;
+		}
+		for (int i = first; i < last; i++) {
+			keys[i].len = strlen(keys[i].entity);
+			hashes[i - first] = frozen_hash(fz->seed, keys[i].intent, keys[i].entity, keys[i].len);
+			__builtin_prefetch(&fz->pilots[frozen_bucket(fz, hashes[i - first])], 0);
+		}
+		for (int i = first; i < last; i++) {
+			slots[i - first] = frozen_slot(fz, hashes[i - first], table->count);
+			__builtin_prefetch(&table->items[slots[i - first]], 0);
+		}
+		for (int i = first; i < last; i++) {
+			Node *item = &table->items[slots[i - first]];
+			keys[i].hash = (unsigned int) hashes[i - first];
+			results[i] = frozen_matches(item, hashes[i - first], keys[i].intent, keys[i].entity, keys[i].len) ? item : NULL;
+		}
+	}
+}
+
+
+/*
+ * Order keys by bucket, then by hash, so the keys of a bucket are together
+ * and keys with the same hash are next to each other.
+ */
+static int frozen_key_compare(const void *a, const void *b) {
+	const FrozenKey *x = (const FrozenKey *) a, *y = (const FrozenKey *) b;
+	if (x->bucket != y->bucket) return x->bucket < y->bucket ? -1 : 1;
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+
+/*
+ * Build the index of a set of keys with one seed.
+ *
+ * Input:
+ *   keys  - the keys, with their items; their hash and bucket are filled in, and they are sorted by bucket
+ *   count - the number of keys, at least 1
+ *   fz    - the index, with its seed and layout filled in
+ *
+ * Output:
+ *   pilots    - receives the pilot of each bucket
+ *   remap     - receives the item of each taken position past the last item
+ *   positions - receives the item of each key, in the order of keys
+ *
+ * Returns: 1 if the index is built, 0 if the seed will not do, or KB_NOMEM
+ */
+static int frozen_build(FrozenKey *keys, unsigned long long count, const Frozen *fz,
+		unsigned int *pilots, unsigned int *remap, unsigned long long *positions) {
+	for (unsigned long long i = 0; i < count; i++) {
+		Node *item = keys[i].item;
+		keys[i].hash = frozen_hash(fz->seed, item->intent, node_entity(item), item->len);
+		keys[i].bucket = frozen_bucket(fz, keys[i].hash);
+	}
+	qsort(keys, count, sizeof(FrozenKey), frozen_key_compare);
+	for (unsigned long long i = 1; i < count; i++)
+		if (keys[i].hash == keys[i - 1].hash) return 0; //no pilot tells two keys with the same hash apart.
+
+	/*Find where each bucket starts, then order the buckets by size, largest first.*/
+	unsigned long long *starts = (unsigned long long *) calloc(fz->buckets + 1, sizeof(unsigned long long));
+	unsigned long long *order = (unsigned long long *) malloc(fz->buckets * sizeof(unsigned long long));
+	unsigned char *taken = (unsigned char *) calloc(fz->slots / 8 + 1, 1);
+	if (starts == NULL || order == NULL || taken == NULL) {
+		free(starts);
+		free(order);
+		free(taken);
+		return KB_NOMEM;
+	}
+	for (unsigned long long i = 0; i < count; i++) starts[keys[i].bucket + 1]++;
+	unsigned long long largest = 0;
+	for (unsigned long long b = 0; b < fz->buckets; b++) {
+		if (starts[b + 1] > largest) largest = starts[b + 1];
+		starts[b + 1] += starts[b];
+	}
+	unsigned long long ordered = 0;
+	for (unsigned long long size = largest; size > 0; size--)
+		for (unsigned long long b = 0; b < fz->buckets; b++)
+			if (starts[b + 1] - starts[b] == size) order[ordered++] = b;
+	for (unsigned long long b = 0; b < fz->buckets; b++)
+		if (starts[b + 1] == starts[b]) pilots[b] = 0; //empty buckets keep the smallest pilot.
+
+	/*Give each bucket the smallest pilot that sends its keys to free positions, all different.*/
+	int built = 1;
+	for (unsigned long long o = 0; built && o < ordered; o++) {
+		unsigned long long b = order[o], first = starts[b], last = starts[b + 1];
+		for (unsigned int pilot = 0;; pilot++) {
+			if (pilot == FROZEN_MAX_PILOT) {
+				built = 0;
+				break;
+			}
+			unsigned long long k = first;
+			for (; k < last; k++) {
+				unsigned long long p = frozen_position(keys[k].hash, pilot, fz->slots);
+				if (taken[p / 8] & (1 << (p % 8))) break;
+				unsigned long long j = first;
+				while (j < k && positions[j] != p) j++;
+				if (j < k) break; //two keys of the bucket would share the position.
+				positions[k] = p;
+			}
+			if (k < last) continue;
+			for (k = first; k < last; k++) taken[positions[k] / 8] |= 1 << (positions[k] % 8);
+			pilots[b] = pilot;
+			break;
+		}
+	}
+
+	/*Remap the positions taken past the last item to the items left free, in order.*/
+	unsigned long long free_item = 0;
+	for (unsigned long long p = count; built && p < fz->slots; p++) {
+		remap[p - count] = 0;
+		if (!(taken[p / 8] & (1 << (p % 8)))) continue;
+		while (taken[free_item / 8] & (1 << (free_item % 8))) free_item++;
+		remap[p - count] = (unsigned int) free_item++;
+	}
+	for (unsigned long long i = 0; built && i < count; i++)
+		if (positions[i] >= count) positions[i] = remap[positions[i] - count];
+	free(starts);
+	free(order);
+	free(taken);
+	return built;
+}
+
+
+/*
+ * Order responses by address, to find the offset of each in the image.
+ */
+static int frozen_response_compare(const void *a, const void *b) {
+	const Response *x = *(Response * const *) a, *y = *(Response * const *) b;
+	return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Round an offset up to a multiple of align.
+ */
+static unsigned long long frozen_align(unsigned long long at, unsigned long long align) {
+	return (at + align - 1) / align * align;
+}
+
+
+/*
+ * Write zeros to f up to an offset.
+ *
+ * Input:
+ *   at - the offset f is at, moved up to to
+ */
+static void frozen_pad(FILE *f, unsigned long long *at, unsigned long long to) {
+	static const char zeros[FROZEN_ALIGN];
+	while (*at < to) {
+		unsigned long long n = to - *at < FROZEN_ALIGN ? to - *at : FROZEN_ALIGN;
+		fwrite(zeros, 1, n, f);
+		*at += n;
+	}
+}
+
+
+/*
+ * Get the bytes a response takes in an image, header included.
+ */
+static unsigned long long frozen_response_size(const Response *r) {
+	return frozen_align(sizeof(Response) + (r->clen ? r->clen : r->len) + 1, sizeof(void *));
+}
+
+
+int frozen_write(HashTable *table, FILE *f, size_t *index_bytes) {
+	/*Writes the table as an image frozen_read() reads back. The table holds no spilled responses.
+	Returns the number of items written, KB_NOMEM, or KB_IOERR if the file could not be written.*/
+	unsigned long long count = table->count;
+	FrozenKey *keys = (FrozenKey *) malloc((count + 1) * sizeof(FrozenKey));
+	unsigned long long *positions = (unsigned long long *) malloc((count + 1) * sizeof(unsigned long long));
+	Response **responses = (Response **) malloc((count + 1) * sizeof(Response *));
+	Node *items = (Node *) calloc(count + 1, sizeof(Node));
+	if (keys == NULL || positions == NULL || responses == NULL || items == NULL) {
+		free(keys);
+		free(positions);
+		free(responses);
+		free(items);
+		return KB_NOMEM;
+	}
+	HtIter iter;
+	Node *item;
+	unsigned long long n = 0;
+	ht_iter_init(&iter);
+	while ((item = ht_next(table, &iter)) != NULL) {
+		keys[n].item = item;
+		responses[n++] = item->responses;
+	}
+
+	/*Build the index, with the next seed whenever one does not do.*/
+	Frozen fz;
+	unsigned long long buckets = (unsigned long long) (count / FROZEN_BUCKET_KEYS) + 1;
+	unsigned long long slots = count == 0 ? 1 : (unsigned long long) (count / FROZEN_LOAD) + 1;
+	frozen_layout(&fz, slots, buckets);
+	unsigned int *pilots = (unsigned int *) calloc(buckets, sizeof(unsigned int));
+	unsigned int *remap = (unsigned int *) calloc(slots - count + 1, sizeof(unsigned int));
+	int built = pilots != NULL && remap != NULL ? count == 0 : KB_NOMEM;
+	for (int s = 0; built == 0 && s < FROZEN_SEEDS; s++) {
+		fz.seed = frozen_mix(0x6b62667265657a65ULL + s);
+		built = frozen_build(keys, count, &fz, pilots, remap, positions);
+	}
+	if (count == 0) fz.seed = 0;
+	if (built != 1) {
+		free(keys);
+		free(positions);
+		free(responses);
+		free(items);
+		free(pilots);
+		free(remap);
+		return built == 0 ? KB_INVALID : KB_NOMEM;
+	}
+
+	/*Lay out the image: the header, the pilots, the remap table, the items, the responses, the long entities
+	and the dictionary.*/
+	FrozenHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, FROZEN_MAGIC, sizeof(h.magic));
+	h.version = FROZEN_VERSION;
+	h.node_size = sizeof(Node);
+	h.count = count;
+	h.seed = fz.seed;
+	h.slots = slots;
+	h.buckets = buckets;
+	for (unsigned long long b = 0; b < buckets; b++)
+		if (pilots[b] >= FROZEN_OVERFLOW) h.overflows++;
+	h.compress = table->responses->compress;
+	h.raw_bytes = table->responses->raw_bytes;
+	qsort(responses, count, sizeof(Response *), frozen_response_compare);
+	unsigned long long distinct = 0;
+	for (unsigned long long i = 0; i < count; i++)
+		if (distinct == 0 || responses[distinct - 1] != responses[i]) responses[distinct++] = responses[i];
+	h.responses = distinct;
+	h.pilots_at = frozen_align(sizeof(h), 8);
+	h.overflow_at = frozen_align(h.pilots_at + buckets, 8);
+	h.remap_at = h.overflow_at + h.overflows * 2 * sizeof(unsigned int);
+	h.items_at = frozen_align(h.remap_at + (slots - count) * sizeof(unsigned int), FROZEN_ALIGN);
+	h.responses_at = h.items_at + count * sizeof(Node);
+	unsigned long long at = h.responses_at;
+	for (unsigned long long i = 0; i < distinct; i++) {
+		h.response_bytes += (responses[i]->clen ? responses[i]->clen : responses[i]->len) + 1;
+		at += frozen_response_size(responses[i]);
+	}
+	h.strings_at = at;
+
+	/*Place the items in the order of the index, with offsets in place of their pointers.*/
+	for (unsigned long long i = 0; i < count; i++) {
+		Node *to = &items[positions[i]];
+		*to = *keys[i].item;
+		to->hash = (unsigned int) keys[i].hash;
+		to->flags = 0;
+		to->ref = 0;
+		Response **r = (Response **) bsearch(&to->responses, responses, distinct, sizeof(Response *), frozen_response_compare);
+		to->responses = (Response *) (uintptr_t) (r - responses); //the number of the response for now.
+		if (to->len >= NODE_INLINE) {
+			to->entity.long_entity = (char *) (uintptr_t) at;
+			at += to->len + 1;
+		}
+	}
+	unsigned long long *response_at = (unsigned long long *) malloc((distinct + 1) * sizeof(unsigned long long));
+	if (response_at == NULL) {
+		free(keys);
+		free(positions);
+		free(responses);
+		free(items);
+		free(pilots);
+		free(remap);
+		return KB_NOMEM;
+	}
+	response_at[0] = h.responses_at;
+	for (unsigned long long i = 0; i + 1 < distinct; i++) response_at[i + 1] = response_at[i] + frozen_response_size(responses[i]);
+	for (unsigned long long i = 0; i < count; i++)
+		items[i].responses = (Response *) (uintptr_t) response_at[(uintptr_t) items[i].responses];
+	Dictionary *dict = table->responses->dict;
+	h.dict_at = at;
+	h.size = at + (dict != NULL ? dict->len : 0);
+
+	/*Write it out.*/
+	at = 0;
+	fwrite(&h, sizeof(h), 1, f);
+	at += sizeof(h);
+	frozen_pad(f, &at, h.pilots_at);
+	for (unsigned long long b = 0; b < buckets; b++)
+		fputc(pilots[b] < FROZEN_OVERFLOW ? (int) pilots[b] : FROZEN_OVERFLOW, f);
+	at += buckets;
+	frozen_pad(f, &at, h.overflow_at);
+	for (unsigned int b = 0; b < buckets; b++) {
+		if (pilots[b] < FROZEN_OVERFLOW) continue;
+		unsigned int pair[2] = { b, pilots[b] };
+		fwrite(pair, sizeof(unsigned int), 2, f);
+		at += sizeof(pair);
+	}
+	frozen_pad(f, &at, h.remap_at);
+	fwrite(remap, sizeof(unsigned int), slots - count, f);
+	at += (slots - count) * sizeof(unsigned int);
+	frozen_pad(f, &at, h.items_at);
+	fwrite(items, sizeof(Node), count, f);
+	at += count * sizeof(Node);
+	for (unsigned long long i = 0; i < distinct; i++) {
+		Response r = *responses[i];
+		r.refcount = 1;
+		r.next = NULL;
+		fwrite(&r, sizeof(Response), 1, f);
+		fwrite(responses[i]->text, 1, (r.clen ? r.clen : r.len) + 1, f);
+		at += sizeof(Response) + (r.clen ? r.clen : r.len) + 1;
+		frozen_pad(f, &at, response_at[i] + frozen_response_size(responses[i]));
+	}
+	for (unsigned long long i = 0; i < count; i++)
+		if (keys[i].item->len >= NODE_INLINE) fwrite(keys[i].item->entity.long_entity, 1, keys[i].item->len + 1, f);
+	if (dict != NULL) fwrite(dict->data, 1, dict->len, f);
+
+	if (index_bytes != NULL) *index_bytes = buckets + h.overflows * 2 * sizeof(unsigned int) + (slots - count) * sizeof(unsigned int);
+	free(keys);
+	free(positions);
+	free(responses);
+	free(items);
+	free(pilots);
+	free(remap);
+	free(response_at);
+	return fflush(f) != 0 || ferror(f) ? KB_IOERR : (int) count;
+}
+
+
+/*
+ * Check the parts of an image before its pointers are fixed up, so a damaged
+ * image is refused rather than followed out of its block.
+ *
+ * Returns: 1 if the image holds together, 0 if not
+ */
+static int frozen_check(const FrozenHeader *h, char *image) {
+	if (h->count > 0x7fffffff || h->slots < h->count || h->slots - h->count > 0xffffffffULL || h->buckets == 0
+		|| h->buckets > 0xffffffffULL || h->overflows > h->buckets) return 0;
+	if (h->pilots_at < sizeof(FrozenHeader) || h->pilots_at % 8 || h->overflow_at % 8 || h->items_at % 8 || h->responses_at % 8
+		|| h->overflow_at < h->pilots_at || h->overflow_at - h->pilots_at < h->buckets
+		|| h->remap_at < h->overflow_at || h->remap_at - h->overflow_at < h->overflows * 2 * sizeof(unsigned int)
+		|| h->items_at < h->remap_at || h->items_at - h->remap_at < (h->slots - h->count) * sizeof(unsigned int)
+		|| h->responses_at < h->items_at || h->responses_at - h->items_at < h->count * sizeof(Node)
+		|| h->strings_at < h->responses_at || h->dict_at < h->strings_at || h->size < h->dict_at) return 0;
+	const unsigned char *pilots = (const unsigned char *) (image + h->pilots_at);
+	const unsigned int *overflow = (const unsigned int *) (image + h->overflow_at);
+	unsigned long long overflows = 0;
+	for (unsigned long long b = 0; b < h->buckets; b++)
+		if (pilots[b] == FROZEN_OVERFLOW) overflows++;
+	if (overflows != h->overflows) return 0;
+	for (unsigned long long i = 0; i < h->overflows; i++) //every overflow pair is the pilot of a bucket that has none, by bucket.
+		if (overflow[2 * i] >= h->buckets || pilots[overflow[2 * i]] != FROZEN_OVERFLOW || (i > 0 && overflow[2 * i] <= overflow[2 * i - 2])) return 0;
+	const unsigned int *remap = (const unsigned int *) (image + h->remap_at);
+	for (unsigned long long i = 0; i < h->slots - h->count; i++)
+		if (h->count > 0 && remap[i] >= h->count) return 0;
+	Node *items = (Node *) (image + h->items_at);
+	for (unsigned long long i = 0; i < h->count; i++) {
+		unsigned long long at = (uintptr_t) items[i].responses;
+		if (items[i].intent > INTENT_ALIAS || items[i].flags != 0 || at < h->responses_at || at % 8
+			|| at + sizeof(Response) > h->strings_at) return 0;
+		const Response *r = (const Response *) (image + at);
+		if (r->clen == RESPONSE_SPILLED || (r->clen ? r->clen : r->len) + 1 > h->strings_at - at - sizeof(Response)
+			|| r->text[r->clen ? r->clen : r->len] != '\0') return 0;
+		if (items[i].len < NODE_INLINE) {
+			if (items[i].entity.inline_entity[items[i].len] != '\0') return 0;
+			continue;
+		}
+		at = (uintptr_t) items[i].entity.long_entity;
+		if (at < h->strings_at || at >= h->dict_at || items[i].len >= h->dict_at - at || image[at + items[i].len] != '\0') return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Turn the pointers of the items of an image, or their offsets if from is
+ * NULL, into pointers into the image, as if it had been read at from.
+ */
+static void frozen_relocate(char *image, const char *from) {
+	const FrozenHeader *h = (const FrozenHeader *) image;
+	Node *items = (Node *) (image + h->items_at);
+	for (unsigned long long i = 0; i < h->count; i++) {
+		items[i].responses = (Response *) (image + ((uintptr_t) items[i].responses - (uintptr_t) from));
+		if (items[i].len >= NODE_INLINE) items[i].entity.long_entity = image + ((uintptr_t) items[i].entity.long_entity - (uintptr_t) from);
+	}
+}
+
+
+/*
+ * Build the table of an image whose pointers have been fixed up.
+ *
+ * Input:
+ *   image  - the image, which starts with its header; it goes with the table
+ *   mapped - the bytes mapped for the image by numa_map(), or 0 if it was allocated with cache_aligned_alloc()
+ *
+ * Returns: the table, or NULL if there was a memory allocation failure
+ */
+static HashTable *frozen_table(char *image, size_t mapped) {
+	const FrozenHeader *h = (const FrozenHeader *) image;
+	HashTable *table = (HashTable *) calloc(1, sizeof(HashTable));
+	ResponseStore *store = (ResponseStore *) calloc(1, sizeof(ResponseStore));
+	Frozen *fz = (Frozen *) calloc(1, sizeof(Frozen));
+	if (table == NULL || store == NULL || fz == NULL
+		|| (h->size > h->dict_at && (store->dict = dict_load(image + h->dict_at, (int) (h->size - h->dict_at))) == NULL)) {
+		free(table);
+		free(store);
+		free(fz);
+		return NULL;
+	}
+	store->count = (int) h->responses;
+	store->bytes = h->response_bytes;
+	store->raw_bytes = h->raw_bytes;
+	store->compress = h->compress;
+	fz->image = image;
+	fz->size = h->size;
+	fz->mapped = mapped;
+	fz->seed = h->seed;
+	fz->pilots = (const unsigned char *) (image + h->pilots_at);
+	fz->overflow = (const unsigned int *) (image + h->overflow_at);
+	fz->overflows = h->overflows;
+	fz->remap = (const unsigned int *) (image + h->remap_at);
+	frozen_layout(fz, h->slots, h->buckets);
+	table->items = (Node *) (image + h->items_at);
+	table->size = (int) h->count;
+	table->count = (int) h->count;
+	table->responses = store;
+	table->frozen = fz;
+	return table;
+}
+
+
+HashTable *frozen_read(FILE *f, int *error) {
+	/*Reads an image written by frozen_write() into a frozen table. Returns the table, or NULL with error set to
+	KB_INVALID if the file is not an image this machine can read, KB_IOERR or KB_NOMEM.*/
+	FrozenHeader h;
+	*error = KB_INVALID;
+	if (fread(&h, sizeof(h), 1, f) != 1) {
+		if (ferror(f)) *error = KB_IOERR;
+		return NULL;
+	}
+	if (memcmp(h.magic, FROZEN_MAGIC, sizeof(h.magic)) != 0 || h.version != FROZEN_VERSION || h.node_size != sizeof(Node)
+		|| h.size < sizeof(h) || h.size != (size_t) h.size) return NULL;
+	char *image = (char *) cache_aligned_alloc(h.size); //the items must start on a cache line, as they do in the file.
+	if (image == NULL) {
+		*error = KB_NOMEM;
+		return NULL;
+	}
+	memcpy(image, &h, sizeof(h));
+	if (fread(image + sizeof(h), 1, h.size - sizeof(h), f) != h.size - sizeof(h) || !frozen_check(&h, image)) {
+		if (ferror(f)) *error = KB_IOERR;
+		cache_aligned_free(image);
+		return NULL;
+	}
+	frozen_relocate(image, NULL);
+	HashTable *table = frozen_table(image, 0);
+	if (table == NULL) {
+		*error = KB_NOMEM;
+		cache_aligned_free(image);
+		return NULL;
+	}
+	*error = KB_OK;
+	return table;
+}
+
+
+HashTable *frozen_copy(const HashTable *table, char *image, size_t mapped) {
+	/*Copies a frozen table into image, which holds table->frozen->size bytes and goes with the copy: the table
+	answers alike from either, from memory of its own. mapped is as for frozen_table(). Returns the copy, or NULL
+	if out of memory.*/
+	memcpy(image, table->frozen->image, table->frozen->size);
+	frozen_relocate(image, table->frozen->image);
+	return frozen_table(image, mapped);
+}
+
+
+void free_frozen(Frozen *frozen) {
+	// Frees the index of a frozen table and the image its items are in.
+	if (frozen->mapped) numa_unmap(frozen->image, frozen->mapped);
+	else cache_aligned_free(frozen->image);
+	free(frozen);
+}
+
+
+/*
+ * Copy an entry into the table to freeze.
+ *
+ * Returns: 1 if it was copied, 0 if there was a memory allocation failure
+ */
+static int freeze_item(HashTable *frozen, HashTable *ht, Node *item, char **buf, size_t *size) {
+	if (item->responses->len + 1 > *size) {
+		char *grown = (char *) realloc(*buf, item->responses->len + 1);
+		if (grown == NULL) return 0;
+		*buf = grown;
+		*size = item->responses->len + 1;
+	}
+	response_copy(ht->responses, item->responses, *buf, *size);
+	return ht_insert(frozen, item->intent, node_entity(item), *buf) != NULL;
+}
+
+
+/*
+ * Freeze the knowledge base: write what it knows, merged with its base if it
+ * is layered, as an image for knowledge_load_frozen(). Responses are
+ * compressed in the image if the knowledge base compresses them.
+ *
+ * Input:
+ *   f - the file, opened for writing in binary mode
+ *
+ * Output:
+ *   index_bytes - if not NULL, receives the bytes the index of the image takes
+ *
+ * Returns:
+ *   the number of entries written
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERR, if the file could not be written
+ *   KB_INVALID, if no index could be built, which only happens if entries hash alike for every seed tried
+ */
+int knowledge_freeze(kb_t *kb, FILE *f, size_t *index_bytes) {
+	ALLOC_OP(ALLOC_OP_SAVE);
+	HashTable *frozen = create_table(CAPACITY);
+	if (frozen == NULL) {
+		return KB_NOMEM;
+	}
+	long entries = kb_entries(kb);
+	ht_reserve(frozen, entries < 0x3fffffff ? (int) entries : 0x3fffffff);
+
+	/*Copy the entries into a table of their own: responses the base and the layer share are interned once,
+	and the knowledge base is only locked while they are copied.*/
+	char *buf = NULL; //buffer the responses are decompressed into, grown as needed.
+	size_t size = 0;
+	int ok = 1;
+	HtIter iter;
+	Node *item;
+	pthread_mutex_lock(&kb->lock);
+	ht_iter_init(&iter);
+	while (ok && kb->ht != NULL && (item = ht_next(kb->ht, &iter)) != NULL)
+		if (!(item->flags & NODE_TOMBSTONE)) ok = freeze_item(frozen, kb->ht, item, &buf, &size);
+	ht_iter_init(&iter);
+	while (ok && kb->base != NULL && kb->base->ht != NULL && (item = ht_next(kb->base->ht, &iter)) != NULL)
+		if (kb->ht == NULL || ht_search(kb->ht, item->intent, node_entity(item)) == NULL) ok = freeze_item(frozen, kb->base->ht, item, &buf, &size);
+	pthread_mutex_unlock(&kb->lock);
+	free(buf);
+
+	int result = KB_NOMEM;
+	if (ok) {
+		if (kb->compress) ht_compress_responses(frozen, 1, DICT_SIZE); //if this fails the responses are written as they are.
+		result = frozen_write(frozen, f, index_bytes);
+	}
+	free_table(frozen);
+	return result;
+}
+
+
+/*
+ * Replace the knowledge base with a frozen image written by
+ * knowledge_freeze(). The knowledge base then answers from the image and is
+ * read only, as a shared base is: layer a knowledge base on it with
+ * kb_create_layered() to learn and forget on top of it.
+ *
+ * Input:
+ *   f - the file, opened for reading in binary mode
+ *
+ * Returns:
+ *   the number of entries read
+ *   KB_INVALID, if the file is not a frozen image this machine can read, or the knowledge base is layered
+ *   KB_READONLY, if the knowledge base is shared as a base
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERR, if the file could not be read
+ */
+int knowledge_load_frozen(kb_t *kb, FILE *f) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	if (kb->base != NULL) {
+		return KB_INVALID;
+	}
+	int error;
+	HashTable *fresh = frozen_read(f, &error);
+	if (fresh == NULL) {
+		return error;
+	}
+	int count = fresh->count;
+	pthread_mutex_lock(&kb->lock);
+	HashTable *old = atomic_exchange(&kb->ht, fresh);
+	atomic_fetch_add(&kb->generation, 1);
+	kb_synchronize(kb);
+	free_table(old);
+	kb->readonly = 1;
+	pthread_mutex_unlock(&kb->lock);
+	return count;
+}
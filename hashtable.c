@@ -1,284 +1,781 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include "chat1002.h"
-
-
-unsigned int hash_function(char *key, size_t len){ 
-    /*Jenkins one at a time hash function. Used to creates keys which are mapped to values. 
-    Good hash functions have low collision rates and JOAT hash function is one of the simplest/low-collision chance
-    function to implement. Keys are encrypted values which are mapped to values to identify them.*/
-    unsigned int hash, i;
-    for(hash = i = 0; i < len; ++i)
-    {
-        hash += key[i];
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
-}
-
-/*Method of handling collision for this hash table is through separate chaining. This means that whenever there is a collision,
-we add items that collide on the same index to the overflow bucket which is basically a linked list.*/
-
-static LinkedList* allocate_memory_list () {
-    // Allocates memory for a Linkedlist pointer
-    LinkedList* list = (LinkedList*) malloc (sizeof(LinkedList)); //Allocate memory for Linkedlist.
-    return list;
-}
-
-static LinkedList* linkedlist_insert(LinkedList* list, Node* item) {
-    // Inserts the item onto the Linked List
-    if (!list) { //If the linkedlist is empty.
-        LinkedList* head = allocate_memory_list(); //Allocate memory for Linkedlist obj to be inserted at memory address with collision.
-        head->item = item; //Set item of head to be the item/Node which is supposed to be stored at collision address.
-        head->next = NULL; //Set memory address of next item in linkedlist obj to null.
-        list = head; 
-        return list;
-    }
-
-    else if (list->next == NULL) { //If there is only 1 linkedlist obj at memory address.
-        LinkedList* secondnode = allocate_memory_list(); //Allocate memory for Linkedlist obj to be inserted at memory address with collision.
-        secondnode->item = item; //Set item of fnode to be the item/Node which is supposed to be stored at collision address.
-        secondnode->next = NULL; //Set memory address of next item in linkedlist to null.
-        list->next = secondnode; //Set next item of first linkedlist obj to be current linkedlist obj.
-        return list;
-    }
-
-    LinkedList* temp = list; 
-    while (temp->next->next) {
-        temp = temp->next; //Iterates through linkedlist to its last item.
-    }
-
-    LinkedList* node = allocate_memory_list(); //Allocate memory for Linkedlist obj to be inserted at memory address with collision.
-    node->item = item; //Set item of nnode to be the item/Node which is supposed to be stored at collision address.
-    node->next = NULL; //Set memory address of next item in linkedlist to null.
-    temp->next = node; //Set next item of previous linkedlist obj to be current linkedlist obj.
-
-    return list; 
-}
-
-static void free_linkedlist(LinkedList* list) {
-    //Removes linkedlist object.
-    LinkedList* temp = list; 
-    /*While there are still items in list/while list is not null, free up all items and its attributes in linkedlist*/
-    while (list) { 
-        temp = list; 
-        list = list->next;
-        free(temp->item->key);
-        free(temp->item->entity);
-        free(temp->item->intent);
-        free(temp->item->responses);
-        free(temp->item);
-        free(temp);
-    }
-}
-
-static LinkedList** create_overflow_buckets(HashTable* table) {
-    /*Create the overflow buckets; an array of linkedlists. 
-    Each node/item in hashtable will have its own overflow bucket thus you will need to set aside
-    tablesize*linkedlist of memory space. */
-    LinkedList** buckets = (LinkedList**) calloc (table->size, sizeof(LinkedList*)); //Allocate memory for overflow bucket and set all values in memory to 0
-    for (int i=0; i<table->size; i++) 
-        buckets[i] = NULL; //for each bucket set its value to be NULL. Which means the bucket contains nothing.
-    return buckets;
-}
-
-static void free_overflow_buckets(HashTable* table) {
-    // Free all the overflow bucket lists
-    LinkedList** buckets = table->obuckets;
-    for (int i=0; i<table->size; i++){
-        if (buckets[i] == NULL) continue;
-        free_linkedlist(buckets[i]);
-    }
-    free(buckets);
-}
-
-
-Node* create_item(char* key, const char* intent, const char* entity, const char* responses){
-    // Creates a pointer to a new hash table item
-    Node* item = (Node*) malloc (sizeof(Node));
-    item->key = (char*) malloc (strlen(key) + 1);
-    item->intent = (char*) malloc (strlen(intent) + 1);
-    item->entity = (char*) malloc (strlen(entity) + 1);
-    item->responses = (char*) malloc (strlen(responses) + 1);
-    strcpy(item->key, key);
-    strcpy(item->intent, intent);
-    strcpy(item->entity, entity);
-    strcpy(item->responses, responses);
-    return item;
-}
-
-HashTable* create_table(int size) {
-    // Creates a new HashTable
-    HashTable* table = (HashTable*) malloc (CAPACITY * sizeof(HashTable)); //Allocate memory for hashtable. Capacity and size is same.
-    table->size = size; //Set size of hashtable to be capacity
-    table->count = 0; //Set number of items in hashtable to be 0.
-    table->items = (Node**) calloc (table->size, sizeof(Node*)); //Allocate memory space for items in hashtable.
-    for (int i=0; i<table->size; i++){ //Set value of items in hashtable to be NULL.
-        table->items[i] = NULL; 
-    }
-    table->obuckets = create_overflow_buckets(table); //Create overflow bucket of hashtable.
-
-    return table;
-}
-
-void free_item(Node* item) {
-    // Frees an item
-    free(item->key);
-    free(item->intent);
-    free(item->entity);
-    free(item->responses);
-    free(item);
-}
-
-void free_table(HashTable* table) {
-    if (table == NULL) return;
-    // Frees the table which is used to reset the chatbot.
-    for (int i=0; i<table->size; i++) { //For each item in the hashtable, free its memory if there is are values in the it.
-        Node* item = table->items[i];
-        if (item != NULL)
-            free_item(item);
-    }
-    
-    free_overflow_buckets(table); //free overflow bucket
-    free(table->items); //free memory space allocated for table items.
-    free(table); //free the table.
-}
-
-void handle_collision(HashTable* table, unsigned long index, Node* item) {
-    LinkedList* head = table->obuckets[index]; //Set head to be overflow bucket at memory address with collision.
-
-    if (head == NULL) { 
-        /*if head is empty/null, allocate memory for a linkedlist and set value of its item to be node that is to be stored at address.*/
-        head = allocate_memory_list(); 
-        head->item = item;
-        table->obuckets[index] = head;
-        return;
-    }
-    else {
-        // Insert to the list
-        table->obuckets[index] = linkedlist_insert(head, item);
-        return;
-    }
- }
-
-int ht_insert(HashTable* table, char* key, const char* intent, const char* entity, const char* response) {
-    Node* item = create_item(key, intent, entity, response); //Create item to be inserted
-    unsigned long index = hash_function(key, strlen(key)) % CAPACITY; //Calculate index/key of item
-    Node* current_item = table->items[index]; //Assign item to a variable current item.
-
-    if (current_item == NULL) { 
-        /*If current item not found and table is full then return. Else insert item to into the table and increase count.*/
-        if (table->count == table->size) {
-            printf("Hash Table is full\n");
-            free_item(item); //Remove item
-            return 0;
-        }
-        table->items[index] = item; //Add item into hashtable.
-        table->count++; //Increase count.
-        return 1; 
-    }
-
-    else {
-            if (strcmp(current_item->key, key) == 0) { 
-                /*If current item is exist and key is the same, then replace values of existing item.*/
-                strcpy(table->items[index]->intent, intent); //Replace intent of exisiting item
-                strcpy(table->items[index]->entity, entity); //Replace intent of exisiting item
-                strcpy(table->items[index]->responses, response); //Replace intent of exisiting item
-                return 1;
-            }
-
-        else {
-            // Scenario 2: Collision
-            handle_collision(table, index, item); //If there is already item in memory address and key is different then handle collision.
-            return 1;
-        }
-    }
-}
-
-Node* ht_search(HashTable* table, char* key) {
-    /*Search for key in hashtable.*/
-    unsigned long index = hash_function(key, strlen(key)) % CAPACITY; //Calculate index/key of item
-    Node* item = table->items[index]; //Set Node to be item at index of hashtable.
-    LinkedList* head = table->obuckets[index]; //Set head of overflow bucket at item at index.
-
-    while (item != NULL) { 
-        /*While there are items in the hashtable. Compare item key with search key and if its the same then retrieve the item. 
-        */ 
-        if (strcmp(item->key, key) == 0) //If key at index is equals to search key then return item.
-            return item;
-        if (head == NULL){ //Else if key is not the same and there is no overflow bucket/linkedlist at index then return null.
-            return NULL;
-        }
-        /*if there is overflow bucket then set item to be next item in linkedlist*/
-        item = head->item; 
-        head = head->next;
-    }
-    return NULL;
-}
-
-void ht_delete(HashTable* table, char* key) {
-
-    unsigned long index = hash_function(key, strlen(key)) % CAPACITY; //Calculate index/key of item
-    Node* item = table->items[index]; //Set Node to be item at index of hashtable.
-    LinkedList* head = table->obuckets[index]; //Set head of overflow bucket at item at index.
-
-    if (item == NULL) { //If item does not exist then return.
-        return;
-    }
-    else {
-        if (head == NULL && strcmp(item->key, key) == 0) {
-            /*If not collison at index then set value of item to be null, free up its memory space, and decrease count*/
-            table->items[index] = NULL;
-            free_item(item);
-            table->count--;
-            return;
-        }
-        else if (head != NULL) {
-            if (strcmp(item->key, key) == 0) {
-            /*If there is collision at index and key of firstitem in the collisionn chain is the same then remove it.
-            Set next item in collision chain/linkedlist to be the head*/
-                free_item(item);
-                LinkedList* node = head; 
-                head = head->next;
-                node->next = NULL;
-                table->items[index] = create_item(node->item->key, node->item->intent, node->item->entity, node->item->responses);
-                free_linkedlist(node);
-                table->obuckets[index] = head;
-                return;
-            }
-
-            LinkedList* curr = head;
-            LinkedList* prev = NULL;
-
-            while (curr) {
-                /*If the item to be deleted lies somewhere in the linkedlist then iterate through it to find the item and remove it.*/
-                if (strcmp(curr->item->key, key) == 0) { 
-                    if (prev == NULL) { 
-                        /*If key in linkedlist is same as search key and item is first in linkedlist/chain then remove item and set
-                        value of linkedlist to be null to remove it. basically removing overflow bucket.*/
-                        free_linkedlist(head); 
-                        table->obuckets[index] = NULL;
-                        return;
-                    }
-                    else {
-                        /*Else If key in linkedlist is same as search key and item is not first in linkedlist/chain and set next address of previous
-                        item to be the address of the next item of current address. Then remove the item in current address.*/
-                        prev->next = curr->next;
-                        curr->next = NULL;
-                        free_linkedlist(curr);
-                        table->obuckets[index] = head;
-                        return;
-                    }
-                }
-                curr = curr->next;
-                prev = curr;
-            }
-
-        }
-    }
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "alloc.h"
+
+
+unsigned int hash_function(char *key, size_t len){ 
+    /*Jenkins one at a time hash function. Used to creates keys which are mapped to values. 
+    Good hash functions have low collision rates and JOAT hash function is one of the simplest/low-collision chance
+    function to implement. Keys are encrypted values which are mapped to values to identify them.*/
+    unsigned int hash, i;
+    for(hash = i = 0; i < len; ++i)
+    {
+        hash += key[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+/*Responses are interned in a content addressed store owned by the table. Every Node with the same response text holds
+a handle to one shared, refcounted Response, so large knowledge bases with boilerplate answers only keep one copy of each
+answer. Overwriting a response swaps the handle instead of copying text over the old buffer.
+If the store is set to compress, each response is kept compressed with the store's dictionary and only decompressed
+by response_copy() when it is needed.*/
+
+ResponseStore* create_response_store(int size) {
+    // Creates an empty response store with size buckets.
+    ResponseStore* store = (ResponseStore*) malloc (sizeof(ResponseStore));
+    if (store == NULL) return NULL;
+    store->buckets = (Response**) calloc (size, sizeof(Response*)); //Set all buckets to NULL.
+    if (store->buckets == NULL) {
+        free(store);
+        return NULL;
+    }
+    store->size = size;
+    store->count = 0;
+    store->bytes = 0;
+    store->raw_bytes = 0;
+    store->compress = 0;
+    store->dict = NULL;
+    store->spilled = 0;
+    store->spilled_bytes = 0;
+    return store;
+}
+
+void free_response_store(ResponseStore* store) {
+    // Frees the store and every response still in it.
+    if (store == NULL) return;
+    for (int i=0; i<store->size; i++) {
+        Response* r = store->buckets[i];
+        while (r) {
+            Response* next = r->next;
+            free(r);
+            r = next;
+        }
+    }
+    free(store->buckets);
+    free_dictionary(store->dict);
+    free(store);
+}
+
+static void response_store_grow(ResponseStore* store) {
+    /*Doubles the number of buckets once the store holds more responses than buckets, so chains stay short.
+    The hash is kept in each response so nothing needs to be rehashed from the text.*/
+    int size = store->size * 2;
+    Response** buckets = (Response**) calloc (size, sizeof(Response*));
+    if (buckets == NULL) return; //Keep the old buckets, lookups still work with longer chains.
+    for (int i=0; i<store->size; i++) {
+        Response* r = store->buckets[i];
+        while (r) {
+            Response* next = r->next;
+            r->next = buckets[r->hash % size];
+            buckets[r->hash % size] = r;
+            r = next;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+    store->size = size;
+}
+
+Response* response_intern(ResponseStore* store, const char* text) {
+    /*Returns a handle to the response with this text, taking a reference on it.
+    If no Node holds this text yet, a new response is created. Returns NULL if out of memory.*/
+    size_t len = strlen(text);
+    unsigned int hash = hash_function((char*) text, len);
+    const char* stored = text; //Bytes kept in the response, the text itself unless compressing saves space.
+    size_t stored_len = len, clen = 0;
+    char* packed = NULL;
+    if (store->compress) {
+        /*Compression is deterministic for a given dictionary, so equal texts compress to equal bytes
+        and can be compared without decompressing.*/
+        packed = (char*) malloc (dict_compress_bound(len));
+        if (packed == NULL) return NULL;
+        size_t c = dict_compress(store->dict, text, len, packed);
+        if (c > 0 && c < len) {
+            stored = packed;
+            stored_len = clen = c;
+        }
+    }
+
+    Response* r = store->buckets[hash % store->size];
+    while (r) {
+        if (r->hash == hash && r->len == len && r->clen == clen && memcmp(r->text, stored, stored_len) == 0) {
+            r->refcount++;
+            free(packed);
+            return r;
+        }
+        r = r->next;
+    }
+
+    r = (Response*) malloc (sizeof(Response) + stored_len + 1); //Allocate the header and the text in one block.
+    if (r == NULL) {
+        free(packed);
+        return NULL;
+    }
+    r->hash = hash;
+    r->refcount = 1;
+    r->len = len;
+    r->clen = clen;
+    memcpy(r->text, stored, stored_len);
+    r->text[stored_len] = '\0';
+    free(packed);
+    if (store->count >= store->size) response_store_grow(store);
+    r->next = store->buckets[hash % store->size];
+    store->buckets[hash % store->size] = r;
+    store->count++;
+    store->bytes += stored_len + 1;
+    store->raw_bytes += len + 1;
+    return r;
+}
+
+Response* response_spilled(ResponseStore* store, size_t len, long offset, int fd) {
+    /*Returns a new response standing for one of len bytes evicted to a spill file, or NULL if out of memory.
+    It belongs to a single Node and is not in the buckets, so texts interned later never match it.*/
+    Spilled spilled = { offset, fd };
+    Response* r = (Response*) malloc (sizeof(Response) + sizeof(Spilled));
+    if (r == NULL) return NULL;
+    r->hash = 0;
+    r->refcount = 1;
+    r->len = len;
+    r->clen = RESPONSE_SPILLED;
+    r->next = NULL;
+    memcpy(r->text, &spilled, sizeof(Spilled));
+    store->spilled++;
+    store->spilled_bytes += len;
+    return r;
+}
+
+Response* response_retire(ResponseStore* store, Response* response) {
+    /*Drops a reference to the response as response_release() does, but leaves freeing it to the caller, who
+    may have to wait for lookups still reading it. Returns the response once no Node holds it, else NULL.*/
+    if (--response->refcount > 0) return NULL;
+    if (response->clen == RESPONSE_SPILLED) {
+        store->spilled--;
+        store->spilled_bytes -= response->len;
+        return response;
+    }
+    Response** link = &store->buckets[response->hash % store->size];
+    while (*link != response) link = &(*link)->next;
+    *link = response->next;
+    store->count--;
+    store->bytes -= (response->clen ? response->clen : response->len) + 1;
+    store->raw_bytes -= response->len + 1;
+    return response;
+}
+
+void response_release(ResponseStore* store, Response* response) {
+    // Drops a reference to the response, removing it from the store when no Node holds it anymore.
+    if (response == NULL) return;
+    free(response_retire(store, response));
+}
+
+size_t response_copy(const ResponseStore* store, const Response* response, char* buf, size_t n) {
+    /*Copies the response into buf, as snprintf(buf, n, "%s", text) would, decompressing it if needed.
+    Returns the number of characters written, excluding the terminating null.*/
+    if (n == 0) return 0;
+    size_t len;
+    if (response->clen == RESPONSE_SPILLED) {
+        Spilled spilled;
+        memcpy(&spilled, response->text, sizeof(Spilled));
+        len = spill_read(&spilled, buf, response->len < n - 1 ? response->len : n - 1);
+    } else if (response->clen) {
+        len = dict_decompress(store->dict, response->text, response->clen, buf, n - 1);
+    } else {
+        len = response->len < n - 1 ? response->len : n - 1;
+        memcpy(buf, response->text, len);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static Response* move_response(HashTable* table, ResponseStore* store, Node* item) {
+    // Interns the response of item, which lives in the table's store, into store. An evicted response stays where it is.
+    if (item->responses->clen == RESPONSE_SPILLED) return item->responses;
+    char* text = (char*) malloc (item->responses->len + 1);
+    if (text == NULL) return NULL;
+    response_copy(table->responses, item->responses, text, item->responses->len + 1);
+    Response* r = response_intern(store, text);
+    free(text);
+    return r;
+}
+
+int ht_compress_responses(HashTable* table, int compress, int dict_size) {
+    /*Switches the table between plain and compressed responses.
+
+    When compressing, a new dictionary of up to dict_size bytes is trained from the responses currently in the table,
+    so calling this again after loading more knowledge retrains it. All responses are then moved to a new store, since
+    bytes compressed with the old dictionary cannot be decoded with the new one. Returns 1 if successful, 0 if out of
+    memory (the table is left as it was).*/
+    ResponseStore* old = table->responses;
+    ResponseStore* store = create_response_store(old->size);
+    if (store == NULL) return 0;
+    store->compress = compress;
+
+    if (compress && dict_size > 0 && old->count > 0) {
+        const char** texts = (const char**) malloc (old->count * sizeof(char*));
+        size_t* lens = (size_t*) malloc (old->count * sizeof(size_t));
+        int count = 0;
+        for (int i=0; texts && lens && i<old->size; i++) {
+            for (Response* r = old->buckets[i]; r; r = r->next) {
+                char* text = (char*) malloc (r->len + 1);
+                if (text == NULL) continue; //Train on fewer responses.
+                response_copy(old, r, text, r->len + 1);
+                texts[count] = text;
+                lens[count++] = r->len;
+            }
+        }
+        if (count > 0) store->dict = dict_train(texts, lens, count, dict_size); //count is 0 if texts or lens could not be allocated.
+        for (int i=0; i<count; i++) free((char*) texts[i]);
+        free(texts);
+        free(lens);
+    }
+
+    /*Intern every item's response into the new store first, and only point the items at them once all succeeded.*/
+    int nitems = 0;
+    for (int i=0; i<table->size; i++) {
+        if (table->items[i].responses != NULL) nitems++;
+        for (LinkedList* l = table->obuckets[i]; l; l = l->next) nitems++;
+    }
+    Response** moved = (Response**) malloc ((nitems + 1) * sizeof(Response*));
+    int k = 0;
+    for (int i=0; moved && k >= 0 && i<table->size; i++) {
+        if (table->items[i].responses != NULL && (moved[k++] = move_response(table, store, &table->items[i])) == NULL) k = -1;
+        for (LinkedList* l = table->obuckets[i]; k >= 0 && l; l = l->next)
+            if ((moved[k++] = move_response(table, store, &l->item)) == NULL) k = -1;
+    }
+    if (moved == NULL || k < 0) { //Out of memory, the items still point into the old store.
+        free(moved);
+        free_response_store(store);
+        return 0;
+    }
+    k = 0;
+    for (int i=0; i<table->size; i++) {
+        if (table->items[i].responses != NULL) table->items[i].responses = moved[k++];
+        for (LinkedList* l = table->obuckets[i]; l; l = l->next) l->item.responses = moved[k++];
+    }
+    free(moved);
+    store->spilled = old->spilled; //The evicted responses came along as they were.
+    store->spilled_bytes = old->spilled_bytes;
+    table->responses = store;
+    free_response_store(old); //Every item now holds a response in the new store.
+    return 1;
+}
+
+/*Method of handling collision for this hash table is through separate chaining. This means that whenever there is a collision,
+we add items that collide on the same index to the overflow bucket which is basically a linked list.
+
+Each slot of the table holds a Node itself rather than a pointer to one. A Node fills one cache line, the slots start on
+one (see cache_aligned_alloc()), and a Node keeps the hash, intent tag and (if short) the entity together, so a
+successful lookup in a slot touches a single cache line. There is no
+separate key string, the key is the intent tag followed by the entity.*/
+
+unsigned int key_hash(int intent, const char* entity, size_t len) {
+    /*Hashes the key made of the intent tag followed by the entity, with the same Jenkins one at a time steps as
+    hash_function(), without building the key in a buffer.*/
+    unsigned int hash = 0;
+    hash += (unsigned char) intent;
+    hash += (hash << 10);
+    hash ^= (hash >> 6);
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash += entity[i];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+const char* node_entity(const Node* item) {
+    // Returns the entity of an item, wherever it is stored.
+    return item->len < NODE_INLINE ? item->entity.inline_entity : item->entity.long_entity;
+}
+
+static int node_matches(const Node* item, unsigned int hash, int intent, const char* entity, size_t len) {
+    // Checks whether item holds the key, comparing the hash first so most mismatches never look at the entity.
+    return item->hash == hash && item->intent == intent && item->len == len && memcmp(node_entity(item), entity, len) == 0;
+}
+
+static int fill_item(Node* item, unsigned int hash, int intent, const char* entity, size_t len, Response* responses) {
+    /*Fills in an item. Short entities are copied inside the item, longer ones into their own block.
+    The item takes over the reference held on responses. Returns 0 if out of memory.*/
+    if (len >= NODE_INLINE) {
+        char* copy = (char*) malloc (len + 1);
+        if (copy == NULL) return 0;
+        memcpy(copy, entity, len + 1);
+        item->entity.long_entity = copy;
+    } else {
+        memcpy(item->entity.inline_entity, entity, len + 1);
+    }
+    item->hash = hash;
+    item->len = len;
+    item->intent = intent;
+    item->flags = 0;
+    item->ref = 0;
+    item->responses = responses;
+    return 1;
+}
+
+static LinkedList* allocate_memory_list () {
+    // Allocates memory for a Linkedlist pointer
+    LinkedList* list = (LinkedList*) malloc (sizeof(LinkedList)); //Allocate memory for Linkedlist.
+    return list;
+}
+
+static void free_cells(LinkedList* list) {
+    //Frees a list of empty cells.
+    while (list) {
+        LinkedList* next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+static void free_linkedlist(HashTable* table, LinkedList* list) {
+    //Removes linkedlist object.
+    LinkedList* temp = list; 
+    /*While there are still items in list/while list is not null, free up all items and its attributes in linkedlist*/
+    while (list) { 
+        temp = list; 
+        list = list->next;
+        free_item(table, &temp->item);
+        free(temp);
+    }
+}
+
+static LinkedList** create_overflow_buckets(HashTable* table) {
+    /*Create the overflow buckets; an array of linkedlists. 
+    Each node/item in hashtable will have its own overflow bucket thus you will need to set aside
+    tablesize*linkedlist of memory space. */
+    LinkedList** buckets = (LinkedList**) calloc (table->size, sizeof(LinkedList*)); //Allocate memory for overflow bucket and set all values in memory to 0
+    for (int i=0; i<table->size; i++) 
+        buckets[i] = NULL; //for each bucket set its value to be NULL. Which means the bucket contains nothing.
+    return buckets;
+}
+
+static void free_overflow_buckets(HashTable* table) {
+    // Free all the overflow bucket lists
+    LinkedList** buckets = table->obuckets;
+    for (int i=0; i<table->size; i++){
+        if (buckets[i] == NULL) continue;
+        free_linkedlist(table, buckets[i]);
+    }
+    free(buckets);
+}
+
+void* cache_aligned_alloc(size_t size) {
+    /*Allocates size bytes of zeroes starting on a cache line, so an array of Nodes puts each in exactly one line
+    rather than across two, as malloc()'s 16 byte alignment would. Free it with cache_aligned_free(). Returns NULL
+    if out of memory.*/
+    size_t bytes = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE; //aligned_alloc() takes whole lines.
+#ifdef _WIN32
+    void* block = _aligned_malloc(bytes ? bytes : CACHE_LINE, CACHE_LINE);
+#else
+    void* block = aligned_alloc(CACHE_LINE, bytes ? bytes : CACHE_LINE);
+#endif
+    if (block != NULL) memset(block, 0, bytes);
+    return block;
+}
+
+void cache_aligned_free(void* block) {
+    // Frees a block allocated by cache_aligned_alloc().
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
+
+HashTable* create_table(int size) {
+    // Creates a new HashTable
+    HashTable* table = (HashTable*) malloc (sizeof(HashTable)); //Allocate memory for hashtable.
+    if (table == NULL) return NULL;
+    table->size = size; //Set size of hashtable to be capacity
+    table->count = 0; //Set number of items in hashtable to be 0.
+    table->deleted = 0;
+    table->frozen = NULL;
+    table->items = (Node*) cache_aligned_alloc ((size_t) table->size * sizeof(Node)); //Allocate the slots, a slot with no response is empty.
+    table->obuckets = create_overflow_buckets(table); //Create overflow bucket of hashtable.
+    table->responses = create_response_store(size); //Create the store shared by the responses of all items.
+    if (table->items == NULL || table->obuckets == NULL || table->responses == NULL) {
+        cache_aligned_free(table->items);
+        free(table->obuckets);
+        free_response_store(table->responses);
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void free_item(HashTable* table, Node* item) {
+    // Frees what an item holds and drops its reference on the response. The item itself lives in a slot or list.
+    if (item->len >= NODE_INLINE) free(item->entity.long_entity);
+    response_release(table->responses, item->responses);
+    item->responses = NULL;
+}
+
+void free_table(HashTable* table) {
+    if (table == NULL) return;
+    // Frees the table which is used to reset the chatbot.
+    if (table->frozen != NULL) { //A frozen table is one block, its items and responses go with it.
+        free_response_store(table->responses);
+        free_frozen(table->frozen);
+        free(table);
+        return;
+    }
+    for (int i=0; i<table->size; i++) { //For each item in the hashtable, free its memory if there is are values in the it.
+        Node* item = &table->items[i];
+        if (item->responses != NULL)
+            free_item(table, item);
+    }
+    
+    free_overflow_buckets(table); //free overflow bucket
+    free_response_store(table->responses); //free the responses, all references are gone by now.
+    cache_aligned_free(table->items); //free memory space allocated for table items.
+    free(table); //free the table.
+}
+
+static void ht_place(Node* items, LinkedList** obuckets, int size, Node* item, LinkedList* cell) {
+    /*Places an item being moved by ht_rehash() into the new arrays. cell is the overflow bucket cell that held
+    the item (reused if the item collides again, freed if not), or a spare cell if the item came from a slot.*/
+    unsigned long index = item->hash % size;
+    if (items[index].responses == NULL) {
+        items[index] = *item;
+        free(cell);
+        return;
+    }
+    cell->item = *item;
+    cell->next = obuckets[index];
+    obuckets[index] = cell;
+}
+
+static int ht_rehash(HashTable* table, int size) {
+    /*Moves every item into new arrays of size slots. Items are moved as they are (a Node holds no pointer to
+    its slot), so only the overflow bucket cells change hands. The cells needed for items leaving a slot are
+    counted and allocated first, so once the move starts it cannot fail. Returns 0 if out of memory, leaving
+    the table as it was.*/
+    Node* items = (Node*) cache_aligned_alloc ((size_t) size * sizeof(Node));
+    LinkedList** obuckets = (LinkedList**) calloc (size, sizeof(LinkedList*));
+    if (items == NULL || obuckets == NULL) {
+        cache_aligned_free(items);
+        free(obuckets);
+        return 0;
+    }
+
+    /*Walk the items in the order they will be moved, marking the new slots taken, to count the items now
+    in a slot that will collide.*/
+    int needed = 0;
+    HtIter iter;
+    Node* item;
+    ht_iter_init(&iter);
+    while ((item = ht_next(table, &iter)) != NULL) {
+        Node* slot = &items[item->hash % size];
+        if (slot->responses == NULL) slot->responses = item->responses;
+        else if (item >= table->items && item < table->items + table->size) needed++;
+    }
+    memset(items, 0, size * sizeof(Node));
+    LinkedList* spare = NULL; //Cells for the items leaving a slot.
+    for (int i = 0; i < needed; i++) {
+        LinkedList* cell = allocate_memory_list();
+        if (cell == NULL) {
+            free_cells(spare);
+            cache_aligned_free(items);
+            free(obuckets);
+            return 0;
+        }
+        cell->next = spare;
+        spare = cell;
+    }
+
+    for (int i = 0; i < table->size; i++) {
+        Node* slot = &table->items[i];
+        if (slot->responses != NULL) {
+            LinkedList* cell = NULL;
+            if (items[slot->hash % size].responses != NULL) { //Collides, take a spare cell.
+                cell = spare;
+                spare = spare->next;
+            }
+            ht_place(items, obuckets, size, slot, cell);
+        }
+        for (LinkedList* l = table->obuckets[i]; l; ) {
+            LinkedList* next = l->next;
+            Node moving = l->item;
+            ht_place(items, obuckets, size, &moving, l);
+            l = next;
+        }
+    }
+
+    cache_aligned_free(table->items);
+    free(table->obuckets);
+    table->items = items;
+    table->obuckets = obuckets;
+    table->size = size;
+    table->deleted = 0; //Every slot with a bucket holds an item again.
+    return 1;
+}
+
+int ht_reserve(HashTable* table, int count) {
+    /*Grows the table so count more items fit without it growing again. Growing once up front is cheaper than
+    growing step by step as the items arrive. Returns 0 if out of memory, the table then stays as it was.*/
+    if (table->frozen != NULL) return 0;
+    long needed = (long) table->count + count;
+    if (needed <= table->size) return 1;
+    long size = table->size;
+    while (size < needed) size = size * 2 + 1; //Odd sizes, as CAPACITY, spread the hashes over every slot.
+    if (size > 0x7fffffff) return 0;
+    return ht_rehash(table, (int) size);
+}
+
+static Node* ht_insert_hashed(HashTable* table, int intent, const char* entity, size_t len, unsigned int hash, const char* response) {
+    /*Inserts or overwrites the item with this key, whose hash is already known. Returns the item, or NULL if out of memory
+    or if the table is frozen.*/
+    if (table->frozen != NULL) return NULL;
+    unsigned long index = hash % table->size; //Calculate index/key of item
+    Node* existing = NULL;
+    if (table->items[index].responses != NULL && node_matches(&table->items[index], hash, intent, entity, len))
+        existing = &table->items[index];
+    for (LinkedList* l = table->obuckets[index]; existing == NULL && l; l = l->next)
+        if (node_matches(&l->item, hash, intent, entity, len)) existing = &l->item;
+
+    Response* r = response_intern(table->responses, response); //Get a shared handle to the response.
+    if (r == NULL) return NULL;
+    if (existing != NULL) {
+        /*If the key already exists, swap in a handle to the new response and drop the old one.
+        Interning first means overwriting with the same text never frees and reallocates it.*/
+        response_release(table->responses, existing->responses);
+        existing->responses = r;
+        existing->flags = 0; //A tombstone written over becomes a live entry again.
+        return existing;
+    }
+
+    if (table->count >= table->size && ht_reserve(table, table->size)) {
+        index = hash % table->size; //The table grew to keep the buckets short, the item goes to its new index.
+    }
+
+    if (table->items[index].responses == NULL) { 
+        /*If the slot is empty, insert the item into it and increase count.*/
+        if (!fill_item(&table->items[index], hash, intent, entity, len, r)) {
+            response_release(table->responses, r);
+            return NULL;
+        }
+        table->count++; //Increase count.
+        return &table->items[index]; 
+    }
+
+    // Scenario 2: Collision. Add the item to the front of the overflow bucket at the same index.
+    LinkedList* node = allocate_memory_list();
+    if (node == NULL || !fill_item(&node->item, hash, intent, entity, len, r)) {
+        free(node);
+        response_release(table->responses, r);
+        return NULL;
+    }
+    node->next = table->obuckets[index];
+    table->obuckets[index] = node;
+    table->count++;
+    return &node->item;
+}
+
+Node* ht_insert(HashTable* table, int intent, const char* entity, const char* response) {
+    /*Inserts or overwrites the item with this key. Returns the item, or NULL if out of memory.
+    The table grows once it holds as many items as it has slots, which moves every item.*/
+    size_t len = strlen(entity);
+    return ht_insert_hashed(table, intent, entity, len, key_hash(intent, entity, len), response);
+}
+
+int ht_insert_batch(HashTable* table, HtEntry* entries, int count, Node** results) {
+    /*Inserts or overwrites many items, in order, so a later entry with the same key wins. All keys are hashed
+    first and the table grows once to fit them all, then each insert prefetches the slot and bucket of the entry
+    HT_PREFETCH_AHEAD places later, so its cache misses overlap with the work on the entries before it.
+    results[i] receives the item of entries[i], or NULL if it could not be stored. Returns the number stored.*/
+    for (int i = 0; i < count; i++) {
+        entries[i].len = strlen(entries[i].entity);
+        entries[i].hash = key_hash(entries[i].intent, entries[i].entity, entries[i].len);
+    }
+    if (table->frozen != NULL) return 0;
+    ht_reserve(table, count); //If this fails the table still grows step by step.
+
+    int stored = 0;
+    for (int i = 0; i < count; i++) {
+        if (i + HT_PREFETCH_AHEAD < count) {
+            unsigned long ahead = entries[i + HT_PREFETCH_AHEAD].hash % table->size;
+            __builtin_prefetch(&table->items[ahead], 1);
+            __builtin_prefetch(&table->obuckets[ahead], 0);
+        }
+        results[i] = ht_insert_hashed(table, entries[i].intent, entries[i].entity, entries[i].len, entries[i].hash, entries[i].response);
+        if (results[i] != NULL) stored++;
+    }
+    return stored;
+}
+
+Node* ht_search(HashTable* table, int intent, const char* entity) {
+    /*Search for the key in its slot, then in the overflow bucket at the same index.*/
+    if (table->frozen != NULL) return frozen_search(table, intent, entity);
+    size_t len = strlen(entity);
+    unsigned int hash = key_hash(intent, entity, len);
+    unsigned long index = hash % table->size; //Calculate index/key of item
+    Node* item = &table->items[index]; //Set Node to be item at index of hashtable.
+    if (__atomic_load_n(&item->responses, __ATOMIC_RELAXED) != NULL && node_matches(item, hash, intent, entity, len)) //The response may be evicted meanwhile (see spill.c), but never to NULL.
+        return item;
+    for (LinkedList* l = table->obuckets[index]; l; l = l->next) //Else look through the overflow bucket.
+        if (node_matches(&l->item, hash, intent, entity, len))
+            return &l->item;
+    return NULL;
+}
+
+void ht_search_batch(HashTable* table, HtEntry* keys, int count, Node** results) {
+    /*Searches for many keys at once. results[i] receives the item of keys[i], or NULL if there is none.
+    The keys are taken HT_SEARCH_GROUP at a time through three stages: hash each key and prefetch its slot and
+    bucket, then check each slot and prefetch the first overflow cell where the slot did not match, then walk
+    those buckets. Each stage touches memory the previous stage asked for, so the cache misses of a whole
+    group are waited on together rather than one after another.*/
+    if (table->frozen != NULL) {
+        frozen_search_batch(table, keys, count, results);
+        return;
+    }
+    for (int first = 0; first < count; first += HT_SEARCH_GROUP) {
+        int last = first + HT_SEARCH_GROUP < count ? first + HT_SEARCH_GROUP : count;
+        for (int i = first; i < last; i++) {
+            keys[i].len = strlen(keys[i].entity);
+            keys[i].hash = key_hash(keys[i].intent, keys[i].entity, keys[i].len);
+            unsigned long index = keys[i].hash % table->size;
+            __builtin_prefetch(&table->items[index], 0);
+            __builtin_prefetch(&table->obuckets[index], 0);
+        }
+        for (int i = first; i < last; i++) {
+            Node* item = &table->items[keys[i].hash % table->size];
+            results[i] = __atomic_load_n(&item->responses, __ATOMIC_RELAXED) != NULL && node_matches(item, keys[i].hash, keys[i].intent, keys[i].entity, keys[i].len) ? item : NULL;
+            if (results[i] == NULL && table->obuckets[keys[i].hash % table->size] != NULL)
+                __builtin_prefetch(table->obuckets[keys[i].hash % table->size], 0);
+        }
+        for (int i = first; i < last; i++) {
+            if (results[i] != NULL) continue;
+            for (LinkedList* l = table->obuckets[keys[i].hash % table->size]; l; l = l->next)
+                if (node_matches(&l->item, keys[i].hash, keys[i].intent, keys[i].entity, keys[i].len)) {
+                    results[i] = &l->item;
+                    break;
+                }
+        }
+    }
+}
+
+int ht_delete(HashTable* table, int intent, const char* entity) {
+    /*Removes the item with this key in O(1) expected time, without moving any other item. An item in a slot is
+    freed where it is and the slot left empty: lookups go on to the overflow bucket whether the slot is empty or
+    not, so the items behind it need not move up, and pointers to them stay valid. The next insert at this index
+    fills the slot again, or ht_compact() does. An item in the overflow bucket is unlinked from it.
+    Returns 1 if it was found, 0 if not (or if the table is frozen).*/
+    if (table->frozen != NULL) return 0;
+    size_t len = strlen(entity);
+    unsigned int hash = key_hash(intent, entity, len);
+    unsigned long index = hash % table->size; //Calculate index/key of item
+    Node* item = &table->items[index]; //Set Node to be item at index of hashtable.
+
+    if (item->responses != NULL && node_matches(item, hash, intent, entity, len)) {
+        free_item(table, item); //Leaves the slot empty.
+        table->count--;
+        table->deleted++;
+        return 1;
+    }
+
+    for (LinkedList** link = &table->obuckets[index]; *link; link = &(*link)->next) {
+        /*If the item lies somewhere in the linkedlist, unlink it from its previous item and remove it.*/
+        LinkedList* curr = *link;
+        if (node_matches(&curr->item, hash, intent, entity, len)) {
+            *link = curr->next;
+            free_item(table, &curr->item);
+            free(curr);
+            table->count--;
+            table->deleted++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+HashTable* ht_compact(HashTable* table) {
+    /*Builds a new table holding the items of this one, sized for them with room to grow, so that after many
+    deletions every item is in a slot again where it can be, and a table that shrank gives back its memory.
+    The items are copied as they are, and the new table takes over their entities, their responses and the
+    response store, so nothing but the slots and bucket cells is allocated. This table is left untouched for
+    lookups still using it; free it with free_table_shell() once there are none. Returns the new table, or NULL
+    if out of memory.*/
+    long size = CAPACITY;
+    while (size < 2L * table->count) size = size * 2 + 1; //Odd sizes, as ht_reserve() grows to.
+    if (size > 0x7fffffff) return NULL;
+    HashTable* fresh = (HashTable*) malloc (sizeof(HashTable));
+    if (fresh == NULL) return NULL;
+    fresh->size = (int) size;
+    fresh->count = table->count;
+    fresh->deleted = 0;
+    fresh->frozen = NULL;
+    fresh->responses = table->responses;
+    fresh->items = (Node*) cache_aligned_alloc ((size_t) fresh->size * sizeof(Node));
+    fresh->obuckets = (LinkedList**) calloc (fresh->size, sizeof(LinkedList*));
+    if (fresh->items == NULL || fresh->obuckets == NULL) {
+        free_table_shell(fresh);
+        return NULL;
+    }
+
+    HtIter iter;
+    Node* item;
+    ht_iter_init(&iter);
+    while ((item = ht_next(table, &iter)) != NULL) {
+        unsigned long index = item->hash % fresh->size;
+        if (fresh->items[index].responses == NULL) {
+            fresh->items[index] = *item;
+            continue;
+        }
+        LinkedList* cell = allocate_memory_list();
+        if (cell == NULL) {
+            free_table_shell(fresh);
+            return NULL;
+        }
+        cell->item = *item;
+        cell->next = fresh->obuckets[index];
+        fresh->obuckets[index] = cell;
+    }
+    return fresh;
+}
+
+void free_table_shell(HashTable* table) {
+    /*Frees the slots and bucket cells of a table, but not what its items hold nor its response store, which
+    belong to the table ht_compact() made from it (or to the table it was made from, if it was never used).*/
+    if (table == NULL) return;
+    if (table->obuckets != NULL)
+        for (int i=0; i<table->size; i++) free_cells(table->obuckets[i]);
+    free(table->obuckets);
+    cache_aligned_free(table->items);
+    free(table);
+}
+
+void ht_iter_init(HtIter* iter) {
+    // Sets iter to the start of the table.
+    iter->index = 0;
+    iter->list = NULL;
+}
+
+Node* ht_next(HashTable* table, HtIter* iter) {
+    /*Returns the next item of the table, or NULL once every item has been returned.
+    Each slot is followed by its overflow bucket, so items that collided are visited too.*/
+    for (;;) {
+        if (iter->list != NULL) {
+            Node* item = &iter->list->item;
+            iter->list = iter->list->next;
+            return item;
+        }
+        if (iter->index >= table->size) return NULL;
+        int i = iter->index++;
+        iter->list = table->obuckets != NULL ? table->obuckets[i] : NULL; //A frozen table has no overflow buckets.
+        if (table->items[i].responses != NULL) return &table->items[i];
+    }
+}
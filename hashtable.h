@@ -0,0 +1,188 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file contains the definitions and function prototypes of the hash
+ * table holding the chatbot's knowledge. It is internal to libchat1002;
+ * programs using the library only need chat1002.h.
+ */
+
+#ifndef _HASHTABLE_H
+#define _HASHTABLE_H
+#include <stddef.h>
+#include <stdio.h>
+
+/* the number of slots in the hash table of a knowledge base */
+#define CAPACITY 1001
+#define HT_PREFETCH_AHEAD 8 //Number of entries ht_insert_batch() prefetches ahead.
+#define HT_SEARCH_GROUP 16 //Number of keys ht_search_batch() looks up together.
+
+/* the size of the dictionary trained for compressed responses */
+#define DICT_SIZE    16384
+
+/* intent tags, stored in each Node in place of the name of the intent */
+#define INTENT_WHAT  0
+#define INTENT_WHERE 1
+#define INTENT_WHO   2
+#define INTENT_COUNT 3
+#define INTENT_ALIAS INTENT_COUNT //tag of an alias, whose response is the entity it stands for
+
+/* flags of a Node */
+#define NODE_TOMBSTONE 1 //the entry is deleted in an overlay, hiding the entry of the base below it
+
+/* clen of a response evicted to a spill file; its text then holds a Spilled */
+#define RESPONSE_SPILLED ((size_t) -1)
+
+/* entities shorter than this are stored inside their Node, longer ones in a block of their own */
+#define NODE_INLINE  40
+
+/* the size of a cache line, which a Node fills and the slots of a table are aligned to */
+#define CACHE_LINE   64
+
+typedef struct Dictionary Dictionary; //Shared dictionary used to compress responses.
+struct Dictionary {
+    char *data; //Dictionary bytes, matches in compressed responses may point into them.
+    int len; //Number of bytes in data.
+    int *head; //Last position in data for each hash of 4 bytes, used to find matches.
+    int *prev; //Previous position in data with the same hash.
+};
+
+typedef struct Response Response; //Interned response text, shared by every Node that has the same answer.
+struct Response {
+    unsigned int hash; //Hash of the text, used to find it again in the response store.
+    int refcount; //Number of Nodes holding this response. Freed when it drops to 0.
+    size_t len; //Length of the response, excluding the terminating null.
+    size_t clen; //Size of text if it is compressed, 0 if text holds the response as is.
+    Response* next; //Next response in the same store bucket.
+    char text[]; //The response text itself (or its compressed form), stored in the same block.
+};
+
+typedef struct Spilled Spilled; //Where the text of an evicted response is, see spill.c.
+struct Spilled {
+    long offset; //Offset of the text in the spill file.
+    int fd; //The spill file.
+};
+
+typedef struct ResponseStore ResponseStore; //Content addressed store of responses (hash -> refcounted blob).
+struct ResponseStore {
+    Response** buckets; //Chained buckets of responses.
+    int size; //Number of buckets.
+    int count; //Number of distinct responses stored.
+    size_t bytes; //Bytes of response text stored, used to report memory usage.
+    size_t raw_bytes; //Bytes the responses take uncompressed.
+    int compress; //Set to compress responses as they are interned.
+    Dictionary* dict; //Dictionary trained from the responses, or NULL.
+    int spilled; //Number of evicted responses, held by their Node alone and not in the buckets.
+    size_t spilled_bytes; //Bytes of evicted responses in the spill file.
+};
+
+typedef struct node_struct Node; //Hash table entry. Sized to fill one 64 byte cache line, so a lookup touches one line.
+struct node_struct {
+    unsigned int hash; //Hash of the key (intent tag followed by entity), compared before the entity itself.
+    unsigned int len; //Length of the entity, excluding the terminating null.
+    unsigned char intent; //Intent tag, one of INTENT_WHAT, INTENT_WHERE or INTENT_WHO, or INTENT_ALIAS.
+    unsigned char flags; //NODE_TOMBSTONE if the entry records a deletion.
+    unsigned char ref; //Set by lookups, cleared by the eviction hand in spill.c.
+    Response *responses; //Handle to the interned response, owned through its refcount. NULL if the slot is empty.
+    union {
+        char inline_entity[NODE_INLINE]; //The entity, if it is shorter than NODE_INLINE.
+        char *long_entity; //Else the entity, in its own block.
+    } entity;
+};
+_Static_assert(sizeof(Node) == CACHE_LINE, "a Node must fill one cache line");
+
+typedef struct LinkedList LinkedList; //Create LinkedList data structure to handle collisions from hashtable.
+struct LinkedList {
+    Node item; //Stores the item itself.
+    LinkedList* next; //Stores address of next item in the linkedlist.
+};
+
+typedef struct HtIter HtIter; //Position of a walk over every item of a hashtable, see ht_next().
+struct HtIter {
+    int index; //Next slot to visit.
+    LinkedList* list; //Next item to visit in the overflow bucket of the previous slot.
+};
+
+typedef struct HtEntry HtEntry; //An item to insert with ht_insert_batch(), or a key to look up with ht_search_batch().
+struct HtEntry {
+    int intent; //Intent tag.
+    const char* entity;
+    const char* response; //Not used by ht_search_batch().
+    size_t len; //Length of the entity, filled in by ht_insert_batch() and ht_search_batch().
+    unsigned int hash; //Hash of the key, filled in by ht_insert_batch() and ht_search_batch().
+};
+
+typedef struct Frozen Frozen; //The minimal perfect hash index of a frozen table, see frozen.c.
+struct Frozen {
+    char* image; //The image the table was read from, in one block: its items, entities and responses are in it.
+    size_t size; //Bytes of the image.
+    size_t mapped; //Bytes mapped for the image by numa_map(), or 0 if it was allocated with malloc().
+    unsigned long long seed; //Seed of the hash of the keys.
+    unsigned long long slots; //Positions the pilots map keys to, a few more than there are items.
+    unsigned long long buckets; //Number of pilots.
+    unsigned long long dense_buckets; //Buckets the dense part of the hashes goes to.
+    unsigned long long dense_hash; //Hashes below this are in the dense part.
+    const unsigned char* pilots; //The pilot of each bucket, which places its keys, or 255 if it is in overflow.
+    const unsigned int* overflow; //Pairs of bucket and pilot, by bucket, for the pilots from 255 up.
+    unsigned long long overflows; //Number of pairs in overflow.
+    const unsigned int* remap; //Item of each position past the last item that is taken.
+};
+
+typedef struct HashTable HashTable; //Hashtable data structure. Hashtable is a array of pointers, makes it easy to search up nodes.
+struct HashTable{
+    Node* items; //Array of slots, each holding a Node.
+    int size; //Size of the hash table.
+    int count; //Number of items in hashtable
+    int deleted; //Items deleted since the items were last placed, each may leave a slot empty in front of its bucket.
+    LinkedList** obuckets; //Stores linkedlist in case of collision.
+    ResponseStore* responses; //Interned responses referenced by the nodes of this table.
+    Frozen* frozen; //Set if the table is frozen: items then hold count items in the order of its index, and obuckets is NULL.
+};
+
+/* functions defined in compress.c */
+Dictionary *dict_train(const char **texts, const size_t *lens, int count, int size);
+void free_dictionary(Dictionary *dict);
+size_t dict_compress_bound(size_t len);
+size_t dict_compress(const Dictionary *dict, const char *src, size_t len, char *dst);
+size_t dict_decompress(const Dictionary *dict, const char *src, size_t len, char *dst, size_t n);
+Dictionary *dict_load(const char *data, int len);
+
+/* functions defined in hashtable.c */
+void* cache_aligned_alloc(size_t size);
+void cache_aligned_free(void* block);
+unsigned int hash_function(char *key, size_t len);
+ResponseStore* create_response_store(int size);
+void free_response_store(ResponseStore* store);
+Response* response_intern(ResponseStore* store, const char* text);
+void response_release(ResponseStore* store, Response* response);
+size_t response_copy(const ResponseStore* store, const Response* response, char* buf, size_t n);
+Response* response_spilled(ResponseStore* store, size_t len, long offset, int fd);
+Response* response_retire(ResponseStore* store, Response* response);
+int ht_compress_responses(HashTable* table, int compress, int dict_size);
+unsigned int key_hash(int intent, const char* entity, size_t len);
+const char* node_entity(const Node* item);
+HashTable* create_table(int size);
+void free_item(HashTable* table, Node* item);
+void free_table(HashTable* table);
+int ht_reserve(HashTable* table, int count);
+Node* ht_insert(HashTable* table, int intent, const char* entity, const char* response);
+int ht_insert_batch(HashTable* table, HtEntry* entries, int count, Node** results);
+Node* ht_search(HashTable* table, int intent, const char* entity);
+void ht_search_batch(HashTable* table, HtEntry* keys, int count, Node** results);
+int ht_delete(HashTable* table, int intent, const char* entity);
+HashTable* ht_compact(HashTable* table);
+void free_table_shell(HashTable* table);
+void ht_iter_init(HtIter* iter);
+Node* ht_next(HashTable* table, HtIter* iter);
+
+/* functions defined in frozen.c */
+int frozen_write(HashTable* table, FILE* f, size_t* index_bytes);
+HashTable* frozen_read(FILE* f, int* error);
+HashTable* frozen_copy(const HashTable* table, char* image, size_t mapped);
+Node* frozen_search(HashTable* table, int intent, const char* entity);
+void frozen_search_batch(HashTable* table, HtEntry* keys, int count, Node** results);
+void free_frozen(Frozen* frozen);
+
+/* functions defined in spill.c */
+size_t spill_read(const Spilled* spilled, char* buf, size_t len);
+
+#endif
@@ -1,211 +1,1433 @@
-/*
- * INF1002 (C Language) Group Project.
- *
- * This file implements the chatbot's knowledge base.
- *
- * knowledge_get() retrieves the response to a question.
- * knowledge_put() inserts a new response to a question.
- * knowledge_read() reads the knowledge base from a file.
- * knowledge_reset() erases all of the knowledge.
- * knowledge_write() saves the knowledge base in a file.
- *
- * You may add helper functions as necessary.
- */
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include "chat1002.h" //uncomment this line if you have error.
-#include "hashtable.c"
-#define CAPACITY 1001 // Size of the Hash Table
-
-Node *head = NULL;
-Node *end = NULL;
-HashTable* ht = NULL;
-
-/*
- * Get the response to a question.
- *
- * Input:
- *   intent   - the question word
- *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
- *
- * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
- *   KB_NOTFOUND, if no response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
- */
-
-void hashtable_callup(){
-	if (ht == NULL)	ht = create_table(CAPACITY); //If hashtable does not exist then create a hashtable.
-}
-
-int knowledge_get(const char *intent, const char *entity, char *response, int n) {
-	if (chatbot_is_question(intent) == KB_INVALID) { //If first word of user is not intent then return KB_invalid/not recognised.
-		return KB_INVALID;
-	}
-	char* key = (char*)calloc(1, MAX_INTENT+1+MAX_ENTITY+1); //allocate memory space of MAX_INTENT+MAX_ENTITY for key.
-	char *tempintent = (char*) calloc (1, MAX_INTENT);
-	strcpy(tempintent, intent);
-	for (int i = 0; i <strlen(tempintent); i++){
-		tempintent[i]=tolower(tempintent[i]);
-	}
-	strcpy(key, tempintent); //Copy intent onto key
-	strcat(key, entity); //Concatenate entity onto key. Eg. Who is Mike will become whoMike. This is used to create unique keys for hashtable.
-	Node* knowledge = ht_search(ht, key); //Invoke ht_search which return knowledge node if found.
-	free(key);
-	free(tempintent);
-	if (knowledge == NULL) { //If knowledge node is empty then return item not found.
-			return KB_NOTFOUND;
-		}
-	else{ //Else if item is not empty then print out response to user.
-			char * buf = NULL; 
-    		buf = knowledge->responses;
-			snprintf(response, n, "%s", buf);
-			return KB_OK;
-	}
-
-}
-
-
-/*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
- *
- * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
- *
- * Returns:
- *   KB_FOUND, if successful
- *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
- */
-int knowledge_put(const char *intent, const char *entity, const char *response) {
-	if (chatbot_is_question(intent) == KB_INVALID) { //If first word of user is not intent then return KB_invalid/not recognised.
-		return KB_INVALID;
-	}
-	char* key = (char*)calloc(1, MAX_INTENT+1+MAX_ENTITY+1); //allocate memory space of MAX_INTENT+MAX_ENTITY for key.
-	char *tempintent = (char*) calloc (1, MAX_INTENT);
-	strcpy(tempintent, intent);
-	for (int i = 0; i <strlen(tempintent); i++){
-		tempintent[i]=tolower(tempintent[i]);
-	}
-	strcpy(key, tempintent); //Copy intent onto key
-	strcat(key, entity); //Concatenate entity onto key. Eg. Who is Mike will become whoMike. This is used to create unique keys for hashtable.
-	int successful = ht_insert(ht, key, intent, entity, response); //Invoke ht_insert which return knowledge node if found.
-    if (!successful){ //If unable to be inserted into hashtable then return memory allocation error.
-            return KB_NOMEM;
-        }
-	free(tempintent);
-	free(key);
-	return KB_OK; //else return it is successful. 
-
-}
-
-
-/*
- * Read a knowledge base from a file.
- *
- * Input:
- *   f - the file
- *
- * Returns: the number of entity/response pairs successful read from the file
- */
-int knowledge_read(FILE *f) {
-	int erpair = 0; //count number of er pair successfully read from file.
-	int length = MAX_ENTITY + 1 + MAX_RESPONSE + 1; //initialise maximum length of each line/
-	int linelength = 0; //store length of each line.
-	char * buf = calloc(1, length); //allocate memory to buffer to store each line read from file.
-	if (buf == NULL) { //if unable to allocate memory then return memory allocation failure
-		return KB_NOMEM;
-	}
-	int isquestion = 0; //initalise variable isquestion to determine whether intent is valid.
-	char * headertext; //initalise variable to store intent
-	headertext = (char *)calloc(1, 7); //allocate memory to store each intent temporarily.
-	 while ((fgets(buf, length, (FILE*)f)) != NULL) { //while not end of file
-		if (buf == NULL){ //if empty line then continue to next iteration.
-			continue;
-		}
-		if (buf[0] == '['){ //if first character of line is [ then extract string between delimiters []
-			buf = strtok(buf, "]"); //removes ] from string
-			buf = strtok(buf, "["); //return [ from string
-			isquestion = chatbot_is_question(buf); //check whether string is a valid intent/question. 
-			if (!isquestion) continue; //if it is not a valid intent then continue
-			strcpy(headertext, buf); //else copy the intent from buf to headertext and continue.
-			continue;
-		}
-
-		char *entity = (char *) calloc(1, MAX_ENTITY); //allocate memory for entity and set all values in memory to be 0.
-		snprintf(entity, MAX_ENTITY, "%s", strtok(buf, "=")); //store string before delimiter = into variable entity
-
-		char *response = (char *) calloc(1, MAX_RESPONSE); //allocate memory for response and set all values in memory to be 0.
-		snprintf(response, MAX_RESPONSE, "%s", strtok(NULL, "\r\n")); //store string before delimiter "\r\n" which is a newline character into variable entity
-
-		int result = knowledge_put(headertext, entity, response); //invoke knowledge_put for data retrieved from line,
-		if (result != KB_OK) {
-			return result;
-		}
-		erpair++; //add 1 to erpair
-		free(entity); //free up memory allocated for entity
-		free(response); //free up memory allocated for response
-	}
-	free(headertext); //free up memory allocated for response
-	return erpair;
-}
-
-
-/*
- * Reset the knowledge base, removing all know entitities from all intents.
- */
-void knowledge_reset() {
-	if (ht == NULL) return; //if hash table is null/does not exist then return.
-	free_table(ht); //else invoke free_table function
-	HashTable* ht = create_table(CAPACITY); //create new empty hash table.
-}
-
-
-/*
- * Write the knowledge base to a file.
- *
- * Input:
- *   f - the file
- */
-void knowledge_write(FILE *f) {
-	fputs("[what]\n", f); //insert intent onto file
-	if (ht != NULL){ //if hashtable is not empty then iterate through it and get all items with what intent
-		for (int i = 0; i<ht->size; i++){
-			if (ht->items[i] != NULL){
-			if (compare_token(ht->items[i]->intent, "what") == 0 ){
-				fprintf(f, "%s=%s\n", ht->items[i]->entity, ht->items[i]->responses);
-			}
-			}
-		}
-	}
-
-	fputs("[where]\n", f); //insert intent onto file
-	if (ht != NULL){ //if hashtable is not empty then iterate through it and get all items with where intent
-		for (int i = 0; i<ht->size; i++){
-			if (ht->items[i]!= NULL){
-			if (compare_token(ht->items[i]->intent, "where")== 0 ){
-				fprintf(f, "%s=%s\n", ht->items[i]->entity, ht->items[i]->responses);
-			}
-			}
-		}
-	}
-	
-	fputs("[who]\n", f); //insert intent onto file
-	if (ht != NULL){ //if hashtable is not empty then iterate through it and get all items with who intent
-		for (int i = 0; i<ht->size; i++){
-			if (ht->items[i] != NULL){
-			if (compare_token(ht->items[i]->intent, "who")== 0 ){
-				fprintf(f, "%s=%s\n", ht->items[i]->entity, ht->items[i]->responses);
-			}
-			}
-		}
-	}
-}
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the chatbot's knowledge base.
+ *
+ * knowledge_get() retrieves the response to a question.
+ * knowledge_put() inserts a new response to a question.
+ * knowledge_read() reads the knowledge base from a file.
+ * knowledge_reset() erases all of the knowledge.
+ * knowledge_write() saves the knowledge base in a file.
+ * knowledge_save() saves it in the background (see save.c).
+ * knowledge_set_budget() limits the memory its responses take (see spill.c).
+ *
+ * Every function takes the knowledge base it works on, created by kb_create().
+ *
+ * A layered knowledge base (see kb_create_layered()) keeps in its own table
+ * only the entries that differ from its base. knowledge_get() looks in that
+ * table first, then in the base. knowledge_put() writes to the table, and
+ * knowledge_delete() records a tombstone in it that hides the entry of the
+ * base. The base is never modified.
+ *
+ * knowledge_alias() makes one entity answer for another, for every intent.
+ * An alias is an entry of its own intent tag, INTENT_ALIAS, whose response
+ * is the name of the entity it stands for, shared by all the aliases of that
+ * entity; it costs a Node, not a copy of every response. A question with no
+ * answer of its own is looked up again through the alias of its entity.
+ *
+ * knowledge_get() may run in any number of threads at once without locking.
+ * Functions that change the knowledge take the knowledge base's lock, and may
+ * run alongside lookups only if they replace the table rather than change it
+ * (knowledge_reload() and knowledge_reset()).
+ *
+ * You may add helper functions as necessary.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include "knowledge.h"
+#include "trace.h"
+#include "alloc.h"
+
+static const char *intent_names[INTENT_COUNT + 1] = {"what", "where", "who", "alias"}; //Names of the intents, indexed by tag, then of the alias section.
+
+/*
+ * Create an empty knowledge base.
+ *
+ * Returns: the knowledge base, or NULL if there was a memory allocation failure
+ */
+kb_t *kb_create() {
+	kb_t *kb = (kb_t *) malloc(sizeof(kb_t));
+	if (kb == NULL) {
+		return NULL;
+	}
+	kb->compress = 0;
+	kb->base = NULL;
+	kb->readonly = 0;
+	kb->saves = NULL;
+	kb->last_save = 0;
+	kb->budget = 0;
+	kb->spill_fd = -1;
+	kb->spill_end = 0;
+	kb->clock_hand = 0;
+	kb->stalled = 0;
+	kb->evictions = 0;
+	kb->refaults = 0;
+	kb->created = time(NULL);
+	atomic_init(&kb->refs, 1);
+	atomic_init(&kb->epoch, 0);
+	atomic_init(&kb->generation, 0);
+	atomic_init(&kb->readers[0], 0);
+	atomic_init(&kb->readers[1], 0);
+	atomic_init(&kb->replicas, NULL);
+	kb->nodes = 0;
+	pthread_mutex_init(&kb->lock, NULL);
+	kb->ht = create_table(CAPACITY);
+	if (kb->ht == NULL) {
+		pthread_mutex_destroy(&kb->lock);
+		free(kb);
+		return NULL;
+	}
+	return kb;
+}
+
+
+/*
+ * Create an empty knowledge base layered on a shared base.
+ *
+ * The base becomes read only from then on, and is kept alive until both its
+ * owner and every knowledge base layered on it have been freed. Layers only
+ * go one level deep: the base may not itself be layered.
+ *
+ * Input:
+ *   base - the knowledge base to build on
+ *
+ * Returns: the knowledge base, or NULL if base is layered or there was a memory allocation failure
+ */
+kb_t *kb_create_layered(kb_t *base) {
+	if (base->base != NULL) {
+		return NULL;
+	}
+	kb_t *kb = kb_create();
+	if (kb == NULL) {
+		return NULL;
+	}
+	base->readonly = 1;
+	atomic_fetch_add(&base->refs, 1);
+	kb->base = base;
+	return kb;
+}
+
+
+/*
+ * Free a knowledge base and all of its knowledge. A knowledge base still
+ * used as a base is only freed once the last layer on it is freed.
+ */
+void kb_free(kb_t *kb) {
+	if (kb == NULL) return;
+	if (atomic_fetch_sub(&kb->refs, 1) > 1) return;
+	save_jobs_free(kb); //waits for saves still running.
+	numa_free_replicas(kb);
+	free_table(kb->ht);
+	spill_free(kb);
+	kb_free(kb->base);
+	pthread_mutex_destroy(&kb->lock);
+	free(kb);
+}
+
+
+/*
+ * The table to look up entries in: the replica in the memory of the NUMA node
+ * the calling thread runs on, if the table is replicated (see numa.c), else
+ * the table itself.
+ */
+static inline HashTable *kb_local(kb_t *kb) {
+	HashTable **replicas = atomic_load_explicit(&kb->replicas, memory_order_acquire);
+	HashTable *local = replicas != NULL ? replicas[numa_current_node()] : NULL;
+	return local != NULL ? local : atomic_load(&kb->ht);
+}
+
+
+/*
+ * Enter a read of the knowledge base's table.
+ *
+ * Output:
+ *   slot - the reader count to give back to kb_leave()
+ *
+ * Returns: the table, which stays valid until kb_leave()
+ */
+static HashTable *kb_enter(kb_t *kb, unsigned int *slot) {
+	for (;;) {
+		unsigned int epoch = atomic_load(&kb->epoch);
+		atomic_fetch_add(&kb->readers[epoch & 1], 1);
+		if (atomic_load(&kb->epoch) == epoch) { //no table was swapped in between, so the writer will wait for us.
+			*slot = epoch & 1;
+			return kb_local(kb);
+		}
+		atomic_fetch_sub(&kb->readers[epoch & 1], 1);
+	}
+}
+
+
+/*
+ * Leave a read entered with kb_enter().
+ */
+static void kb_leave(kb_t *kb, unsigned int slot) {
+	atomic_fetch_sub(&kb->readers[slot], 1);
+}
+
+
+/*
+ * Wait until every reader that entered before this call has left, so what
+ * was unlinked from the table before it can be freed. The caller holds the
+ * lock.
+ */
+void kb_synchronize(kb_t *kb) {
+	unsigned int epoch = atomic_fetch_add(&kb->epoch, 1); //new readers count themselves in the other slot.
+	while (atomic_load(&kb->readers[epoch & 1]) > 0) //wait for readers that may still use what was unlinked.
+		sched_yield();
+}
+
+
+/*
+ * Replace the knowledge base's table, then wait until no reader uses the old
+ * one anymore. The caller holds the lock.
+ *
+ * Input:
+ *   fresh - the new table
+ *
+ * Returns: the old table, for the caller to free
+ */
+static HashTable *kb_swap_table(kb_t *kb, HashTable *fresh) {
+	HashTable *old = atomic_exchange(&kb->ht, fresh);
+	atomic_fetch_add(&kb->generation, 1); //after the swap, so an answer from the old table is never taken for a new one.
+	kb->stalled = 0; //the new table may fit the budget where the old one could not.
+	kb_synchronize(kb);
+	return old;
+}
+
+
+/*
+ * Get the generation of the knowledge base, which moves on after every
+ * change to what it answers: learning, forgetting, loading or resetting.
+ * An answer found after reading the generation stays right for as long as
+ * the generation stays the same, so callers may keep answers (see memo.c).
+ *
+ * Returns: the generation
+ */
+unsigned int knowledge_generation(kb_t *kb) {
+	return atomic_load(&kb->generation);
+}
+
+
+/*
+ * Compact the knowledge base's table once deletions have left it with many
+ * empty slots in front of overflow buckets, or much larger than what it
+ * holds: a copy with every item back in a slot where it can be is swapped in
+ * as knowledge_reload() swaps in a new table, so lookups go on meanwhile. It
+ * takes as many deletions as the table has items, and at least
+ * COMPACT_MIN_DELETED, so the copy costs O(1) per deletion over time.
+ * The caller holds the lock.
+ */
+static void kb_compact(kb_t *kb) {
+	HashTable *ht = kb->ht;
+	if (ht == NULL || ht->deleted < COMPACT_MIN_DELETED || ht->deleted < ht->count) return;
+	HashTable *fresh = ht_compact(ht);
+	if (fresh == NULL) return; //lookups still work with empty slots, try again after the next deletion.
+	free_table_shell(kb_swap_table(kb, fresh)); //the items and responses now belong to the new table.
+}
+
+
+/*
+ * Create an empty table for the knowledge base, compressing its responses if
+ * the knowledge base does.
+ *
+ * Returns: the table, or NULL if there was a memory allocation failure
+ */
+static HashTable *kb_new_table(kb_t *kb) {
+	HashTable *ht = create_table(CAPACITY);
+	if (ht != NULL && kb->compress) ht->responses->compress = 1; //new responses are compressed, without a dictionary until the next read.
+	return ht;
+}
+
+
+/*
+ * Get the tag of an intent.
+ *
+ * Input:
+ *   intent - the question word, in any case
+ *
+ * Returns:
+ *   INTENT_WHAT, INTENT_WHERE or INTENT_WHO, if the intent is a question word
+ *   -1, otherwise
+ */
+int intent_tag(const char *intent) {
+	for (int tag = 0; tag < INTENT_COUNT; tag++) {
+		if (compare_token(intent, intent_names[tag]) == 0) {
+			return tag;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Get the tag of a section of a knowledge file, or of the intent of an entry
+ * given to knowledge_put_batch(): an intent, or "alias" for aliases.
+ *
+ * Returns: the tag of the intent, INTENT_ALIAS, or -1 if the name is neither
+ */
+static int section_tag(const char *name) {
+	int tag = intent_tag(name);
+	return tag < 0 && compare_token(name, intent_names[INTENT_ALIAS]) == 0 ? INTENT_ALIAS : tag;
+}
+
+
+/*
+ * Get the name of an intent from its tag.
+ *
+ * Returns: the name of the intent, in lower case, or "alias" for INTENT_ALIAS
+ */
+const char *intent_name(int tag) {
+	return intent_names[tag];
+}
+
+
+/*
+ * Copy out the response of an entry a lookup found, and mark the entry as
+ * recently used for the eviction hand (see spill.c).
+ *
+ * Input:
+ *   ht       - the table holding the entry
+ *   item     - the entry
+ *   response - a buffer to receive the response
+ *   n        - the size of the response buffer
+ *
+ * Returns: 1 if the response had been evicted and was read from the spill file, 0 otherwise
+ */
+static int kb_touch(HashTable *ht, Node *item, char *response, int n) {
+	Response *r = __atomic_load_n(&item->responses, __ATOMIC_ACQUIRE); //it may be evicted or brought back meanwhile.
+	if (!__atomic_load_n(&item->ref, __ATOMIC_RELAXED)) __atomic_store_n(&item->ref, 1, __ATOMIC_RELAXED); //hot entries are not written again.
+	response_copy(ht->responses, r, response, n);
+	return r->clen == RESPONSE_SPILLED;
+}
+
+
+/*
+ * Look up an entry in the knowledge base's table, then in its base. The
+ * caller has entered a read with kb_enter().
+ *
+ * Input:
+ *   own    - the table, from kb_enter()
+ *   tag    - the tag of the intent
+ *   entity - the entity
+ *
+ * Output:
+ *   ht - the table the entry was found in
+ *
+ * Returns: the entry, which may be a tombstone, or NULL if neither table has it
+ */
+static Node *kb_search(kb_t *kb, HashTable *own, int tag, const char *entity, HashTable **ht) {
+	*ht = own;
+	Node *item = own ? ht_search(own, tag, entity) : NULL;
+	if (item == NULL && kb->base != NULL && kb->base->ht != NULL) { //If this layer does not know, ask the base, which is never replaced.
+		*ht = kb_local(kb->base);
+		item = ht_search(*ht, tag, entity);
+	}
+	return item;
+}
+
+
+/*
+ * Look up a question through the alias of its entity, for a question that
+ * has no answer of its own. An alias may stand for another alias, up to
+ * ALIAS_MAX_HOPS deep, so aliases can be added in any order.
+ *
+ * This is not resolved in the probe that missed, but takes an alias probe and
+ * an entry probe per hop, each in this layer and then its base: at most
+ * 2 * ALIAS_MAX_HOPS + 1 probes per table for a question asked through an
+ * alias, counting the one that missed. An alias stands for its entity under
+ * every intent, so it is stored once under INTENT_ALIAS, and its key hashes
+ * to a chain of its own, not to the chain of each intent's key. Resolving it
+ * in the same chain would take an alias entry per intent, tripling what a
+ * list of synonyms costs. Questions asked by the entity's own name still take
+ * one probe, and the entries aliases stand for are never copied.
+ *
+ * Input:
+ *   own    - the table, from kb_enter()
+ *   tag    - the tag of the intent
+ *   entity - the entity as asked
+ *
+ * Output:
+ *   canonical - receives the entity the alias stands for, MAX_INPUT characters at most
+ *   ht        - the table the entry was found in
+ *
+ * Returns: the entry of the entity the alias stands for, or NULL if there is none
+ */
+static Node *kb_search_alias(kb_t *kb, HashTable *own, int tag, const char *entity, char *canonical, HashTable **ht) {
+	for (int hop = 0; hop < ALIAS_MAX_HOPS; hop++) {
+		HashTable *aliases;
+		Node *alias = kb_search(kb, own, INTENT_ALIAS, entity, &aliases);
+		if (alias == NULL || (alias->flags & NODE_TOMBSTONE)) return NULL;
+		response_copy(aliases->responses, __atomic_load_n(&alias->responses, __ATOMIC_ACQUIRE), canonical, MAX_INPUT);
+		Node *item = kb_search(kb, own, tag, canonical, ht);
+		if (item != NULL && !(item->flags & NODE_TOMBSTONE)) return item;
+		entity = canonical; //the alias may stand for another alias; it is looked up before canonical is written again.
+	}
+	return NULL;
+}
+
+
+/*
+ * Get the response to a question.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity, or for the entity it is an alias of (the response is copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+
+int knowledge_get(kb_t *kb, const char *intent, const char *entity, char *response, int n) {
+	ALLOC_OP(ALLOC_OP_GET);
+	TRACE_BEGIN(key);
+	int tag = intent_tag(intent); //The key is the intent tag followed by the entity, so no key needs to be built.
+	TRACE_END(TRACE_KEY, key);
+	if (tag < 0) { //If first word of user is not intent then return KB_invalid/not recognised.
+		return KB_INVALID;
+	}
+	unsigned int slot;
+	HashTable *own = kb_enter(kb, &slot); //The table cannot be freed until kb_leave(), even if it is replaced.
+	HashTable *ht;
+	char canonical[MAX_INPUT]; //the entity the question's entity is an alias of, if it is asked through one.
+	TRACE_BEGIN(search);
+	Node* knowledge = kb_search(kb, own, tag, entity, &ht); //Invoke ht_search which return knowledge node if found.
+	if (knowledge == NULL || (knowledge->flags & NODE_TOMBSTONE)) {
+		knowledge = kb_search_alias(kb, own, tag, entity, canonical, &ht);
+		entity = canonical;
+	}
+	TRACE_END(TRACE_SEARCH, search);
+	int result = KB_NOTFOUND; //If knowledge node is empty or deleted then return item not found.
+	int spilled = 0;
+	if (knowledge != NULL && !(knowledge->flags & NODE_TOMBSTONE)) { //Else copy out the response, decompressing it if it is stored compressed.
+		TRACE_BEGIN(copy);
+		spilled = kb_touch(ht, knowledge, response, n) && ht == own;
+		TRACE_END(TRACE_COPY, copy);
+		result = KB_OK;
+	}
+	kb_leave(kb, slot);
+	if (spilled) kb_refault(kb, tag, entity); //it was read from the spill file, bring it back for next time.
+	return result;
+
+}
+
+
+/*
+ * Copy out the response of an entry found by knowledge_get_many().
+ *
+ * Input:
+ *   ht       - the table holding the entry
+ *   item     - the entry
+ *   q        - the question it answers
+ *   refaults - the questions whose responses were read from the spill file; q is added to them
+ *   spilled  - the number of refaults
+ *
+ * Returns: 1 if the question was answered, 0 if the entry is a tombstone
+ */
+static int kb_answer(HashTable *ht, Node *item, kb_query_t *q, kb_query_t **refaults, int *spilled) {
+	if (item->flags & NODE_TOMBSTONE) return 0;
+	if (kb_touch(ht, item, q->response, q->n) && refaults != NULL && *spilled < GET_MANY_CHUNK) refaults[(*spilled)++] = q;
+	q->status = KB_OK;
+	return 1;
+}
+
+
+/*
+ * Answer many questions at once, as knowledge_get() would one after another.
+ * The lookups are interleaved so that their memory accesses overlap, which
+ * is much faster than many knowledge_get() calls when the knowledge base is
+ * larger than the CPU caches.
+ *
+ * Input:
+ *   queries - the questions; each gives its intent, entity and a response buffer of n characters
+ *   count   - the number of questions
+ *
+ * Output:
+ *   queries[i].response - the response to the question, if found
+ *   queries[i].status   - as knowledge_get() for the question
+ *
+ * Returns: the number of questions answered
+ */
+int knowledge_get_many(kb_t *kb, kb_query_t *queries, int count) {
+	ALLOC_OP(ALLOC_OP_GET);
+	HtEntry keys[GET_MANY_CHUNK]; //questions are looked up a chunk at a time, so nothing is allocated.
+	Node *results[GET_MANY_CHUNK];
+	int index[GET_MANY_CHUNK]; //the question each key comes from.
+	kb_query_t *refaults[GET_MANY_CHUNK]; //questions answered from the spill file, brought back after kb_leave().
+	int spilled = 0;
+	int found = 0;
+	unsigned int slot;
+	HashTable *own = kb_enter(kb, &slot); //The table cannot be freed until kb_leave(), even if it is replaced.
+	HashTable *base = kb->base ? kb_local(kb->base) : NULL;
+	char canonical[MAX_INPUT];
+	for (int first = 0; first < count; first += GET_MANY_CHUNK) {
+		int last = first + GET_MANY_CHUNK < count ? first + GET_MANY_CHUNK : count;
+		int valid = 0;
+		TRACE_BEGIN(key);
+		for (int i = first; i < last; i++) {
+			int tag = intent_tag(queries[i].intent);
+			queries[i].status = tag < 0 ? KB_INVALID : KB_NOTFOUND;
+			if (tag < 0) continue;
+			keys[valid].intent = tag;
+			keys[valid].entity = queries[i].entity;
+			index[valid++] = i;
+		}
+		TRACE_END(TRACE_KEY, key);
+		TRACE_BEGIN(search);
+		if (own != NULL) ht_search_batch(own, keys, valid, results);
+		else memset(results, 0, sizeof(results));
+		TRACE_END(TRACE_SEARCH, search);
+		for (int k = 0; k < valid; k++) //the responses are in blocks of their own, fetch them together too.
+			if (results[k] != NULL) __builtin_prefetch(__atomic_load_n(&results[k]->responses, __ATOMIC_RELAXED), 0);
+		int missing = 0; //questions this layer does not know, moved to the front of keys.
+		TRACE_BEGIN(copy);
+		for (int k = 0; k < valid; k++) {
+			if (results[k] != NULL) found += kb_answer(own, results[k], &queries[index[k]], refaults, &spilled);
+			else {
+				keys[missing] = keys[k];
+				index[missing++] = index[k];
+			}
+		}
+		if (base != NULL && missing > 0) { //ask the base, which is never replaced.
+			ht_search_batch(base, keys, missing, results);
+			for (int k = 0; k < missing; k++)
+				if (results[k] != NULL) __builtin_prefetch(__atomic_load_n(&results[k]->responses, __ATOMIC_RELAXED), 0);
+			for (int k = 0; k < missing; k++)
+				if (results[k] != NULL) found += kb_answer(base, results[k], &queries[index[k]], NULL, NULL);
+		}
+		for (int i = first; i < last; i++) { //questions without an answer of their own may be asked through an alias.
+			HashTable *ht;
+			Node *item = queries[i].status == KB_NOTFOUND ? kb_search_alias(kb, own, intent_tag(queries[i].intent), queries[i].entity, canonical, &ht) : NULL;
+			if (item != NULL) found += kb_answer(ht, item, &queries[i], NULL, NULL);
+		}
+		TRACE_END(TRACE_COPY, copy); //includes the lookups in the base and through aliases.
+	}
+	kb_leave(kb, slot);
+	for (int i = 0; i < spilled; i++)
+		kb_refault(kb, intent_tag(refaults[i]->intent), refaults[i]->entity);
+	return found;
+}
+
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_FOUND, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_put(kb_t *kb, const char *intent, const char *entity, const char *response) {
+	ALLOC_OP(ALLOC_OP_PUT);
+	int tag = intent_tag(intent);
+	if (tag < 0) { //If first word of user is not intent then return KB_invalid/not recognised.
+		return KB_INVALID;
+	}
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	Node *successful = kb->ht ? ht_insert(kb->ht, tag, entity, response) : NULL; //Invoke ht_insert which return knowledge node if found.
+	atomic_fetch_add(&kb->generation, 1);
+	kb_evict(kb); //keep the responses within the budget, if there is one.
+	pthread_mutex_unlock(&kb->lock);
+    if (!successful){ //If unable to be inserted into hashtable then return memory allocation error.
+            return KB_NOMEM;
+        }
+	return KB_OK; //else return it is successful. 
+
+}
+
+
+/*
+ * Insert many responses at once, as knowledge_put() would one after another.
+ * The table grows once to fit them all, and the inserts overlap their memory
+ * accesses, so this is much faster than many knowledge_put() calls for large
+ * numbers of entries.
+ *
+ * An entry whose intent is "alias" adds an alias, as knowledge_alias() does,
+ * with the alias as its entity and the entity it stands for as its response.
+ *
+ * Input:
+ *   entries - the entries, in order; a later entry for the same question wins
+ *   count   - the number of entries
+ *
+ * Output:
+ *   entries[i].status - as knowledge_put() for that entry
+ *
+ * Returns:
+ *   the number of entries stored
+ *   KB_NOMEM, if there was a memory allocation failure before any was stored
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_put_batch(kb_t *kb, kb_entry_t *entries, int count) {
+	ALLOC_OP(ALLOC_OP_PUT);
+	if (kb->readonly) {
+		for (int i = 0; i < count; i++) entries[i].status = KB_READONLY;
+		return KB_READONLY;
+	}
+	HtEntry *batch = (HtEntry *) malloc(count * sizeof(HtEntry) + 1);
+	Node **results = (Node **) calloc(count + 1, sizeof(Node *));
+	int *index = (int *) malloc(count * sizeof(int) + 1); //entry each item of the batch comes from.
+	if (batch == NULL || results == NULL || index == NULL) {
+		free(batch);
+		free(results);
+		free(index);
+		for (int i = 0; i < count; i++) entries[i].status = KB_NOMEM;
+		return KB_NOMEM;
+	}
+	int valid = 0;
+	for (int i = 0; i < count; i++) {
+		int tag = section_tag(entries[i].intent);
+		if (tag == INTENT_ALIAS && strlen(entries[i].response) >= MAX_INPUT) tag = -1; //no entity asked about is that long.
+		entries[i].status = tag < 0 ? KB_INVALID : KB_NOMEM;
+		if (tag < 0) continue;
+		batch[valid].intent = tag;
+		batch[valid].entity = entries[i].entity;
+		batch[valid].response = entries[i].response;
+		index[valid++] = i;
+	}
+	pthread_mutex_lock(&kb->lock);
+	int stored = kb->ht ? ht_insert_batch(kb->ht, batch, valid, results) : 0;
+	atomic_fetch_add(&kb->generation, 1);
+	kb_evict(kb);
+	pthread_mutex_unlock(&kb->lock);
+	for (int i = 0; i < valid; i++)
+		if (results[i] != NULL) entries[index[i]].status = KB_OK;
+	free(batch);
+	free(results);
+	free(index);
+	return stored;
+}
+
+
+/*
+ * Put a tombstone in a table in place of an entry, whether the table has the
+ * entry or not.
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int table_bury(HashTable *ht, int tag, const char *entity) {
+	Node *tombstone = ht_insert(ht, tag, entity, "");
+	if (tombstone == NULL) {
+		return KB_NOMEM;
+	}
+	tombstone->flags |= NODE_TOMBSTONE;
+	return KB_OK;
+}
+
+
+/*
+ * Delete an entry from a table of the knowledge base, hiding the entry of
+ * the base with a tombstone if there is one.
+ *
+ * Input:
+ *   ht     - the table
+ *   tag    - the tag of the intent
+ *   entity - the entity
+ *
+ * Returns: as knowledge_delete()
+ */
+static int table_delete(kb_t *kb, HashTable *ht, int tag, const char *entity) {
+	Node *own = ht_search(ht, tag, entity);
+	int found = own != NULL && !(own->flags & NODE_TOMBSTONE);
+	if (kb->base != NULL && kb->base->ht != NULL && ht_search(kb->base->ht, tag, entity) != NULL) {
+		/*The base has the entry, hide it with a tombstone in this layer.*/
+		if (own == NULL || !(own->flags & NODE_TOMBSTONE)) {
+			return table_bury(ht, tag, entity);
+		}
+		return KB_NOTFOUND; //already deleted.
+	}
+	if (own != NULL) ht_delete(ht, tag, entity);
+	return found ? KB_OK : KB_NOTFOUND;
+}
+
+
+/*
+ * Delete the response to a question. In a layered knowledge base, an entry
+ * of the base is hidden by a tombstone in the layer rather than removed.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *
+ * Returns:
+ *   KB_OK, if the entry was deleted
+ *   KB_NOTFOUND, if there was no such entry
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_delete(kb_t *kb, const char *intent, const char *entity) {
+	ALLOC_OP(ALLOC_OP_DELETE);
+	int tag = intent_tag(intent);
+	if (tag < 0) {
+		return KB_INVALID;
+	}
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	int result = kb->ht ? table_delete(kb, kb->ht, tag, entity) : KB_NOTFOUND;
+	atomic_fetch_add(&kb->generation, 1);
+	kb_compact(kb);
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Delete many responses at once, as knowledge_delete() would one after
+ * another, taking the lock once. Use this to retire large numbers of stale
+ * entries.
+ *
+ * Input:
+ *   entries - the entries to delete, or aliases to remove if their intent is "alias"; their responses are not used
+ *   count   - the number of entries
+ *
+ * Output:
+ *   entries[i].status - as knowledge_delete() for that entry
+ *
+ * Returns:
+ *   the number of entries deleted
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_delete_batch(kb_t *kb, kb_entry_t *entries, int count) {
+	ALLOC_OP(ALLOC_OP_DELETE);
+	if (kb->readonly) {
+		for (int i = 0; i < count; i++) entries[i].status = KB_READONLY;
+		return KB_READONLY;
+	}
+	int deleted = 0;
+	pthread_mutex_lock(&kb->lock);
+	for (int i = 0; i < count; i++) {
+		int tag = section_tag(entries[i].intent);
+		entries[i].status = tag < 0 ? KB_INVALID : kb->ht ? table_delete(kb, kb->ht, tag, entries[i].entity) : KB_NOTFOUND;
+		if (entries[i].status == KB_OK) deleted++;
+	}
+	atomic_fetch_add(&kb->generation, 1);
+	kb_compact(kb);
+	pthread_mutex_unlock(&kb->lock);
+	return deleted;
+}
+
+
+/*
+ * Make an entity answer for another: a question about the alias that has no
+ * answer of its own gets the answer about the entity, for every intent,
+ * even if the entity learns its answers later. Aliases are saved in the
+ * [alias] section of a knowledge file.
+ *
+ * Input:
+ *   alias  - the other name, such as "SIT campus"
+ *   entity - the entity it stands for, such as "SIT", which may itself be an alias
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the alias is the entity itself, or the entity is MAX_INPUT characters or longer
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_alias(kb_t *kb, const char *alias, const char *entity) {
+	ALLOC_OP(ALLOC_OP_PUT);
+	if (strcmp(alias, entity) == 0 || strlen(entity) >= MAX_INPUT) {
+		return KB_INVALID;
+	}
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	Node *item = kb->ht ? ht_insert(kb->ht, INTENT_ALIAS, alias, entity) : NULL;
+	atomic_fetch_add(&kb->generation, 1);
+	kb_evict(kb);
+	pthread_mutex_unlock(&kb->lock);
+	return item != NULL ? KB_OK : KB_NOMEM;
+}
+
+
+/*
+ * Remove an alias made by knowledge_alias(). In a layered knowledge base, an
+ * alias of the base is hidden by a tombstone in the layer.
+ *
+ * Input:
+ *   alias - the alias
+ *
+ * Returns: as knowledge_delete()
+ */
+int knowledge_unalias(kb_t *kb, const char *alias) {
+	ALLOC_OP(ALLOC_OP_DELETE);
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	int result = kb->ht ? table_delete(kb, kb->ht, INTENT_ALIAS, alias) : KB_NOTFOUND;
+	atomic_fetch_add(&kb->generation, 1);
+	kb_compact(kb);
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Read one line of any length from a file.
+ *
+ * Input:
+ *   f     - the file
+ *   buf   - the buffer holding the line, grown with realloc() as needed
+ *   size  - the size of buf
+ *   start - where in buf to put the line; what comes before is kept
+ *
+ * Returns: the length of the line, or -1 at the end of the file or if out of memory
+ */
+static long read_line(FILE *f, char **buf, size_t *size, size_t start) {
+	size_t len = start;
+	if (*size - len < MAX_INPUT) { //make room for a typical line, so short lines are read in one call.
+		char *grown = (char *) realloc(*buf, *size * 2 + MAX_INPUT);
+		if (grown == NULL) return -1;
+		*buf = grown;
+		*size = *size * 2 + MAX_INPUT;
+	}
+	while (fgets(*buf + len, *size - len, f) != NULL) {
+		len += strlen(*buf + len);
+		if (len > start && (*buf)[len - 1] == '\n') return len - start; //the whole line has been read.
+		if (len + 1 < *size) return len - start; //the last line of the file has no newline.
+		char *grown = (char *) realloc(*buf, *size * 2); //the line did not fit, double the buffer and read the rest.
+		if (grown == NULL) return -1;
+		*buf = grown;
+		*size *= 2;
+	}
+	return len > start ? (long) (len - start) : -1;
+}
+
+
+/*
+ * Entries read from a file, waiting to be inserted together with
+ * ht_insert_batch(). Their lines are kept one after another in the line
+ * buffer, so the entities and responses are inserted without being copied.
+ */
+typedef struct ReadBatch {
+	int count; //Number of entries waiting.
+	int tag[READ_BATCH]; //Intent tag of each entry.
+	size_t entity[READ_BATCH]; //Offset of each entity in the line buffer.
+	size_t response[READ_BATCH]; //Offset of each response in the line buffer.
+	HtEntry entries[READ_BATCH];
+	Node *results[READ_BATCH];
+} ReadBatch;
+
+
+/*
+ * Insert the entries waiting in a batch.
+ *
+ * Input:
+ *   ht    - the table
+ *   batch - the batch, emptied
+ *   buf   - the line buffer holding the entries
+ *
+ * Returns: the number of entries inserted, or KB_NOMEM if any could not be
+ */
+static int read_batch_flush(HashTable *ht, ReadBatch *batch, const char *buf) {
+	int count = batch->count;
+	for (int i = 0; i < count; i++) {
+		batch->entries[i].intent = batch->tag[i];
+		batch->entries[i].entity = buf + batch->entity[i];
+		batch->entries[i].response = buf + batch->response[i];
+	}
+	batch->count = 0;
+	return ht_insert_batch(ht, batch->entries, count, batch->results) == count ? count : KB_NOMEM;
+}
+
+
+/*
+ * Find the '=' that ends the entity of an ini line, passing over those
+ * escaped as \=.
+ *
+ * Returns: the '=', or NULL if the line has none
+ */
+static char *ini_equals(char *line) {
+	for (char *c = line; *c != '\0'; c++) {
+		if (*c == '=') return c;
+		if (*c == '\\' && c[1] != '\0') c++;
+	}
+	return NULL;
+}
+
+
+/*
+ * Undo the escapes kb_write() puts in entities and responses, in place:
+ * \n, \r, \\, \= and \[. Any other backslash is kept as it is, as in
+ * files written by hand.
+ *
+ * Returns: the length of the string
+ */
+static size_t ini_unescape(char *s) {
+	char *from = strchr(s, '\\');
+	if (from == NULL) return strlen(s); //most have nothing escaped.
+	char *to = from;
+	while (*from != '\0') {
+		if (from[0] == '\\' && from[1] != '\0' && strchr("nr\\=[", from[1]) != NULL) {
+			*to++ = from[1] == 'n' ? '\n' : from[1] == 'r' ? '\r' : from[1];
+			from += 2;
+		} else {
+			*to++ = *from++;
+		}
+	}
+	*to = '\0';
+	return to - s;
+}
+
+
+/*
+ * Read knowledge from a file into a table of the knowledge base.
+ *
+ * Lines may be of any length; entities and responses are parsed in place in
+ * the line buffer and inserted without being copied, READ_BATCH at a time
+ * with ht_insert_batch().
+ *
+ * An entity or response holding a line break, a backslash, or (in an entity)
+ * an '=' or a leading '[' is escaped by kb_write(), and unescaped here.
+ *
+ * The [alias] section holds alias=entity lines, as knowledge_alias() makes.
+ * A section named after an intent with a leading '-', such as [-who], lists
+ * entities to delete, as written by knowledge_write_delta(); [-alias] lists
+ * aliases to remove.
+ *
+ * The lines are summed as they are read, and each trailer kb_write() writes
+ * must match what was read before it. The entries are stored as they are
+ * read all the same, so a caller that must not keep a damaged file reads it
+ * into a staging table (see kb_read_staged()).
+ *
+ * Input:
+ *   ht      - the table
+ *   f       - the file
+ *   retrain - 1 to train the dictionary again on the new knowledge if the knowledge base compresses
+ *             responses, 0 if the caller does it once it has read several files
+ *   staged  - 1 if ht is a staging table, whose deletions are kept as tombstones to apply on merging
+ *
+ * Output:
+ *   verified - if not NULL, set to 1 if the file ends with a trailer, and 0 if it has none or has lines after
+ *              its last, which nothing vouches for
+ *
+ * Returns: the number of entity/response pairs read, KB_NOMEM if they could
+ *   not be stored, or KB_CORRUPT if a trailer does not match what was read
+ */
+int kb_read_table(kb_t *kb, HashTable *ht, FILE *f, int retrain, int staged, int *verified) {
+	int erpair = 0; //count number of er pair successfully read from file.
+	size_t size = READ_BATCH * 64; //initial size of the line buffer, grown for more or longer lines.
+	char * buf = malloc(size); //allocate memory to buffer to store the lines read from file.
+	ReadBatch *batch = malloc(sizeof(ReadBatch)); //entries read but not inserted yet.
+	if (buf == NULL || batch == NULL) { //if unable to allocate memory then return memory allocation failure
+		free(buf);
+		free(batch);
+		return KB_NOMEM;
+	}
+	batch->count = 0;
+	long start = ftell(f); //presize the table from the size of the file, if it has one, rather than grow it step by step.
+	if (start >= 0 && fseek(f, 0, SEEK_END) == 0) {
+		long end = ftell(f);
+		fseek(f, start, SEEK_SET);
+		if (end > start) ht_reserve(ht, (int) ((end - start) / READ_LINE_ESTIMATE));
+	}
+	size_t used = 0; //bytes of buf holding the lines of the entries in the batch.
+	int tag = -1; //intent of the current section, -1 until a valid one is found.
+	int deleting = 0; //set in a section listing entities to delete.
+	IniSum sum = { 0, 0 }; //lines read since the start or the last trailer.
+	IniSum trailer;
+	int corrupt = 0; //set if a trailer does not match what was read before it.
+	int trailers = 0;
+	int result = 0;
+	long len;
+	while (result >= 0 && (len = read_line(f, &buf, &size, used)) >= 0) { //while not end of file
+		char *line = buf + used; //the line, after those of the batch.
+		unsigned int crc = sum.crc; //the CRC before this line, to compare with the trailer if this is one.
+		sum.crc = crc32_update(sum.crc, line, len);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0'; //strip the line ending.
+		if (len == 0){ //if empty line then continue to next iteration.
+			continue;
+		}
+		if (line[0] == '[' && ini_trailer(line, len, &trailer)){ //the end of a file written by kb_write().
+			if (trailer.entries != sum.entries || trailer.crc != crc) corrupt = 1;
+			trailers++;
+			sum.entries = 0;
+			sum.crc = 0;
+			continue;
+		}
+		if (line[0] != '[') sum.entries++;
+		if (line[0] == '['){ //if first character of line is [ then extract string between delimiters []
+			char *close = strchr(line, ']');
+			if (close != NULL) *close = '\0'; //removes ] from string
+			deleting = line[1] == '-';
+			tag = section_tag(line + 1 + deleting); //check whether string is a valid intent/question or [alias], entries of an invalid section are skipped.
+			continue;
+		}
+		char *equals = ini_equals(line); //the entity is everything before the first =, the response everything after it.
+		if (tag >= 0 && deleting) {
+			if (equals != NULL) *equals = '\0';
+			len = ini_unescape(line);
+			result = read_batch_flush(ht, batch, buf); //entries before the deletion go in first.
+			if (result >= 0) {
+				erpair += result;
+				memmove(buf, line, len + 1); //the batch is empty now, so its lines can go.
+				used = 0;
+				result = (staged ? table_bury(ht, tag, buf) : table_delete(kb, ht, tag, buf)) == KB_NOMEM ? KB_NOMEM : 0;
+			}
+			continue;
+		}
+		if (tag < 0 || equals == NULL) {
+			continue;
+		}
+		*equals = '\0';
+		ini_unescape(line);
+		if (ini_unescape(equals + 1) >= MAX_INPUT && tag == INTENT_ALIAS) {
+			continue;
+		}
+
+		batch->tag[batch->count] = tag; //keep the line and add the entry to the batch.
+		batch->entity[batch->count] = used;
+		batch->response[batch->count] = equals + 1 - buf;
+		batch->count++;
+		used += len + 1;
+		if (batch->count == READ_BATCH) { //the batch is full, insert the data retrieved from its lines.
+			result = read_batch_flush(ht, batch, buf);
+			erpair += result > 0 ? result : 0;
+			used = 0;
+		}
+	}
+	if (result >= 0) result = read_batch_flush(ht, batch, buf); //insert what is left.
+	free(batch);
+	free(buf); //free up memory allocated for the lines
+	if (result < 0) {
+		return result;
+	}
+	erpair += result;
+	if (retrain && kb->compress) ht_compress_responses(ht, 1, DICT_SIZE); //retrain the dictionary on the new knowledge.
+	if (verified != NULL) *verified = trailers > 0 && sum.entries == 0; //as knowledge_verify() judges it.
+	return corrupt ? KB_CORRUPT : erpair;
+}
+
+
+/*
+ * Apply a staging table to the table of the knowledge base: its entries are
+ * stored, and its tombstones delete what they stand for. The staging table
+ * keeps its responses uncompressed, so they are copied as they are.
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was a memory allocation failure
+ */
+static int kb_merge_table(kb_t *kb, HashTable *staging) {
+	HashTable *ht = kb->ht;
+	ht_reserve(ht, staging->count); //If this fails the table still grows step by step.
+	HtIter iter;
+	Node *item;
+	ht_iter_init(&iter);
+	while ((item = ht_next(staging, &iter)) != NULL) {
+		if (item->flags & NODE_TOMBSTONE) {
+			if (table_delete(kb, ht, item->intent, node_entity(item)) == KB_NOMEM) return KB_NOMEM;
+		} else if (ht_insert(ht, item->intent, node_entity(item), item->responses->text) == NULL) {
+			return KB_NOMEM;
+		}
+	}
+	return KB_OK;
+}
+
+
+/*
+ * Read knowledge from a file into the table of the knowledge base, keeping
+ * none of it unless the file matches its trailers. The file is read into a
+ * staging table, which is merged into the knowledge base's table only once
+ * the whole file is read; into an empty table, it is swapped in instead. The
+ * caller holds the lock, and trains the dictionary again if need be.
+ *
+ * Output:
+ *   verified - as for kb_read_table()
+ *
+ * Returns: as kb_read_table(); on KB_CORRUPT the knowledge base is left as it was
+ */
+int kb_read_staged(kb_t *kb, FILE *f, int *verified) {
+	int empty = kb->ht->count == 0; //then there is nothing for the file's deletions to delete but itself.
+	HashTable *staging = empty ? kb_new_table(kb) : create_table(CAPACITY);
+	if (staging == NULL) {
+		return KB_NOMEM;
+	}
+	int result = kb_read_table(kb, staging, f, 0, !empty, verified);
+	if (result >= 0 && empty) {
+		free_table(kb_swap_table(kb, staging));
+		return result;
+	}
+	if (result >= 0 && kb_merge_table(kb, staging) != KB_OK) result = KB_NOMEM;
+	free_table(staging);
+	return result;
+}
+
+
+/*
+ * Read a knowledge base from a file, adding to (or overwriting) what the
+ * knowledge base already knows.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: the number of entity/response pairs successful read from the file,
+ *   or KB_NOMEM or KB_READONLY if they could not be stored, or KB_CORRUPT if
+ *   the file does not match its checksum, in which case nothing is kept
+ */
+int knowledge_read(kb_t *kb, FILE *f) {
+	return knowledge_read_verified(kb, f, NULL);
+}
+
+
+/*
+ * Read a knowledge base from a file, as knowledge_read() does, and tell
+ * whether the file was checked whole against its checksum.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Output:
+ *   verified - if not NULL, set to 1 if the file ends with its checksum, 0 if
+ *              it has none or has lines after it, which are read unverified
+ *
+ * Returns: as knowledge_read()
+ */
+int knowledge_read_verified(kb_t *kb, FILE *f, int *verified) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (verified != NULL) *verified = 0;
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	int result = kb->ht ? kb_read_staged(kb, f, verified) : KB_NOMEM;
+	if (result >= 0 && kb->compress) ht_compress_responses(kb->ht, 1, DICT_SIZE); //retrain the dictionary on the new knowledge.
+	atomic_fetch_add(&kb->generation, 1);
+	kb_evict(kb);
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Replace the knowledge base with the contents of a file. The file is read
+ * into a new table without holding the lock, then swapped in at once, so
+ * lookups never see a half read file and never wait for it. Lookups already
+ * running finish with the old table, which is freed after them. Entries that
+ * are no longer in the file are gone after the swap.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: as knowledge_read(); on error the knowledge base is left as it was
+ */
+int knowledge_reload(kb_t *kb, FILE *f) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	HashTable *fresh = kb_new_table(kb);
+	if (fresh == NULL) {
+		return KB_NOMEM;
+	}
+	int result = kb_read_table(kb, fresh, f, 1, 0, NULL);
+	if (result < 0) {
+		free_table(fresh);
+		return result;
+	}
+	pthread_mutex_lock(&kb->lock);
+	free_table(kb_swap_table(kb, fresh));
+	kb_evict(kb); //the new table was read in full, evict what does not fit now.
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Reset the knowledge base, removing all know entitities from all intents.
+ * A layered knowledge base forgets what it added or deleted and falls back to
+ * its base. A knowledge base shared as a base is left as it is.
+ */
+void knowledge_reset(kb_t *kb) {
+	ALLOC_OP(ALLOC_OP_RESET);
+	if (kb->readonly) return;
+	pthread_mutex_lock(&kb->lock);
+	free_table(kb_swap_table(kb, kb_new_table(kb))); //swap in a new empty hash table, the old one is freed once no lookup uses it.
+	pthread_mutex_unlock(&kb->lock);
+}
+
+
+/*
+ * Write bytes of an ini file and add them to the CRC for the file's trailer.
+ */
+static void ini_put(FILE *f, IniSum *sum, const char *s, size_t len) {
+	fwrite(s, 1, len, f);
+	sum->crc = crc32_update(sum->crc, s, len);
+}
+
+
+/*
+ * Write an entity or a response to an ini file, escaped so that it reads back
+ * as it is (see ini_unescape()): a line break or backslash becomes \n, \r or
+ * \\, and in an entity an '=' becomes \= and a leading '[' becomes \[.
+ */
+static void ini_escaped(FILE *f, IniSum *sum, const char *s, int entity) {
+	if (entity && s[0] == '[') { //would be read as a section header.
+		ini_put(f, sum, "\\[", 2);
+		s++;
+	}
+	for (;;) {
+		size_t len = strcspn(s, entity ? "\n\r\\=" : "\n\r\\");
+		ini_put(f, sum, s, len);
+		if (s[len] == '\0') return;
+		char escape[2] = { '\\', s[len] == '\n' ? 'n' : s[len] == '\r' ? 'r' : s[len] };
+		ini_put(f, sum, escape, 2);
+		s += len + 1;
+	}
+}
+
+
+/*
+ * Write a section header of an ini file, [name] or [-name], which the
+ * trailer does not count.
+ */
+static void ini_section(FILE *f, IniSum *sum, const char *open, const char *name) {
+	ini_put(f, sum, open, strlen(open));
+	ini_put(f, sum, name, strlen(name));
+	ini_put(f, sum, "]\n", 2);
+}
+
+
+/*
+ * Write an entry of an ini file, entity=response, or the entity alone if
+ * response is NULL, as deletions are listed, and count it for the file's
+ * trailer.
+ */
+static void ini_entry(FILE *f, IniSum *sum, const char *entity, const char *response) {
+	ini_escaped(f, sum, entity, 1);
+	if (response != NULL || entity[0] == '\0') ini_put(f, sum, "=", 1); //an empty entity alone would be a blank line, which is skipped.
+	if (response != NULL) ini_escaped(f, sum, response, 0);
+	ini_put(f, sum, "\n", 1);
+	sum->entries++;
+}
+
+
+/*
+ * Write one entity and its response to a file.
+ *
+ * Input:
+ *   ht       - the table holding the entity
+ *   item     - the entity
+ *   f        - the file
+ *   format   - KB_FORMAT_INI to write it under its intent's section, or a row format for knowledge_export()
+ *   buf      - a buffer the response is decompressed into, grown as needed
+ *   size     - the size of buf
+ *   sum      - the sum of an ini file, which the line is added to
+ *   progress - the progress of the write, or NULL
+ *
+ * Returns: KB_OK, or KB_NOMEM if there was no memory to decompress the response into
+ */
+static int knowledge_write_item(HashTable *ht, Node *item, FILE *f, int format, IniSum *sum, char **buf, size_t *size, WriteProgress *progress) {
+	if (item->responses->len + 1 > *size){
+		char *grown = (char *) realloc(*buf, item->responses->len + 1);
+		if (grown == NULL) return KB_NOMEM;
+		*buf = grown;
+		*size = item->responses->len + 1;
+	}
+	response_copy(ht->responses, item->responses, *buf, *size);
+	if (format == KB_FORMAT_INI) ini_entry(f, sum, node_entity(item), *buf);
+	else dump_row(f, format, intent_name(item->intent), node_entity(item), *buf);
+	if (progress != NULL && ++progress->done % WRITE_PROGRESS_EVERY == 0 && progress->report != NULL) progress->report(progress);
+	return KB_OK;
+}
+
+
+/*
+ * Write the entities of one intent to a file.
+ *
+ * Input:
+ *   kb       - the knowledge base
+ *   f        - the file
+ *   format   - as for knowledge_write_item()
+ *   intent   - the tag of the intent whose entities are written
+ *   delta    - 1 to only write what a layered knowledge base changes, 0 to also write what it has from its base
+ *   sum      - as for knowledge_write_item()
+ *   progress - the progress of the write, or NULL
+ *
+ * Returns: as knowledge_write_item(), stopping at the first entry that fails
+ */
+static int knowledge_write_intent(kb_t *kb, FILE *f, int format, int intent, int delta, IniSum *sum, WriteProgress *progress) {
+	char *buf = NULL; //buffer the responses are decompressed into, grown as needed.
+	size_t size = 0;
+	int result = KB_OK;
+	HtIter iter;
+	Node *item;
+	ht_iter_init(&iter);
+	while (result == KB_OK && (item = ht_next(kb->ht, &iter)) != NULL){ //entries of this knowledge base.
+		if (item->intent == intent && !(item->flags & NODE_TOMBSTONE)){
+			result = knowledge_write_item(kb->ht, item, f, format, sum, &buf, &size, progress);
+		}
+	}
+	if (!delta && kb->base != NULL && kb->base->ht != NULL){ //entries of the base not changed or deleted by this one.
+		ht_iter_init(&iter);
+		while (result == KB_OK && (item = ht_next(kb->base->ht, &iter)) != NULL){
+			if (item->intent == intent && ht_search(kb->ht, intent, node_entity(item)) == NULL){
+				result = knowledge_write_item(kb->base->ht, item, f, format, sum, &buf, &size, progress);
+			}
+		}
+	}
+	free(buf);
+	return result;
+}
+
+
+/*
+ * Write the knowledge base to a file without taking its lock. The caller
+ * holds the lock, or has the knowledge base to itself (as the child process
+ * of a background save does).
+ *
+ * The row formats of knowledge_export() cannot list deleted entities, so in
+ * them a delta only holds the entries the layer adds or changes. An ini file
+ * ends with a trailer giving its number of lines and their checksum, which
+ * kb_read_table() checks (see verify.c).
+ *
+ * Input:
+ *   f        - the file
+ *   format   - KB_FORMAT_INI, KB_FORMAT_CSV or KB_FORMAT_JSONL
+ *   delta    - as for knowledge_write_intent()
+ *   progress - the progress of the write, or NULL
+ *
+ * Returns:
+ *   KB_OK, if every entry was written (the file may still have failed to, see ferror())
+ *   KB_NOMEM, if there was a memory allocation failure; the file is left without a trailer
+ */
+int kb_write(kb_t *kb, FILE *f, int format, int delta, WriteProgress *progress) {
+	ALLOC_OP(ALLOC_OP_SAVE);
+	IniSum sum = { 0, 0 }; //lines and CRC of an ini file, for its trailer.
+	if (format == KB_FORMAT_CSV) fputs("intent,entity,response\n", f); //the header row.
+	for (int tag = 0; tag <= INTENT_ALIAS; tag++) { //the intents, then the aliases, kept apart from the entries they stand for.
+		if (format == KB_FORMAT_INI) ini_section(f, &sum, "[", intent_name(tag)); //insert intent onto file
+		if (kb->ht != NULL && knowledge_write_intent(kb, f, format, tag, delta, &sum, progress) != KB_OK) { //if hashtable is not empty then write all items with this intent
+			return KB_NOMEM; //an entry is missing, so the file must not claim to be whole.
+		}
+	}
+	for (int tag = 0; format == KB_FORMAT_INI && delta && kb->base != NULL && kb->ht != NULL && tag <= INTENT_ALIAS; tag++) { //entities and aliases deleted from the base.
+		ini_section(f, &sum, "[-", intent_name(tag));
+		HtIter iter;
+		Node *item;
+		ht_iter_init(&iter);
+		while ((item = ht_next(kb->ht, &iter)) != NULL){
+			if (item->intent == tag && (item->flags & NODE_TOMBSTONE)){
+				ini_entry(f, &sum, node_entity(item), NULL);
+				if (progress != NULL && ++progress->done % WRITE_PROGRESS_EVERY == 0 && progress->report != NULL) progress->report(progress);
+			}
+		}
+	}
+	if (format == KB_FORMAT_INI) fprintf(f, INI_TRAILER "\n", sum.entries, sum.crc); //lets the reader check it has the whole file as written.
+	return KB_OK;
+}
+
+
+/*
+ * Count the entries kb_write() writes at most, for reporting its progress.
+ *
+ * Returns: the number of entries in the knowledge base and its base
+ */
+long kb_entries(kb_t *kb) {
+	long entries = kb->ht ? kb->ht->count : 0;
+	if (kb->base != NULL && kb->base->ht != NULL) entries += kb->base->ht->count;
+	return entries;
+}
+
+
+/*
+ * Write the knowledge base to a file. A layered knowledge base is written
+ * merged with its base, as it answers questions.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: as kb_write()
+ */
+int knowledge_write(kb_t *kb, FILE *f) {
+	pthread_mutex_lock(&kb->lock);
+	int result = kb_write(kb, f, KB_FORMAT_INI, 0, NULL);
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Write only what a layered knowledge base changes from its base: its own
+ * entries, then the entities it deletes under [-what], [-where] and [-who].
+ * Reading the file into a knowledge base layered on the same base gives
+ * back the same knowledge. For a knowledge base that is not layered, this
+ * is the same as knowledge_write().
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: as kb_write()
+ */
+int knowledge_write_delta(kb_t *kb, FILE *f) {
+	pthread_mutex_lock(&kb->lock);
+	int result = kb_write(kb, f, KB_FORMAT_INI, 1, NULL);
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Switch between plain and compressed storage of responses. Turning
+ * compression on trains a dictionary from the responses in the knowledge
+ * base; it is trained again each time a knowledge base is read.
+ *
+ * Input:
+ *   compress - 1 to keep responses compressed, 0 to keep them as is
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_compress(kb_t *kb, int compress) {
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	int result = KB_NOMEM;
+	if (kb->ht != NULL && ht_compress_responses(kb->ht, compress, DICT_SIZE)) {
+		kb->compress = compress;
+		result = KB_OK;
+	}
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+
+/*
+ * Report the memory used by responses.
+ *
+ * Output:
+ *   raw_bytes    - the bytes the responses would take uncompressed
+ *   stored_bytes - the bytes actually stored, including the dictionary
+ */
+void knowledge_memory(kb_t *kb, size_t *raw_bytes, size_t *stored_bytes) {
+	*raw_bytes = *stored_bytes = 0;
+	pthread_mutex_lock(&kb->lock);
+	HashTable *ht = kb->ht;
+	if (ht != NULL) {
+		*raw_bytes = ht->responses->raw_bytes;
+		*stored_bytes = ht->responses->bytes + (ht->responses->dict ? ht->responses->dict->len : 0);
+	}
+	pthread_mutex_unlock(&kb->lock);
+}
@@ -0,0 +1,105 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file contains the definition of a knowledge base context. It is
+ * internal to libchat1002; programs using the library only see kb_t.
+ */
+
+#ifndef _KNOWLEDGE_H
+#define _KNOWLEDGE_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "chat1002.h"
+#include "hashtable.h"
+
+#define READ_BATCH 256 //Number of entries knowledge_read() inserts at a time.
+#define READ_LINE_ESTIMATE 48 //Typical bytes per entry in a file, used to presize the table before reading it.
+#define GET_MANY_CHUNK 64 //Number of questions knowledge_get_many() looks up at a time.
+#define WRITE_PROGRESS_EVERY 1024 //Number of entries written between reports of progress.
+#define COMPACT_MIN_DELETED 1024 //Deletions a table must have seen before it is compacted.
+#define ALIAS_MAX_HOPS 4 //Aliases followed at most to answer a question, so aliases of each other cannot loop.
+#define DUMP_CHUNK (1 << 20) //Bytes knowledge_import() reads at a time.
+#define DUMP_BATCH 4096 //Number of entries knowledge_import() stores at a time.
+#define INI_TRAILER "[end entries=%ld crc32=%08x]" //Last line of an ini file written by kb_write(), see verify.c.
+
+typedef struct SaveJob SaveJob; //A save running in the background, defined in save.c.
+
+typedef struct IniSum IniSum; //What an ini file holds since its start or its last trailer, see verify.c.
+struct IniSum {
+	long entries; //Lines other than section headers.
+	unsigned int crc; //CRC-32 of every byte.
+};
+
+typedef struct WriteProgress WriteProgress; //The progress of a write, reported every WRITE_PROGRESS_EVERY entries.
+struct WriteProgress {
+	long done; //Entries written so far.
+	void (*report)(WriteProgress *progress); //NULL to only count the entries.
+	int fd; //Where report() sends the progress.
+};
+
+/*
+ * The table of a knowledge base may be replaced while other threads look up
+ * entries in it (by knowledge_reload() or knowledge_reset()). Readers enter
+ * the current epoch by counting themselves in readers[epoch & 1]; a writer
+ * swaps the table, advances the epoch, then waits for the readers of the old
+ * epoch to leave before freeing the old table. Readers never wait or lock.
+ * Responses evicted to the spill file or brought back from it (see spill.c)
+ * are freed the same way.
+ */
+struct kb {
+	_Atomic(HashTable *) ht; //The knowledge, NULL only if a reset could not allocate a new table. In a layered knowledge base, only what differs from the base.
+	kb_t *base; //The shared, read only knowledge base below this one, or NULL.
+	atomic_int refs; //References held by the owner and by the layered knowledge bases built on this one.
+	int readonly; //Set once this knowledge base is shared as a base. Writes then fail with KB_READONLY.
+	int compress; //Set by knowledge_compress() to keep responses compressed.
+	atomic_uint epoch; //Advanced each time the table is replaced.
+	atomic_uint generation; //Advanced after every change to what the knowledge base answers, see knowledge_generation().
+	atomic_int readers[2]; //Number of readers in even and odd epochs.
+	_Atomic(HashTable **) replicas; //A copy of the table in the memory of each NUMA node, by node, or NULL; see numa.c.
+	int nodes; //Number of replicas.
+	pthread_mutex_t lock; //Held by writers, so changes and replacements of the table happen one at a time.
+	SaveJob *saves; //Saves started by knowledge_save(), newest first, protected by lock.
+	int last_save; //Number of the newest save.
+	size_t budget; //Bytes the responses may take before the coldest are evicted, 0 for no limit.
+	int spill_fd; //The spill file evicted responses are written to, -1 until a budget is set.
+	long spill_end; //Bytes written to the spill file.
+	int clock_hand; //Next slot of the table the eviction hand visits.
+	size_t stalled; //Bytes the responses took when the hand last could not meet the budget, 0 if it did.
+	long evictions; //Responses evicted so far.
+	long refaults; //Evicted responses brought back by lookups so far.
+	time_t created; //When the knowledge base was created, to turn the counts into rates.
+};
+
+/* functions defined in knowledge.c */
+int intent_tag(const char *intent);
+const char *intent_name(int tag);
+int kb_write(kb_t *kb, FILE *f, int format, int delta, WriteProgress *progress);
+long kb_entries(kb_t *kb);
+int kb_read_table(kb_t *kb, HashTable *ht, FILE *f, int retrain, int staged, int *verified);
+int kb_read_staged(kb_t *kb, FILE *f, int *verified);
+void kb_synchronize(kb_t *kb);
+
+/* functions defined in dump.c */
+void dump_row(FILE *f, int format, const char *intent, const char *entity, const char *response);
+
+/* functions defined in verify.c */
+unsigned int crc32_update(unsigned int crc, const char *data, size_t len);
+int ini_trailer(const char *line, size_t len, IniSum *trailer);
+
+/* functions defined in spill.c */
+int kb_evict(kb_t *kb);
+void kb_refault(kb_t *kb, int tag, const char *entity);
+void spill_free(kb_t *kb);
+
+/* functions defined in numa.c */
+int numa_nodes();
+int numa_current_node();
+int numa_run_on(int node);
+void numa_unmap(char *image, size_t mapped);
+void numa_free_replicas(kb_t *kb);
+
+/* functions defined in save.c */
+void save_jobs_free(kb_t *kb);
+
+#endif
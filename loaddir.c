@@ -0,0 +1,680 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements reading every knowledge file of a directory at once.
+ *
+ * knowledge_read_dir() lists the .ini files of a directory (not of its
+ * subdirectories), sorts them by name, and reads them into the knowledge base
+ * as if each had been loaded in turn in that order: where two files answer
+ * the same question, the file whose name sorts last wins, and the deletions
+ * of a file apply to what the files before it hold.
+ *
+ * A knowledge base split into thousands of small files spends most of the
+ * time it takes to read them waiting on one open(), read() and close() after
+ * another. Instead, up to LOADDIR_AHEAD files are read at once, ahead of the
+ * one being parsed, and each file is parsed from memory (with fmemopen()) as
+ * soon as it and every file before it have been read.
+ *
+ * On Linux the opens, reads and closes are queued in an io_uring, set up
+ * with the raw system calls, so one io_uring_enter() submits the requests of
+ * many files and collects as many completions. Where io_uring is not
+ * available (kernels before 5.6, or a seccomp policy forbidding it, or a build
+ * with -DNO_IO_URING), LOADDIR_THREADS threads read the files instead. Where
+ * neither fmemopen() nor threads are, the files are read one by one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knowledge.h"
+#include <dirent.h> //after knowledge.h: it may define MAX_INPUT, which is chat1002.h's to define.
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LOADDIR_READAHEAD 1
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define LOADDIR_URING 1
+#endif
+#endif
+#endif
+#include "alloc.h"
+
+#define LOADDIR_AHEAD 64 //Files read ahead of the one being parsed, at most.
+#define LOADDIR_THREADS 8 //Threads reading files where io_uring is not available.
+#define LOADDIR_CHUNK 65536 //Bytes read from a file at first; the buffer doubles for longer files.
+
+/* states of a file */
+#define FILE_READING 0 //Not read yet.
+#define FILE_READ    1 //Its contents are in data.
+#define FILE_FAILED  2 //It could not be opened or read.
+#define FILE_NOMEM   3 //There was no memory to read it into.
+
+typedef struct DirFile DirFile; //A file of the directory.
+struct DirFile {
+	char *path; //The directory followed by the name of the file.
+	char *data; //The contents of the file once read, NULL before.
+	size_t len; //Bytes of data read.
+	size_t size; //Size of data.
+	int fd; //The file while it is being read, -1 before and after.
+	int state; //FILE_READING until the file is read or fails.
+};
+
+typedef struct DirLoad DirLoad; //A directory being read into a knowledge base.
+struct DirLoad {
+	kb_t *kb;
+	DirFile *files; //The .ini files, in the order of their names.
+	int count; //Number of files.
+	int entries; //Entity/response pairs read so far.
+	int read; //Files read so far.
+	int failed; //Files that could not be read, or did not match their checksum.
+	int unverified; //Files read that had no checksum for all of them.
+};
+
+
+/*
+ * Order files by their names.
+ */
+static int dir_compare(const void *a, const void *b) {
+	return strcmp(((const DirFile *) a)->path, ((const DirFile *) b)->path);
+}
+
+
+/*
+ * List the .ini files of a directory, sorted by name.
+ *
+ * Input:
+ *   path - the directory
+ *
+ * Output:
+ *   load - its files and count are set
+ *
+ * Returns: KB_OK, KB_NOTFOUND if the directory could not be opened, or KB_NOMEM
+ */
+static int dir_list(DirLoad *load, const char *path) {
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		return KB_NOTFOUND;
+	}
+	int size = 64;
+	DirFile *files = (DirFile *) malloc(size * sizeof(DirFile));
+	int count = 0;
+	int result = files != NULL ? KB_OK : KB_NOMEM;
+	struct dirent *entry;
+	while (result == KB_OK && (entry = readdir(dir)) != NULL) {
+		if (kb_format(entry->d_name) != KB_FORMAT_INI) continue;
+#ifdef DT_DIR
+		if (entry->d_type == DT_DIR) continue;
+#endif
+		if (count == size) {
+			DirFile *grown = (DirFile *) realloc(files, size * 2 * sizeof(DirFile));
+			if (grown == NULL) {
+				result = KB_NOMEM;
+				break;
+			}
+			files = grown;
+			size *= 2;
+		}
+		size_t len = strlen(path) + strlen(entry->d_name) + 2;
+		char *name = (char *) malloc(len);
+		if (name == NULL) {
+			result = KB_NOMEM;
+			break;
+		}
+		snprintf(name, len, "%s/%s", path, entry->d_name);
+		DirFile *file = &files[count++];
+		file->path = name;
+		file->data = NULL;
+		file->len = 0;
+		file->size = 0;
+		file->fd = -1;
+		file->state = FILE_READING;
+	}
+	closedir(dir);
+	if (result != KB_OK) {
+		for (int i = 0; i < count; i++) free(files[i].path);
+		free(files);
+		return result;
+	}
+	qsort(files, count, sizeof(DirFile), dir_compare); //the files share the directory, so this sorts them by name.
+	load->files = files;
+	load->count = count;
+	return KB_OK;
+}
+
+
+/*
+ * Free the files of a directory, with whatever was read of them.
+ */
+static void dir_free(DirLoad *load) {
+	for (int i = 0; i < load->count; i++) {
+		free(load->files[i].path);
+		free(load->files[i].data);
+	}
+	free(load->files);
+}
+
+
+/*
+ * Grow the table for the files not parsed yet, guessing they hold as many
+ * entries each as those parsed so far. The table then grows a few times over
+ * the whole directory rather than step by step with every file.
+ */
+static void dir_presize(DirLoad *load, int parsed) {
+	if (parsed == 0 || load->entries == 0) return;
+	long more = (long) ((double) load->entries / parsed * (load->count - parsed));
+	HashTable *ht = load->kb->ht;
+	if (more > 0 && ht->count + more > ht->size)
+		ht_reserve(ht, more > 0x7fffffff - ht->count ? 0x7fffffff - ht->count : (int) more);
+}
+
+
+/*
+ * Count a file that has been parsed.
+ *
+ * Input:
+ *   index    - the index of the file
+ *   result   - what kb_read_staged() returned for it
+ *   verified - whether it matched its checksum
+ *
+ * Returns: KB_OK, or KB_NOMEM if its entries could not be stored
+ */
+static int dir_count(DirLoad *load, int index, int result, int verified) {
+	if (result == KB_CORRUPT) { //none of its entries are kept.
+		load->failed++;
+		return KB_OK;
+	}
+	if (result < 0) {
+		return result;
+	}
+	load->entries += result;
+	load->read++;
+	if (!verified) load->unverified++;
+	dir_presize(load, index + 1);
+	return KB_OK;
+}
+
+
+#ifdef LOADDIR_READAHEAD
+/*
+ * Make room to read more of a file: LOADDIR_CHUNK bytes at first, then twice
+ * what there was.
+ *
+ * Returns: 1 if successful, 0 if there was a memory allocation failure
+ */
+static int dir_grow(DirFile *file) {
+	size_t size = file->size == 0 ? LOADDIR_CHUNK : file->size * 2;
+	char *grown = (char *) realloc(file->data, size);
+	if (grown == NULL) return 0;
+	file->data = grown;
+	file->size = size;
+	return 1;
+}
+
+
+/*
+ * Read a whole file into memory with the usual system calls.
+ *
+ * Returns: the new state of the file, FILE_READ, FILE_FAILED or FILE_NOMEM
+ */
+static int dir_read_file(DirFile *file) {
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return FILE_FAILED;
+	int state = FILE_READ;
+	for (;;) {
+		if (file->len == file->size && !dir_grow(file)) {
+			state = FILE_NOMEM;
+			break;
+		}
+		ssize_t got = read(fd, file->data + file->len, file->size - file->len);
+		if (got < 0 && errno == EINTR) continue;
+		if (got < 0) state = FILE_FAILED;
+		if (got <= 0) break;
+		file->len += got;
+	}
+	close(fd);
+	return state;
+}
+
+
+/*
+ * Parse a file that has been read (or has failed), then free its contents.
+ *
+ * Returns: KB_OK, or KB_NOMEM if its entries could not be stored
+ */
+static int dir_parse(DirLoad *load, DirFile *file) {
+	int result = KB_OK;
+	if (file->state == FILE_NOMEM) {
+		result = KB_NOMEM;
+	} else if (file->state != FILE_READ) {
+		load->failed++;
+	} else if (file->len > 0) {
+		FILE *f = fmemopen(file->data, file->len, "r");
+		int verified = 0;
+		result = f != NULL ? kb_read_staged(load->kb, f, &verified) : KB_NOMEM;
+		if (f != NULL) fclose(f);
+		result = dir_count(load, (int) (file - load->files), result, verified);
+	} else {
+		load->read++;
+		load->unverified++;
+	}
+	free(file->data);
+	file->data = NULL;
+	return result;
+}
+#endif
+
+
+#ifdef LOADDIR_URING
+/* what a request of the ring does, in the low bits of its user_data; the index of its file is in the others */
+#define RING_OPEN  0
+#define RING_READ  1
+#define RING_CLOSE 2
+#define RING_SHIFT 2
+
+typedef struct Ring Ring; //An io_uring, as set up by ring_setup().
+struct Ring {
+	int fd; //The ring, -1 if it could not be set up.
+	unsigned entries; //Size of the submission queue.
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array; //The submission queue, shared with the kernel.
+	unsigned *cq_head, *cq_tail, *cq_mask; //The completion queue, shared with the kernel.
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map; //The mappings of the queues, which may be the same.
+	size_t sq_map_size, cq_map_size;
+	unsigned queued; //Requests queued but not submitted yet.
+	int running; //Requests submitted or queued whose completion has not been seen.
+	int stopping; //Set once the load has failed, so opened files are closed rather than read.
+};
+
+
+/*
+ * Set up an io_uring, mapping its queues into memory.
+ *
+ * Input:
+ *   entries - the size of the submission queue
+ *
+ * Returns: 1 if successful, 0 if io_uring is not available or is too old to
+ *   open, read and close files (IORING_FEAT_RW_CUR_POS came with them, in 5.6)
+ */
+static int ring_setup(Ring *ring, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(Ring));
+	ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) return 0;
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		return 0;
+	}
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0; //both queues are in one mapping.
+	if (single && ring->cq_map_size > ring->sq_map_size) ring->sq_map_size = ring->cq_map_size;
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_map = single ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = (struct io_uring_sqe *) mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+		if (!single && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+		if (ring->sqes != MAP_FAILED) munmap(ring->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+		close(ring->fd);
+		return 0;
+	}
+	char *sq = (char *) ring->sq_map, *cq = (char *) ring->cq_map;
+	ring->entries = p.sq_entries;
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 1;
+}
+
+
+/*
+ * Unmap and close an io_uring.
+ */
+static void ring_free(Ring *ring) {
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_size);
+	munmap(ring->sq_map, ring->sq_map_size);
+	close(ring->fd);
+}
+
+
+/*
+ * Submit the queued requests, and wait for at least one to complete.
+ *
+ * Input:
+ *   wait - 1 to wait for a completion, 0 only to submit
+ *
+ * Returns: 1 if successful, 0 if the ring failed
+ */
+static int ring_enter(Ring *ring, int wait) {
+	long done = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (done < 0) return errno == EINTR || errno == EAGAIN || errno == EBUSY; //try again, after reaping what has completed.
+	ring->queued -= (unsigned) done;
+	return 1;
+}
+
+
+/*
+ * Queue a request. The submission queue holds twice the files read at once,
+ * each of which has one request running, so it is only full if the kernel
+ * has not taken what was queued yet; it is then submitted first.
+ *
+ * Input:
+ *   op        - IORING_OP_OPENAT, IORING_OP_READ or IORING_OP_CLOSE
+ *   fd        - the file, or AT_FDCWD to open one
+ *   addr      - the path to open, or the buffer to read into
+ *   len       - the bytes to read
+ *   off       - the offset to read from
+ *   user_data - what the request does, and for which file
+ *
+ * Returns: 1 if successful, 0 if the queue stayed full
+ */
+static int ring_push(Ring *ring, int op, int fd, void *addr, unsigned len, unsigned long long off, unsigned long long user_data) {
+	unsigned tail = *ring->sq_tail; //only this thread moves the tail.
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries
+		&& (!ring_enter(ring, 0) || tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)) {
+		return 0;
+	}
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (unsigned char) op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long) (size_t) addr;
+	sqe->len = len;
+	sqe->off = off;
+	if (op == IORING_OP_OPENAT) sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE); //publish the request once it is filled in.
+	ring->queued++;
+	ring->running++;
+	return 1;
+}
+
+
+/*
+ * Close a file that has been opened, in the ring if possible.
+ */
+static void ring_close(Ring *ring, DirFile *file) {
+	if (!ring_push(ring, IORING_OP_CLOSE, file->fd, NULL, 0, 0, RING_CLOSE)) close(file->fd);
+	file->fd = -1;
+}
+
+
+/*
+ * Queue the read of the rest of a file, growing its buffer if it is full.
+ */
+static void ring_read(Ring *ring, DirFile *file, int index) {
+	if (file->len == file->size && !dir_grow(file)) {
+		file->state = FILE_NOMEM;
+		ring_close(ring, file);
+		return;
+	}
+	size_t room = file->size - file->len;
+	if (room > 0x7fffffff) room = 0x7fffffff;
+	if (!ring_push(ring, IORING_OP_READ, file->fd, file->data + file->len, (unsigned) room, file->len, ((unsigned long long) index << RING_SHIFT) | RING_READ)) {
+		file->state = FILE_FAILED;
+		ring_close(ring, file);
+	}
+}
+
+
+/*
+ * Take the completions of the ring, and queue the request that follows each:
+ * an opened file is read, a read that filled the buffer is followed by
+ * another, and a file read in full is closed. A read that stops short of the
+ * buffer has reached the end of the file.
+ */
+static void ring_reap(Ring *ring, DirFile *files) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		unsigned long long data = cqe->user_data;
+		int res = cqe->res;
+		ring->running--;
+		int op = (int) (data & ((1 << RING_SHIFT) - 1));
+		if (op == RING_CLOSE) continue;
+		int index = (int) (data >> RING_SHIFT);
+		DirFile *file = &files[index];
+		if (op == RING_OPEN) {
+			if (res < 0) {
+				file->state = FILE_FAILED;
+				continue;
+			}
+			file->fd = res;
+			if (ring->stopping) ring_close(ring, file);
+			else ring_read(ring, file, index);
+		} else if (res < 0 || ring->stopping) {
+			file->state = FILE_FAILED;
+			ring_close(ring, file);
+		} else {
+			file->len += res;
+			if (file->len < file->size) {
+				file->state = FILE_READ;
+				ring_close(ring, file);
+			} else {
+				ring_read(ring, file, index);
+			}
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE); //hand the completions back to the kernel.
+}
+
+
+/*
+ * Read and parse the files of a directory through an io_uring.
+ *
+ * Returns: KB_OK, KB_NOMEM or KB_IOERR, or KB_INVALID if there is no io_uring
+ *   to use, in which case nothing has been read
+ */
+static int dir_read_ring(DirLoad *load) {
+	Ring ring;
+	if (!ring_setup(&ring, LOADDIR_AHEAD * 2)) {
+		return KB_INVALID;
+	}
+	int result = KB_OK;
+	int issued = 0; //files whose open has been queued.
+	int next = 0; //the file to parse next.
+	while (next < load->count && result == KB_OK) {
+		for (; issued < load->count && issued < next + LOADDIR_AHEAD; issued++) {
+			if (!ring_push(&ring, IORING_OP_OPENAT, AT_FDCWD, load->files[issued].path, 0, 0, ((unsigned long long) issued << RING_SHIFT) | RING_OPEN))
+				load->files[issued].state = FILE_FAILED;
+		}
+		if (load->files[next].state == FILE_READING) { //wait for it, queueing what follows each request as it completes.
+			if (!ring_enter(&ring, 1)) result = KB_IOERR;
+			ring_reap(&ring, load->files);
+			continue;
+		}
+		if (ring.queued > 0 && !ring_enter(&ring, 0)) result = KB_IOERR; //let the kernel read on while this file is parsed.
+		if (result == KB_OK) result = dir_parse(load, &load->files[next++]);
+	}
+	ring.stopping = 1;
+	while (ring.running > 0 && ring_enter(&ring, 1)) //wait for the files still being read and closed.
+		ring_reap(&ring, load->files);
+	ring_free(&ring);
+	return result;
+}
+#endif
+
+
+#ifdef LOADDIR_READAHEAD
+typedef struct DirPool DirPool; //Threads reading the files of a directory ahead of the one being parsed.
+struct DirPool {
+	DirLoad *load;
+	int issued; //Files taken by a thread.
+	int next; //The file to parse next; threads take no file LOADDIR_AHEAD or more past it.
+	pthread_mutex_t lock;
+	pthread_cond_t ready; //Signalled when a file has been read.
+	pthread_cond_t room; //Signalled when a file has been parsed, so another may be read.
+};
+
+
+/*
+ * Read files, in order, until there are none left.
+ */
+static void *dir_worker(void *arg) {
+	DirPool *pool = (DirPool *) arg;
+	DirLoad *load = pool->load;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->issued < load->count && pool->issued >= pool->next + LOADDIR_AHEAD)
+			pthread_cond_wait(&pool->room, &pool->lock);
+		if (pool->issued >= load->count) break;
+		DirFile *file = &load->files[pool->issued++];
+		if (pool->issued == load->count) pthread_cond_broadcast(&pool->room); //the others waiting have nothing left to take.
+		pthread_mutex_unlock(&pool->lock);
+		int state = dir_read_file(file);
+		pthread_mutex_lock(&pool->lock);
+		file->state = state;
+		if (file == &load->files[pool->next]) pthread_cond_signal(&pool->ready); //only the file to parse next is waited for.
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+/*
+ * Read the files of a directory with LOADDIR_THREADS threads, and parse them
+ * in this one.
+ *
+ * Returns: KB_OK or KB_NOMEM, or KB_INVALID if no thread could be started, in
+ *   which case nothing has been read
+ */
+static int dir_read_pool(DirLoad *load) {
+	DirPool pool;
+	pthread_t threads[LOADDIR_THREADS];
+	int started = 0;
+	pool.load = load;
+	pool.issued = 0;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.ready, NULL);
+	pthread_cond_init(&pool.room, NULL);
+	while (started < LOADDIR_THREADS && started < load->count && pthread_create(&threads[started], NULL, dir_worker, &pool) == 0)
+		started++;
+
+	int result = started > 0 ? KB_OK : KB_INVALID;
+	while (result == KB_OK && pool.next < load->count) {
+		DirFile *file = &load->files[pool.next];
+		pthread_mutex_lock(&pool.lock);
+		while (file->state == FILE_READING)
+			pthread_cond_wait(&pool.ready, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		result = dir_parse(load, file);
+		pthread_mutex_lock(&pool.lock);
+		pool.next++;
+		if (result != KB_OK) {
+			pool.issued = load->count; //stop the threads taking more files.
+			pthread_cond_broadcast(&pool.room);
+		} else {
+			pthread_cond_signal(&pool.room); //one more file may be read.
+		}
+		pthread_mutex_unlock(&pool.lock);
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&pool.room);
+	pthread_cond_destroy(&pool.ready);
+	pthread_mutex_destroy(&pool.lock);
+	return result;
+}
+#endif
+
+
+/*
+ * Read and parse the files of a directory one after another.
+ *
+ * Returns: KB_OK or KB_NOMEM
+ */
+static int dir_read_each(DirLoad *load) {
+	for (int i = 0; i < load->count; i++) {
+		FILE *f = fopen(load->files[i].path, "r");
+		if (f == NULL) {
+			load->failed++;
+			continue;
+		}
+		int verified = 0;
+		int result = kb_read_staged(load->kb, f, &verified);
+		fclose(f);
+		result = dir_count(load, i, result, verified);
+		if (result != KB_OK) return result;
+	}
+	return KB_OK;
+}
+
+
+/*
+ * Read every .ini file of a directory into the knowledge base, as
+ * knowledge_read() would read each of them in turn, in the order of their
+ * names. Files that cannot be read are skipped. Files that do not match
+ * their checksum count as failed too, and none of their entries are kept, as
+ * knowledge_read() keeps none.
+ *
+ * Input:
+ *   path - the directory
+ *
+ * Output:
+ *   files      - the number of files read, if not NULL
+ *   failed     - the number of files that could not be read or are damaged, if not NULL
+ *   unverified - the number of files read that have no checksum for all of them, if not NULL
+ *
+ * Returns: the number of entity/response pairs read from the files,
+ *   KB_NOTFOUND if the directory could not be opened,
+ *   or KB_NOMEM or KB_READONLY as knowledge_read()
+ */
+int knowledge_read_dir(kb_t *kb, const char *path, int *files, int *failed, int *unverified) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (files != NULL) *files = 0;
+	if (failed != NULL) *failed = 0;
+	if (unverified != NULL) *unverified = 0;
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	DirLoad load;
+	load.kb = kb;
+	load.entries = 0;
+	load.read = 0;
+	load.failed = 0;
+	load.unverified = 0;
+	int result = dir_list(&load, path);
+	if (result != KB_OK) {
+		return result;
+	}
+
+	pthread_mutex_lock(&kb->lock);
+	result = kb->ht != NULL ? KB_INVALID : KB_NOMEM;
+#ifdef LOADDIR_URING
+	if (result == KB_INVALID) result = dir_read_ring(&load);
+#endif
+#ifdef LOADDIR_READAHEAD
+	if (result == KB_INVALID) result = dir_read_pool(&load);
+#endif
+	if (result == KB_INVALID) result = dir_read_each(&load);
+	if (result == KB_OK && kb->compress) ht_compress_responses(kb->ht, 1, DICT_SIZE); //retrain the dictionary once, on every file.
+	atomic_fetch_add(&kb->generation, 1);
+	kb_evict(kb);
+	pthread_mutex_unlock(&kb->lock);
+
+	if (files != NULL) *files = load.read;
+	if (failed != NULL) *failed = load.failed;
+	if (unverified != NULL) *unverified = load.unverified;
+	dir_free(&load);
+	return result == KB_OK ? load.entries : result;
+}
@@ -1,130 +1,368 @@
-/*
- * INF1002 (C Language) Group Project.
- *
- * This file implements the main loop, including dividing input into words.
- *
- * You should not need to modify this file. You may invoke its functions if you like, however.
- */
-
-#include <ctype.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include "chat1002.h"
-#include "chatbot.c" //uncomment this line if you have error.
-
-
-/*
- * Main loop.
- */
-int main(int argc, char *argv[]) {
-
-	char input[MAX_INPUT];      /* buffer for holding the user input */
-	int inc;                    /* the number of words in the user input */
-	char *inv[MAX_INPUT];       /* pointers to the beginning of each word of input */
-	char output[MAX_RESPONSE];  /* the chatbot's output */
-	int len;                    /* length of a word */
-	int done = 0;               /* set to 1 to end the main loop */
-
-	/* initialise the chatbot */
-	inv[0] = "reset";
-	inv[1] = NULL;
-	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
-
-	/* print a welcome message */
-	printf("%s: Hello! I'm %s. What can I do for you?\n", chatbot_botname(), chatbot_botname());
-
-	/* main command loop */
-	do {
-
-		do {
-			/* read the line */
-			printf("%s: ", chatbot_username());
-			fgets(input, MAX_INPUT, stdin);
-
-			/* split it into words */
-			inc = 0;
-			inv[inc] = strtok(input, delimiters);
-			while (inv[inc] != NULL) {
-
-				/* remove trailing punctuation */
-				len = strlen(inv[inc]);
-				while (len > 0 && ispunct(inv[inc][len - 1])) {
-					inv[inc][len - 1] = '\0';
-					len--;
-				}
-
-				/* go to the next word */
-				inc++;
-				inv[inc] = strtok(NULL, delimiters);
-			}
-		} while (inc < 1);
-
-		/* invoke the chatbot */
-		done = chatbot_main(inc, inv, output, MAX_RESPONSE);
-		printf("%s: %s\n", chatbot_botname(), output);
-
-	} while (!done);
-
-	return 0;
-}
-
-
-/*
- * Utility function for comparing string case-insensitively.
- *
- * Input:
- *   token1 - the first token
- *   token2 - the second token
- *
- * Returns:
- *   as strcmp()
- */
-int compare_token(const char *token1, const char *token2) {
-
-	int i = 0;
-	while (token1[i] != '\0' && token2[i] != '\0') {
-		if (toupper(token1[i]) < toupper(token2[i]))
-			return -1;
-		else if (toupper(token1[i]) > toupper(token2[i]))
-			return 1;
-		i++;
-	}
-
-	if (token1[i] == '\0' && token2[i] == '\0')
-		return 0;
-	else if (token1[i] == '\0')
-		return -1;
-	else
-		return 1;
-
-}
-
-
-/*
- * Prompt the user.
- *
- * Input:
- *   buf    - a buffer into which to store the answer
- *   n      - the maximum number of characters to write to the buffer
- *   format - format string, as printf
- *   ...    - as printf
- */
-void prompt_user(char *buf, int n, const char *format, ...) {
-
-	/* print the prompt */
-	va_list args;
-	va_start(args, format);
-	printf("%s: ", chatbot_botname());
-	vprintf(format, args);
-	printf(" ");
-	va_end(args);
-	printf("\n%s: ", chatbot_username());
-
-	/* get the response from the user */
-	fgets(buf, n, stdin);
-	char *nl = strchr(buf, '\n');
-	if (nl != NULL)
-		*nl = '\0';
-}
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the main loop, which reads lines of input and prints the chatbot's responses.
+ *
+ * You should not need to modify this file. You may invoke its functions if you like, however.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+#include "trace.h"
+#include "alloc.h"
+
+/* functions defined in bench.c and batch.c */
+int bench_main(const char *filename);
+int batch_main(kb_t *kb, FILE *in, FILE *out, int threads, int memo);
+
+
+/*
+ * Parse a size in bytes, optionally followed by K, M or G.
+ *
+ * Returns: the size, or 0 if it is not a valid size
+ */
+static size_t parse_size(const char *text) {
+	char *end;
+	unsigned long long size = strtoull(text, &end, 10);
+	if (end == text) return 0;
+	switch (*end) {
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+		case 'g': case 'G': size <<= 30; end++; break;
+	}
+	return *end == '\0' ? (size_t) size : 0;
+}
+
+
+/*
+ * Write the trace started by --trace, if there is one, then free it.
+ *
+ * Input:
+ *   filename - the file to write to, or NULL if there is no trace
+ *
+ * Returns: 0 if successful, 1 if the file could not be written
+ */
+static int write_trace(const char *filename) {
+	if (filename == NULL) return 0;
+	size_t len = strlen(filename);
+	int format = len >= 5 && strcmp(filename + len - 5, ".json") == 0 ? TRACE_FORMAT_CHROME : TRACE_FORMAT_HISTOGRAM;
+	FILE *f = fopen(filename, "w");
+	int result = f != NULL ? trace_write(f, format) : KB_IOERR;
+	if (f != NULL && fclose(f) != 0) result = KB_IOERR;
+	trace_free();
+	if (result != KB_OK) {
+		fprintf(stderr, "Could not write the trace to %s\n", filename);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Freeze a knowledge file into an image for --base, then report on it.
+ *
+ * Input:
+ *   in       - the knowledge file, .ini, .csv or .jsonl
+ *   out      - the image to write, .kbf
+ *   compress - 1 to keep the responses of the image compressed
+ *
+ * Returns: 0 if successful, 1 if not
+ */
+static int freeze_main(const char *in, const char *out, int compress) {
+	int format = kb_format(in);
+	if (format < 0 || format == KB_FORMAT_FROZEN || kb_format(out) != KB_FORMAT_FROZEN) {
+		fprintf(stderr, "Usage: chatbot [--compress] --freeze FILE.ini|FILE.csv|FILE.jsonl FILE.kbf\n");
+		return 1;
+	}
+	FILE *f = fopen(in, "r");
+	if (f == NULL) {
+		fprintf(stderr, "File %s not found\n", in);
+		return 1;
+	}
+	kb_t *kb = kb_create();
+	if (kb == NULL) {
+		fclose(f);
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (compress)
+		knowledge_compress(kb, 1);
+	int verified = 1;
+	int result = format == KB_FORMAT_INI ? knowledge_read_verified(kb, f, &verified) : knowledge_import(kb, f, format);
+	fclose(f);
+	if (result < 0) {
+		if (result == KB_CORRUPT) fprintf(stderr, "%s is damaged: it does not match its checksum\n", in);
+		else fprintf(stderr, "Could not read %s\n", in);
+		kb_free(kb);
+		return 1;
+	}
+	if (!verified)
+		fprintf(stderr, "%s has no checksum, it was read unverified\n", in);
+
+	clock_t start = clock();
+	size_t index_bytes = 0;
+	f = fopen(out, "wb");
+	result = f != NULL ? knowledge_freeze(kb, f, &index_bytes) : KB_IOERR;
+	if (f != NULL && fclose(f) != 0 && result >= 0) result = KB_IOERR;
+	kb_free(kb);
+	if (result < 0) {
+		if (result == KB_NOMEM) fprintf(stderr, "Out of memory\n");
+		else fprintf(stderr, "Could not write %s\n", out);
+		if (f != NULL) remove(out);
+		return 1;
+	}
+	printf("froze %d entries into %s in %.2f s, the index takes %zu bytes (%.2f bits per entry)\n",
+		result, out, (double) (clock() - start) / CLOCKS_PER_SEC, index_bytes, result > 0 ? index_bytes * 8.0 / result : 0.0);
+	return 0;
+}
+
+
+/*
+ * Check a saved knowledge file against the checksum it ends with, without
+ * loading it, then report on it.
+ *
+ * Input:
+ *   filename - the file, .ini
+ *
+ * Returns: 0 if the file matches its checksum, 1 if it does not, has none or cannot be read
+ */
+static int verify_main(const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (f == NULL) {
+		fprintf(stderr, "File %s not found\n", filename);
+		return 1;
+	}
+	clock_t start = clock();
+	long entries;
+	unsigned int checksum;
+	int result = knowledge_verify(f, &entries, &checksum);
+	fclose(f);
+	if (result == KB_OK) {
+		printf("%s is intact: %ld lines, crc32 %08x, checked in %.2f s\n",
+			filename, entries, checksum, (double) (clock() - start) / CLOCKS_PER_SEC);
+		return 0;
+	}
+	if (result == KB_NOTFOUND) fprintf(stderr, "%s has no checksum for all of its %ld lines (crc32 %08x)\n", filename, entries, checksum);
+	else if (result == KB_CORRUPT) fprintf(stderr, "%s is damaged: it does not match its checksum\n", filename);
+	else if (result == KB_NOMEM) fprintf(stderr, "Out of memory\n");
+	else fprintf(stderr, "Could not read %s\n", filename);
+	return 1;
+}
+
+#ifdef ALLOC_STATS
+/*
+ * Write the allocations counted. Registered with atexit(), so it runs once
+ * everything else is freed, and what is still live has leaked.
+ */
+static void report_allocations() {
+	alloc_report(stderr);
+}
+#endif
+
+
+/*
+ * Main loop.
+ *
+ * Options:
+ *   --compress    keep responses compressed with a trained dictionary
+ *   --base FILE   read FILE into a shared, read only base; the chatbot learns and forgets in a layer on top of it.
+ *                 FILE may be an image written by --freeze or "freeze as", or a directory of .ini files
+ *   --replicate   with --base, copy the base into the memory of each NUMA node, so lookups read the copy next to them
+ *   --watch FILE  read FILE, then reload it whenever it changes
+ *   --budget SIZE keep responses within SIZE bytes (K, M or G may follow), evicting the coldest to a spill file
+ *   --batch       answer the lines of standard input, one response per line, without prompting
+ *   --threads N   answer the questions of batch mode with N threads
+ *   --memo N      keep the responses to the N questions asked most recently, and answer them again without looking them up
+ *   --trace FILE  time each stage of each request, and write the timings to FILE on exit: every event in the
+ *                 Chrome trace event format if FILE ends in .json, else a table of percentiles per stage
+ *   --bench FILE  read FILE, print how fast and how large it is with and without compression, then exit
+ *   --freeze IN OUT  freeze the knowledge file IN into the image OUT (.kbf) for --base, then exit
+ *   --verify FILE check that the .ini file FILE matches the checksum it was saved with, then exit
+ */
+int main(int argc, char *argv[]) {
+
+	char input[MAX_INPUT];      /* buffer for holding the user input */
+	char output[MAX_RESPONSE];  /* the chatbot's output */
+	int done = 0;               /* set to 1 to end the main loop */
+	int compress = 0;           /* set to 1 to keep responses compressed */
+	int batch = 0;              /* set to 1 to run in batch mode */
+	int threads = 1;            /* number of threads answering questions in batch mode */
+	int memo = 0;               /* number of responses kept in the memo, 0 for no memo */
+	int replicate = 0;          /* set to 1 to copy the base to each NUMA node */
+	const char *basefile = NULL; /* file to read into the shared base, if any */
+	const char *watchfile = NULL; /* file to read and reload on change, if any */
+	size_t budget = 0;          /* bytes the responses may take, 0 for no limit */
+	const char *tracefile = NULL; /* file to write the trace to, if any */
+	kb_watch_t *watch = NULL;   /* the watch on watchfile */
+	kb_t *kb;                   /* the chatbot's knowledge */
+	chat_session_t *session;    /* the conversation with the user */
+
+#ifdef ALLOC_STATS
+	atexit(report_allocations);
+#endif
+
+	/* read the options */
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--compress") == 0)
+			compress = 1;
+		else if (strcmp(argv[i], "--base") == 0 && i + 1 < argc)
+			basefile = argv[++i];
+		else if (strcmp(argv[i], "--replicate") == 0)
+			replicate = 1;
+		else if (strcmp(argv[i], "--batch") == 0)
+			batch = 1;
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--memo") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+			memo = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+			watchfile = argv[++i];
+		else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc && parse_size(argv[i + 1]) > 0)
+			budget = parse_size(argv[++i]);
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracefile = argv[++i];
+		else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+			return bench_main(argv[i + 1]);
+		else if (strcmp(argv[i], "--freeze") == 0 && i + 2 < argc)
+			return freeze_main(argv[i + 1], argv[i + 2], compress);
+		else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc)
+			return verify_main(argv[i + 1]);
+		else {
+			fprintf(stderr, "Usage: %s [--compress] [--base FILE [--replicate]] [--watch FILE] [--budget SIZE] [--batch [--threads N]] [--memo N] [--trace FILE] [--bench FILE] [--freeze IN OUT] [--verify FILE]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	/* initialise the chatbot */
+	kb = kb_create();
+	if (kb == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	if (compress)
+		knowledge_compress(kb, 1);
+	if (basefile != NULL) {
+		/* read the base, then chat in a layer on top of it */
+		int frozen = kb_format(basefile) == KB_FORMAT_FROZEN;
+		int files, failed, unverified;
+		int verified = 1;
+		int result = frozen ? KB_NOTFOUND : knowledge_read_dir(kb, basefile, &files, &failed, &unverified);
+		if (result == KB_NOTFOUND) {
+			/* not a directory, so a file */
+			FILE *f = fopen(basefile, frozen ? "rb" : "r");
+			if (f == NULL) {
+				fprintf(stderr, "File %s not found\n", basefile);
+				kb_free(kb);
+				return 1;
+			}
+			result = frozen ? knowledge_load_frozen(kb, f) : knowledge_read_verified(kb, f, &verified);
+			fclose(f);
+		} else {
+			if (failed > 0)
+				fprintf(stderr, "%d files in %s could not be read or are damaged\n", failed, basefile);
+			if (unverified > 0)
+				fprintf(stderr, "%d files in %s have no checksum, they were read unverified\n", unverified, basefile);
+		}
+		if (result == KB_CORRUPT)
+			fprintf(stderr, "%s does not match its checksum, it may be damaged; nothing was read from it\n", basefile);
+		else if (result >= 0 && !verified)
+			fprintf(stderr, "%s has no checksum, it was read unverified\n", basefile);
+		if (frozen && result < 0) {
+			if (result == KB_NOMEM) fprintf(stderr, "Out of memory\n");
+			else fprintf(stderr, "%s is not a frozen knowledge base this chatbot can read\n", basefile);
+			kb_free(kb);
+			return 1;
+		}
+		if (replicate && (result = knowledge_replicate(kb)) < 0)
+			fprintf(stderr, "Cannot replicate %s, it stays in the memory it was read into\n", basefile);
+		kb_t *base = kb;
+		kb = kb_create_layered(base);
+		kb_free(base); /* the layer keeps the base alive */
+		if (kb == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		if (compress)
+			knowledge_compress(kb, 1);
+	}
+	if (budget > 0) {
+		int result = knowledge_set_budget(kb, budget);
+		if (result == KB_INVALID) {
+			kb_stats_t stats;
+			knowledge_stats(kb, &stats);
+			fprintf(stderr, "A budget of %zu bytes is below the %zu bytes the responses take with every one evicted, responses will all stay in memory\n", budget, stats.floor_bytes);
+		} else if (result != KB_OK) {
+			fprintf(stderr, "Cannot create a spill file, responses will all stay in memory\n");
+		}
+	}
+	if (watchfile != NULL) {
+		/* read the file, then keep reloading it as it changes */
+		FILE *f = fopen(watchfile, "r");
+		if (f == NULL) {
+			fprintf(stderr, "File %s not found\n", watchfile);
+			kb_free(kb);
+			return 1;
+		}
+		int result = knowledge_reload(kb, f);
+		fclose(f);
+		if (result < 0) {
+			if (result == KB_NOMEM) fprintf(stderr, "Out of memory\n");
+			else if (result == KB_CORRUPT) fprintf(stderr, "%s does not match its checksum, it may be damaged; nothing was read from it\n", watchfile);
+			else fprintf(stderr, "Could not read %s\n", watchfile);
+			kb_free(kb);
+			return 1;
+		}
+		watch = kb_watch(kb, watchfile);
+		if (watch == NULL)
+			fprintf(stderr, "Cannot watch %s, it will not be reloaded\n", watchfile);
+	}
+
+	if (tracefile != NULL)
+		trace_start();
+
+	if (batch) {
+		int status = batch_main(kb, stdin, stdout, threads, memo);
+		kb_unwatch(watch);
+		kb_free(kb);
+		return write_trace(tracefile) != 0 ? 1 : status;
+	}
+
+	/* print a welcome message */
+	printf("%s: Hello! I'm %s. What can I do for you?\n", chatbot_botname(), chatbot_botname());
+
+	/* main command loop */
+	session = chatbot_session_create(kb);
+	if (session == NULL || chatbot_session_set_memo(session, memo) != KB_OK) {
+		chatbot_session_free(session);
+		fprintf(stderr, "Out of memory\n");
+		kb_unwatch(watch);
+		kb_free(kb);
+		return 1;
+	}
+	do {
+
+		/* read the line */
+		printf("%s: ", chatbot_username());
+		TRACE_REQUEST();
+		TRACE_BEGIN(read);
+		if (fgets(input, MAX_INPUT, stdin) == NULL)
+			break;
+		TRACE_END(TRACE_READ, read);
+
+		/* invoke the chatbot, which splits the line into words unless it is the answer to something the chatbot asked */
+		done = chatbot_handle_line(session, input, output, MAX_RESPONSE);
+		TRACE_BEGIN(format);
+		if (output[0] != '\0')
+			printf("%s: %s\n", chatbot_botname(), output);
+		TRACE_END(TRACE_FORMAT, format);
+
+	} while (!done);
+
+	chatbot_session_free(session);
+	kb_unwatch(watch);
+	kb_free(kb);
+	return write_trace(tracefile);
+}
@@ -0,0 +1,262 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the memo: a cache of the responses to the questions a
+ * session was asked most recently, keyed on the line as typed.
+ *
+ * Real traffic is skewed: a few thousand distinct lines make up most of it.
+ * Each of them is otherwise split into words, dispatched, reassembled into an
+ * entity and looked up again every time it is asked. memo_key() reduces a
+ * line to the words chatbot_split() would find, joined by single spaces, with
+ * the question word in lower case, so lines that differ only in spacing or
+ * punctuation share an entry; memo_get() then returns the response without
+ * any of that work.
+ *
+ * An answer is only kept while knowledge_generation() stays where it was
+ * when the answer was looked up: learning, forgetting, loading or resetting
+ * moves it on, which makes every older entry stale at once, without finding
+ * them. Only answered questions are kept; anything else may change the
+ * knowledge or the session.
+ *
+ * The memo holds a fixed number of entries. When it is full, a CLOCK hand
+ * sweeps over them: a stale entry is replaced at once, an entry hit since the
+ * hand last passed is spared once more, and the first other one is replaced.
+ * A line asked only once is thus gone the next time round, while the lines
+ * asked again and again stay, for the cost of one bit per entry.
+ *
+ * A memo belongs to one session (see chatbot_session_set_memo()) and is not
+ * locked: give each thread its own.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+#include "alloc.h"
+
+#define MEMO_NONE -1 //End of a bucket.
+
+/* Delimiters for splitting input to words, as in chatbot.c */
+static const char *delimiters = " ?\t\n";
+
+typedef struct MemoEntry MemoEntry; //A response kept in the memo.
+struct MemoEntry {
+	unsigned int hash; //Hash of the key.
+	unsigned int generation; //knowledge_generation() when the response was looked up.
+	int next; //Next entry in the same bucket, or MEMO_NONE.
+	int ref; //Set by hits, cleared by the CLOCK hand.
+	int len; //Length of the response.
+	char key[MAX_INPUT]; //The line, as reduced by memo_key().
+	char response[MAX_RESPONSE];
+};
+
+struct chat_memo {
+	MemoEntry *entries;
+	int size; //Number of entries.
+	int count; //Entries in use, the first count of them.
+	int *buckets; //First entry of each bucket, or MEMO_NONE.
+	unsigned int mask; //Number of buckets, a power of two, less one.
+	int hand; //Next entry the CLOCK hand visits.
+	long hits; //Lookups answered.
+	long misses; //Lookups not answered, whether the line was not kept or its answer was stale.
+};
+
+
+/*
+ * Create a memo.
+ *
+ * Input:
+ *   entries - the number of responses it keeps
+ *
+ * Returns: the memo, or NULL if entries is not positive or there was a memory allocation failure
+ */
+chat_memo_t *memo_create(int entries) {
+	if (entries <= 0) {
+		return NULL;
+	}
+	unsigned int buckets = 1;
+	while (buckets < (unsigned int) entries && buckets < 0x40000000) buckets <<= 1;
+	chat_memo_t *memo = (chat_memo_t *) calloc(1, sizeof(chat_memo_t));
+	if (memo == NULL) {
+		return NULL;
+	}
+	memo->entries = (MemoEntry *) malloc((size_t) entries * sizeof(MemoEntry));
+	memo->buckets = (int *) malloc(buckets * sizeof(int));
+	if (memo->entries == NULL || memo->buckets == NULL) {
+		memo_free(memo);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < buckets; i++) memo->buckets[i] = MEMO_NONE;
+	memo->size = entries;
+	memo->mask = buckets - 1;
+	return memo;
+}
+
+
+/*
+ * Free a memo.
+ */
+void memo_free(chat_memo_t *memo) {
+	if (memo == NULL) return;
+	free(memo->entries);
+	free(memo->buckets);
+	free(memo);
+}
+
+
+/*
+ * Reduce a line to the key of its response: its words as chatbot_split()
+ * finds them, joined by single spaces, with the first in lower case.
+ *
+ * Input:
+ *   line - the line
+ *   key  - a buffer to receive the key
+ *   n    - the size of the buffer
+ *
+ * Returns: the length of the key, or 0 if the line is not a question, or
+ *   does not fit in the buffer, and so has no key
+ */
+int memo_key(const char *line, char *key, int n) {
+	int len = 0;
+	int words = 0;
+	int first = 0; //length of the first word.
+	const char *p = line + strspn(line, delimiters);
+	while (*p != '\0') {
+		size_t word = strcspn(p, delimiters);
+		size_t keep = word;
+		while (keep > 0 && ispunct((unsigned char) p[keep - 1])) keep--; //trailing punctuation, as chatbot_split() removes it.
+		if (len + (words > 0) + (int) keep >= n) return 0;
+		if (words > 0) key[len++] = ' ';
+		for (size_t i = 0; i < keep; i++) key[len++] = words == 0 ? (char) tolower((unsigned char) p[i]) : p[i];
+		if (words++ == 0) first = len;
+		p += word;
+		p += strspn(p, delimiters);
+	}
+	if (words < 2 || first >= MAX_INTENT) return 0; //a question has an entity after its question word.
+	key[len] = '\0';
+	char intent[MAX_INTENT];
+	memcpy(intent, key, first);
+	intent[first] = '\0';
+	return chatbot_is_question(intent) ? len : 0;
+}
+
+
+/*
+ * Hash a key with FNV-1a.
+ */
+static unsigned int memo_hash(const char *key) {
+	unsigned int hash = 2166136261u;
+	for (; *key != '\0'; key++) hash = (hash ^ (unsigned char) *key) * 16777619u;
+	return hash;
+}
+
+
+/*
+ * Find the entry of a key.
+ *
+ * Returns: the index of the entry, or MEMO_NONE
+ */
+static int memo_find(const chat_memo_t *memo, const char *key, unsigned int hash) {
+	for (int i = memo->buckets[hash & memo->mask]; i != MEMO_NONE; i = memo->entries[i].next)
+		if (memo->entries[i].hash == hash && strcmp(memo->entries[i].key, key) == 0) return i;
+	return MEMO_NONE;
+}
+
+
+/*
+ * Look up the response to a line.
+ *
+ * Input:
+ *   kb       - the knowledge base the response comes from
+ *   key      - the key of the line, from memo_key()
+ *   response - a buffer to receive the response
+ *   n        - the size of the buffer
+ *
+ * Output:
+ *   generation - the generation of the knowledge base, read before the
+ *                lookup; give it to memo_put() with the response found
+ *
+ * Returns: 1 if the response was kept, 0 if it has to be looked up
+ */
+int memo_get(chat_memo_t *memo, kb_t *kb, const char *key, char *response, int n, unsigned int *generation) {
+	*generation = knowledge_generation(kb);
+	int i = memo_find(memo, key, memo_hash(key));
+	if (i == MEMO_NONE || memo->entries[i].generation != *generation) {
+		memo->misses++;
+		return 0;
+	}
+	MemoEntry *e = &memo->entries[i];
+	e->ref = 1;
+	memo->hits++;
+	int len = e->len < n ? e->len : n - 1;
+	memcpy(response, e->response, len);
+	response[len] = '\0';
+	return 1;
+}
+
+
+/*
+ * Take an entry to replace, moving the CLOCK hand past it.
+ *
+ * Input:
+ *   generation - the current generation; entries of any other are stale
+ *
+ * Returns: the index of the entry, which is unlinked from its bucket
+ */
+static int memo_evict(chat_memo_t *memo, unsigned int generation) {
+	for (;;) {
+		MemoEntry *e = &memo->entries[memo->hand];
+		int i = memo->hand;
+		memo->hand = memo->hand + 1 < memo->size ? memo->hand + 1 : 0;
+		if (e->ref && e->generation == generation) { //hit since the hand last came by: spare it once more.
+			e->ref = 0;
+			continue;
+		}
+		int *link = &memo->buckets[e->hash & memo->mask];
+		while (*link != i) link = &memo->entries[*link].next;
+		*link = e->next;
+		return i;
+	}
+}
+
+
+/*
+ * Keep the response to a line, replacing the least recently asked if the
+ * memo is full.
+ *
+ * Input:
+ *   key        - the key of the line, from memo_key()
+ *   generation - the generation memo_get() gave when the line was looked up
+ *   response   - the response
+ */
+void memo_put(chat_memo_t *memo, const char *key, unsigned int generation, const char *response) {
+	unsigned int hash = memo_hash(key);
+	int i = memo_find(memo, key, hash);
+	if (i == MEMO_NONE) {
+		i = memo->count < memo->size ? memo->count++ : memo_evict(memo, generation);
+		MemoEntry *e = &memo->entries[i];
+		e->hash = hash;
+		e->ref = 0; //a line must be asked again before the hand spares it.
+		snprintf(e->key, sizeof(e->key), "%s", key);
+		e->next = memo->buckets[hash & memo->mask];
+		memo->buckets[hash & memo->mask] = i;
+	}
+	MemoEntry *e = &memo->entries[i];
+	e->generation = generation;
+	e->len = snprintf(e->response, sizeof(e->response), "%s", response);
+	if (e->len >= (int) sizeof(e->response)) e->len = sizeof(e->response) - 1;
+}
+
+
+/*
+ * Count the lookups of a memo.
+ *
+ * Output:
+ *   hits   - the lookups answered from the memo
+ *   misses - the others
+ */
+void memo_stats(const chat_memo_t *memo, long *hits, long *misses) {
+	*hits = memo->hits;
+	*misses = memo->misses;
+}
@@ -0,0 +1,307 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements replicated knowledge bases. "chatbot --base FILE
+ * --replicate" copies the base into the memory of each NUMA node, and every
+ * lookup then reads the copy of the node its thread runs on.
+ *
+ * On a machine with several sockets, each bank of memory is attached to one
+ * of them. A thread reading memory attached to another socket waits for it
+ * to cross the interconnect, which takes half as long again or more, and
+ * shares the interconnect with every other thread doing the same. A shared
+ * base is read by every thread and written by none, so it can be copied once
+ * per node for nothing but memory.
+ *
+ * Only a frozen table is copied as it is, in one block: a base read from
+ * ini files is frozen in memory first (see frozen.c). Each copy is mapped
+ * with mmap() and bound to its node with mbind() before anything is written
+ * to it, then filled by a thread running on that node, so the dictionary and
+ * index built with it are in that node's memory too. The copies are published
+ * together, once, and never change: what the chatbot learns goes to the layer
+ * on top of the base, which is small and not copied.
+ *
+ * The nodes and their CPUs are read from /sys/devices/system/node, and
+ * mbind() is called directly, so libnuma is not needed. Elsewhere than on
+ * Linux, and on machines with one node, nothing is copied.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE //for sched_getcpu() and pthread_setaffinity_np().
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knowledge.h"
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "alloc.h"
+
+#define NUMA_MAX_NODES 64 //Nodes looked for; the CPUs of any past these read the table itself.
+#define NUMA_MPOL_PREFERRED 1 //MPOL_PREFERRED of <numaif.h>: take pages from the node as long as it has any.
+
+typedef struct NumaCopy NumaCopy; //A replica being made, see numa_copy().
+struct NumaCopy {
+	const HashTable *table; //The frozen table to copy.
+	int node; //The node to copy it to.
+	HashTable *replica; //The copy, NULL until it is made or if there was no memory for it.
+};
+
+#ifdef __linux__
+
+static int numa_count = 1; //Number of nodes, from node 0 to the last.
+static cpu_set_t numa_cpus[NUMA_MAX_NODES]; //The CPUs of each node.
+static unsigned char numa_cpu_node[CPU_SETSIZE]; //The node of each CPU.
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Read which CPUs each node has. Called once, by numa_nodes().
+ */
+static void numa_topology() {
+	for (int node = 0; node < NUMA_MAX_NODES; node++) {
+		char path[64];
+		char line[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) continue;
+		if (fgets(line, sizeof(line), f) != NULL) {
+			char *p = line;
+			for (;;) { //a list of CPUs and ranges of them, such as "0-7,16-23".
+				char *end;
+				long first = strtol(p, &end, 10);
+				if (end == p) break;
+				long last = first;
+				if (*end == '-') last = strtol(end + 1, &end, 10);
+				for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+					CPU_SET(cpu, &numa_cpus[node]);
+					numa_cpu_node[cpu] = (unsigned char) node;
+				}
+				if (*end != ',') break;
+				p = end + 1;
+			}
+		}
+		fclose(f);
+		numa_count = node + 1;
+	}
+}
+
+
+/*
+ * Count the NUMA nodes.
+ *
+ * Returns: the number of nodes, 1 if the machine has no NUMA
+ */
+int numa_nodes() {
+	pthread_once(&numa_once, numa_topology);
+	return numa_count;
+}
+
+
+/*
+ * Find the NUMA node the calling thread runs on. The thread may move to
+ * another node at any time, so this is only a hint.
+ *
+ * Returns: the node, which is 0 until numa_nodes() has been called
+ */
+int numa_current_node() {
+	int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? numa_cpu_node[cpu] : 0;
+}
+
+
+/*
+ * Make the calling thread run on the CPUs of a NUMA node only.
+ *
+ * Returns: 1 if it does, 0 if the node has no CPUs or the thread cannot be moved
+ */
+int numa_run_on(int node) {
+	if (node < 0 || node >= numa_nodes() || CPU_COUNT(&numa_cpus[node]) == 0) return 0;
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_cpus[node]) == 0;
+}
+
+
+/*
+ * Map memory for an image in a NUMA node. The pages are bound to the node
+ * before anything touches them, so they are taken from its memory whichever
+ * thread touches them first.
+ *
+ * Output:
+ *   mapped - the bytes mapped, to give back to numa_unmap()
+ *
+ * Returns: the memory, or NULL if it could not be mapped
+ */
+static char *numa_map(size_t size, int node, size_t *mapped) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	*mapped = (size + page - 1) / page * page;
+	void *image = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (image == MAP_FAILED) return NULL;
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	syscall(SYS_mbind, image, *mapped, NUMA_MPOL_PREFERRED, mask, (unsigned long) NUMA_MAX_NODES + 1, 0); //if it fails, the pages are placed as first touched.
+	return (char *) image;
+}
+
+
+/*
+ * Unmap an image mapped by numa_map().
+ */
+void numa_unmap(char *image, size_t mapped) {
+	munmap(image, mapped);
+}
+
+
+/*
+ * Copy a frozen table into the memory of a NUMA node, from a thread of its
+ * own running on that node.
+ *
+ * Input:
+ *   arg - the NumaCopy to make
+ */
+static void *numa_copy(void *arg) {
+	NumaCopy *copy = (NumaCopy *) arg;
+	size_t mapped;
+	if (!numa_run_on(copy->node)) return NULL; //no thread runs on the node to read a copy, or none can be made to.
+	char *image = numa_map(copy->table->frozen->size, copy->node, &mapped);
+	if (image == NULL) return NULL;
+	copy->replica = frozen_copy(copy->table, image, mapped);
+	if (copy->replica == NULL) numa_unmap(image, mapped);
+	return NULL;
+}
+
+#else
+
+int numa_nodes() {
+	// Without NUMA support, there is one node.
+	return 1;
+}
+
+int numa_current_node() {
+	return 0;
+}
+
+int numa_run_on(int node) {
+	return 0;
+}
+
+void numa_unmap(char *image, size_t mapped) {
+	// Nothing is mapped without NUMA support.
+}
+
+static void *numa_copy(void *arg) {
+	return NULL;
+}
+
+#endif
+
+
+/*
+ * Freeze the table of a knowledge base in memory, going through a temporary
+ * file, so that it can be copied in one block.
+ *
+ * Returns: the number of entries, or as knowledge_freeze() and knowledge_load_frozen()
+ */
+static int numa_freeze(kb_t *kb) {
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	FILE *f = tmpfile();
+	if (f == NULL) {
+		return KB_IOERR;
+	}
+	int result = knowledge_freeze(kb, f, NULL);
+	if (result >= 0) {
+		rewind(f);
+		result = knowledge_load_frozen(kb, f);
+	}
+	fclose(f);
+	return result;
+}
+
+
+/*
+ * Copy the knowledge base into the memory of each NUMA node, so every thread
+ * looking it up reads the copy next to it. A knowledge base that is not a
+ * frozen image is frozen first. Either way it is then read only, as a shared
+ * base is: replicate a base before layering anything on it, unless it is
+ * frozen. On a machine with one node nothing is copied, and the knowledge
+ * base is left as it is.
+ *
+ * Returns:
+ *   the number of nodes the knowledge base is copied to, or 1 if nothing is copied because the machine has one
+ *   node, or threads cannot be moved to the others
+ *   KB_INVALID, if the knowledge base is layered
+ *   KB_READONLY, if it is already shared as a base, and not frozen
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERR, if the temporary file to freeze it through could not be written
+ */
+int knowledge_replicate(kb_t *kb) {
+	ALLOC_OP(ALLOC_OP_LOAD);
+	if (kb->base != NULL) {
+		return KB_INVALID;
+	}
+	int nodes = numa_nodes();
+	if (nodes <= 1) { //nothing to copy, so nothing is frozen either.
+		return 1;
+	}
+	HashTable *ht = atomic_load(&kb->ht);
+	if (ht == NULL || ht->frozen == NULL) {
+		int result = numa_freeze(kb);
+		if (result < 0) {
+			return result;
+		}
+	}
+	pthread_mutex_lock(&kb->lock);
+	ht = atomic_load(&kb->ht); //read only from here on, so it stays.
+	if (atomic_load(&kb->replicas) != NULL) {
+		int copies = kb->nodes > 1 ? kb->nodes : 1;
+		pthread_mutex_unlock(&kb->lock);
+		return copies;
+	}
+	HashTable **replicas = (HashTable **) calloc(nodes, sizeof(HashTable *));
+	NumaCopy *copies = (NumaCopy *) calloc(nodes, sizeof(NumaCopy));
+	pthread_t *threads = (pthread_t *) malloc(nodes * sizeof(pthread_t));
+	int *started = (int *) calloc(nodes, sizeof(int));
+	int result = KB_NOMEM;
+	if (replicas != NULL && copies != NULL && threads != NULL && started != NULL) {
+		for (int n = 0; n < nodes; n++) { //every node at once, each from a thread on it.
+			copies[n].table = ht;
+			copies[n].node = n;
+			started[n] = pthread_create(&threads[n], NULL, numa_copy, &copies[n]) == 0;
+		}
+		result = 0;
+		for (int n = 0; n < nodes; n++) {
+			if (started[n]) pthread_join(threads[n], NULL);
+			replicas[n] = copies[n].replica;
+			if (replicas[n] != NULL) result++;
+		}
+	}
+	if (result > 0) { //a node left without a copy reads the table itself.
+		kb->nodes = result;
+		atomic_store_explicit(&kb->replicas, replicas, memory_order_release);
+		replicas = NULL;
+	} else if (result == 0) { //no thread could be moved to any node: lookups stay where they are.
+		result = 1;
+	}
+	pthread_mutex_unlock(&kb->lock);
+	for (int n = 0; replicas != NULL && n < nodes; n++) free_table(replicas[n]);
+	free(replicas);
+	free(copies);
+	free(threads);
+	free(started);
+	return result;
+}
+
+
+/*
+ * Free the replicas of a knowledge base. Called by kb_free().
+ */
+void numa_free_replicas(kb_t *kb) {
+	HashTable **replicas = atomic_load(&kb->replicas);
+	if (replicas == NULL) return;
+	for (int n = 0; n < numa_nodes(); n++) free_table(replicas[n]);
+	free(replicas);
+}
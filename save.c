@@ -0,0 +1,314 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements saving a knowledge base in the background.
+ *
+ * knowledge_save() forks a child process while holding the knowledge base's
+ * lock. The child has a copy-on-write image of the knowledge base as it was
+ * at that instant, so it writes a consistent snapshot however the parent
+ * changes its own copy afterwards, and lookups and changes in the parent
+ * never wait for the save. The child writes to a temporary file next to the
+ * target, flushes it to disk, then renames it over the target, so the target
+ * always holds either the old or the complete new knowledge. It reports its
+ * progress over a pipe, which knowledge_save_status() reads.
+ *
+ * Where fork() is not available the save is done at once in the calling
+ * thread, still through a temporary file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knowledge.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SAVE_FORK 1
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#include "alloc.h"
+
+#define SAVE_EXIT_NOMEM 2 //Exit status of a child that ran out of memory; any other failure exits with 1.
+
+struct SaveJob {
+	int id; //The number returned by knowledge_save().
+	int status; //KB_RUNNING, then KB_OK or KB_IOERR once the save is over.
+	long done; //Entries written, as last reported.
+	long total; //Entries to write, at most.
+#ifdef SAVE_FORK
+	pid_t pid; //The child process writing the file.
+	int fd; //The end of the pipe progress is read from, -1 once the save is over.
+#endif
+	SaveJob *next;
+};
+
+
+/*
+ * Make the name of the temporary file a save writes to.
+ *
+ * Input:
+ *   filename - the file being saved
+ *   id       - the number of the save
+ *
+ * Returns: the name, to be freed by the caller, or NULL if there was a memory allocation failure
+ */
+static char *save_temp_name(const char *filename, int id) {
+	size_t n = strlen(filename) + 48;
+	char *temp = (char *) malloc(n);
+#ifdef SAVE_FORK
+	if (temp != NULL) snprintf(temp, n, "%s.%ld.%d.tmp", filename, (long) getpid(), id); //unique among the processes saving to the same file.
+#else
+	if (temp != NULL) snprintf(temp, n, "%s.%d.tmp", filename, id);
+#endif
+	return temp;
+}
+
+
+/*
+ * Write the knowledge base to a temporary file, flush it to disk and rename
+ * it over the target.
+ *
+ * Input:
+ *   f        - the temporary file, closed before returning
+ *   temp     - the name of the temporary file
+ *   filename - the target
+ *   format   - as for kb_write()
+ *   delta    - as for kb_write()
+ *   progress - the progress of the write, or NULL
+ *
+ * Returns: KB_OK, KB_IOERR if the file could not be written, or KB_NOMEM
+ *          if there was a memory allocation failure; the target is left as it was
+ */
+static int save_write(kb_t *kb, FILE *f, const char *temp, const char *filename, int format, int delta, WriteProgress *progress) {
+	int result = kb_write(kb, f, format, delta, progress);
+	if (result != KB_OK) {
+		fclose(f);
+		remove(temp);
+		return result;
+	}
+	int failed = fflush(f) != 0 || ferror(f);
+#ifdef SAVE_FORK
+	failed = failed || fsync(fileno(f)) != 0; //the data must be on disk before the rename makes it the target.
+#endif
+	failed = fclose(f) != 0 || failed;
+#ifdef _WIN32
+	if (!failed) remove(filename); //rename() does not replace files on Windows.
+#endif
+	if (failed || rename(temp, filename) != 0) {
+		remove(temp);
+		return KB_IOERR;
+	}
+#ifdef SAVE_FORK
+	/* flush the directory too, so the rename itself survives a crash */
+	char *dir = strdup(filename);
+	char *slash = dir ? strrchr(dir, '/') : NULL;
+	if (dir != NULL) {
+		if (slash == NULL) strcpy(dir, ".");
+		else if (slash == dir) slash[1] = '\0';
+		else *slash = '\0';
+		int fd = open(dir, O_RDONLY);
+		if (fd >= 0) {
+			fsync(fd);
+			close(fd);
+		}
+		free(dir);
+	}
+#endif
+	return KB_OK;
+}
+
+
+#ifdef SAVE_FORK
+
+/*
+ * Send the progress of the write to the parent. Progress that does not fit
+ * in the pipe is dropped; the parent only wants the latest.
+ */
+static void save_report(WriteProgress *progress) {
+	ssize_t written = write(progress->fd, &progress->done, sizeof(progress->done));
+	(void) written;
+}
+
+
+/*
+ * Catch up with a save: read the progress reported since last time, and
+ * find out whether the child has finished.
+ *
+ * Input:
+ *   job  - the save
+ *   wait - 1 to wait for the child to finish, 0 to only look
+ */
+static void save_poll(SaveJob *job, int wait) {
+	if (job->status != KB_RUNNING) return;
+	long done;
+	while (read(job->fd, &done, sizeof(done)) == sizeof(done))
+		job->done = done;
+	int status;
+	pid_t pid;
+	do {
+		pid = waitpid(job->pid, &status, wait ? 0 : WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+	if (pid == 0) return; //still running.
+	job->status = pid != job->pid || !WIFEXITED(status) ? KB_IOERR
+		: WEXITSTATUS(status) == 0 ? KB_OK : WEXITSTATUS(status) == SAVE_EXIT_NOMEM ? KB_NOMEM : KB_IOERR;
+	if (job->status == KB_OK) job->done = job->total;
+	close(job->fd);
+	job->fd = -1;
+}
+
+#else
+
+static void save_poll(SaveJob *job, int wait) {
+	// Saves are over by the time knowledge_save() returns.
+}
+
+#endif
+
+
+/*
+ * Start saving the knowledge base to a file in the background. The file
+ * receives the knowledge as it is when this function is called, even if it
+ * changes before the save is over. Files named .csv or .jsonl are written as
+ * by knowledge_export(), any other as by knowledge_write(), except .kbf files,
+ * which only knowledge_freeze() writes.
+ *
+ * Input:
+ *   filename - the file
+ *   delta    - 1 to save as knowledge_write_delta(), 0 to save as knowledge_write()
+ *
+ * Returns:
+ *   the number of the save (greater than 0), to pass to knowledge_save_status()
+ *   KB_IOERR, if the file could not be created
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the file is named .kbf
+ */
+int knowledge_save(kb_t *kb, const char *filename, int delta) {
+	ALLOC_OP(ALLOC_OP_SAVE);
+	int format = kb_format(filename);
+	if (format == KB_FORMAT_FROZEN) {
+		return KB_INVALID;
+	}
+	if (format < 0) format = KB_FORMAT_INI;
+	SaveJob *job = (SaveJob *) calloc(1, sizeof(SaveJob));
+	if (job == NULL) {
+		return KB_NOMEM;
+	}
+	pthread_mutex_lock(&kb->lock);
+	for (SaveJob *other = kb->saves; other != NULL; other = other->next)
+		save_poll(other, 0); //reap saves that have finished.
+	job->id = kb->last_save + 1;
+	char *temp = save_temp_name(filename, job->id);
+	if (temp == NULL) {
+		pthread_mutex_unlock(&kb->lock);
+		free(job);
+		return KB_NOMEM;
+	}
+	job->total = kb_entries(kb);
+	job->status = KB_IOERR;
+
+#ifdef SAVE_FORK
+	int fds[2] = { -1, -1 };
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (f == NULL || pipe(fds) != 0) {
+		if (f != NULL) fclose(f);
+		else if (fd >= 0) close(fd);
+		if (fd >= 0) remove(temp);
+		pthread_mutex_unlock(&kb->lock);
+		free(temp);
+		free(job);
+		return KB_IOERR;
+	}
+	job->pid = fork();
+	if (job->pid == 0) {
+		/* the child: write the snapshot, then exit without running the parent's cleanup */
+		close(fds[0]);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		WriteProgress progress = { 0, save_report, fds[1] };
+		int result = save_write(kb, f, temp, filename, format, delta, &progress);
+		_exit(result == KB_OK ? 0 : result == KB_NOMEM ? SAVE_EXIT_NOMEM : 1);
+	}
+	fclose(f); //the child has its own copy.
+	close(fds[1]);
+	if (job->pid < 0) {
+		close(fds[0]);
+		remove(temp);
+		pthread_mutex_unlock(&kb->lock);
+		free(temp);
+		free(job);
+		return KB_IOERR;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	job->fd = fds[0];
+	job->status = KB_RUNNING;
+#else
+	FILE *f = fopen(temp, "w");
+	if (f != NULL) job->status = save_write(kb, f, temp, filename, format, delta, NULL);
+	if (job->status != KB_OK) {
+		int result = job->status;
+		pthread_mutex_unlock(&kb->lock);
+		free(temp);
+		free(job);
+		return result;
+	}
+	job->done = job->total;
+#endif
+
+	kb->last_save = job->id;
+	job->next = kb->saves;
+	kb->saves = job;
+	pthread_mutex_unlock(&kb->lock);
+	free(temp);
+	return job->id;
+}
+
+
+/*
+ * Get the progress of a save started by knowledge_save().
+ *
+ * Input:
+ *   job   - the number of the save, or 0 for the latest save; receives the number of the save
+ *
+ * Output:
+ *   done  - the number of entries written so far
+ *   total - the number of entries to write, at most
+ *
+ * Returns:
+ *   KB_RUNNING, if the save is still running
+ *   KB_OK, if the file was saved
+ *   KB_IOERR, if the file could not be written
+ *   KB_NOMEM, if there was no memory to write it; the file was not changed
+ *   KB_NOTFOUND, if there is no such save
+ */
+int knowledge_save_status(kb_t *kb, int *job, long *done, long *total) {
+	pthread_mutex_lock(&kb->lock);
+	SaveJob *save = kb->saves;
+	while (save != NULL && *job != 0 && save->id != *job)
+		save = save->next;
+	int status = KB_NOTFOUND;
+	if (save != NULL) {
+		save_poll(save, 0);
+		*job = save->id;
+		*done = save->done;
+		*total = save->total;
+		status = save->status;
+	}
+	pthread_mutex_unlock(&kb->lock);
+	return status;
+}
+
+
+/*
+ * Wait for the saves of a knowledge base that are still running, then free
+ * them. Called by kb_free().
+ */
+void save_jobs_free(kb_t *kb) {
+	while (kb->saves != NULL) {
+		SaveJob *next = kb->saves->next;
+		save_poll(kb->saves, 1);
+		free(kb->saves);
+		kb->saves = next;
+	}
+}
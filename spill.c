@@ -0,0 +1,452 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements keeping a knowledge base's responses within a memory
+ * budget, set with knowledge_set_budget().
+ *
+ * Once the responses take more memory than the budget, the coldest ones are
+ * evicted to a spill file: a temporary file that is unlinked as soon as it is
+ * created, so it goes away with the process. An evicted response is replaced
+ * in its entry by a small stub recording where its text is in the file, and
+ * the entity stays in the table, so lookups still find it. A lookup that hits
+ * a stub reads the text back with pread() and answers; afterwards it takes the
+ * lock and brings the response back into memory (a refault), evicting others
+ * if need be.
+ *
+ * Responses are interned, so entries with the same answer share one. Evicting
+ * a shared response from one of its entries would free nothing, only give
+ * that entry a stub and a copy of the text in the spill file of its own, so
+ * shared responses are left in memory: the hand only evicts responses held by
+ * a single entry. Stubs count against the budget like the responses they
+ * replace, so no budget below a stub for every response (the floor, see
+ * spill_floor()) can be met, and knowledge_set_budget() refuses one. The
+ * budget may still be out of reach once the knowledge grows, or if many
+ * responses are shared or short: when a whole turn of the hand evicts nothing,
+ * kb_evict() gives up, and tries again only once the responses have grown by
+ * 1/SPILL_STALL_GROWTH, rather than walk the table after every refault.
+ *
+ * Cold entries are found with the CLOCK algorithm, which approximates LRU
+ * without making lookups write to shared lists: every lookup sets the ref bit
+ * of the entry it hits, and only if it is not set already, so hot entries do
+ * not bounce cache lines between threads. The eviction hand walks the slots
+ * of the table in turn, clearing set bits and evicting the entries whose bit
+ * was already clear, that is, entries not looked up since the hand last
+ * passed.
+ *
+ * Lookups may be running while responses are evicted or refaulted. The new
+ * response is published in the entry before the old one is dropped, and the
+ * old ones are only freed once every lookup that may still read them has
+ * left (see kb_synchronize()). Evicted text is never overwritten: the spill
+ * file only grows, until it holds more dead text than live, when the live
+ * text is copied to a new file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "knowledge.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SPILL_FILE 1
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "alloc.h"
+
+#define SPILL_MIN_LEN 32 //Responses shorter than this are never evicted, their stub would save next to nothing.
+#define SPILL_COMPACT_MIN (1 << 20) //Bytes the spill file must hold before it is compacted.
+#define SPILL_STALL_GROWTH 8 //Once the budget is out of reach, evict again after the responses grow by 1/8.
+
+#ifdef SPILL_FILE
+
+/*
+ * Create a spill file, unlinked so it is removed when it is closed.
+ *
+ * Returns: the file descriptor, or -1 if the file could not be created
+ */
+static int spill_open() {
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+	size_t n = strlen(dir) + 32;
+	char *name = (char *) malloc(n);
+	if (name == NULL) return -1;
+	snprintf(name, n, "%s/chat1002-spill-XXXXXX", dir);
+	int fd = mkstemp(name);
+	if (fd >= 0) {
+		unlink(name);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+	free(name);
+	return fd;
+}
+
+
+/*
+ * Write text to a spill file.
+ *
+ * Returns: 0, or -1 if it could not all be written
+ */
+static int spill_write(int fd, const char *text, size_t len, long offset) {
+	while (len > 0) {
+		ssize_t written = pwrite(fd, text, len, offset);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return -1;
+		text += written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+
+/*
+ * Read the text of an evicted response. Called by response_copy().
+ *
+ * Input:
+ *   spilled - where the text is
+ *   buf     - a buffer to receive the text, terminated with a null
+ *   len     - the number of characters to read; buf holds at least len + 1
+ *
+ * Returns: the number of characters read, less than len only if the file could not be read
+ */
+size_t spill_read(const Spilled *spilled, char *buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t got = pread(spilled->fd, buf + done, len - done, spilled->offset + done);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) break;
+		done += got;
+	}
+	buf[done] = '\0';
+	return done;
+}
+
+
+/*
+ * Get the bytes of memory the responses of a table take, with the stubs of
+ * the evicted ones.
+ */
+static size_t spill_resident(HashTable *ht) {
+	return ht->responses->bytes + ht->responses->count * sizeof(Response) + ht->responses->spilled * (sizeof(Response) + sizeof(Spilled));
+}
+
+
+/*
+ * Get the bytes of memory the responses of a table would take if every one
+ * of them were evicted, leaving only its stub. No budget below it can be met.
+ */
+static size_t spill_floor(HashTable *ht) {
+	return (ht->responses->count + ht->responses->spilled) * (sizeof(Response) + sizeof(Spilled));
+}
+
+
+/*
+ * Put a response on the list of responses to free once no lookup can read
+ * them anymore. A retired response is out of its store's buckets, so its
+ * link is free to chain the list.
+ */
+static void spill_retire(HashTable *ht, Response *response, Response **retired) {
+	Response *dead = response_retire(ht->responses, response);
+	if (dead != NULL) {
+		dead->next = *retired;
+		*retired = dead;
+	}
+}
+
+
+/*
+ * Evict the response of an entry to the spill file.
+ *
+ * Input:
+ *   ht      - the table holding the entry
+ *   item    - the entry
+ *   buf     - a buffer the response is copied into, grown as needed
+ *   size    - the size of buf
+ *   retired - the list of responses to free
+ *
+ * Returns: 1 if the response was evicted, 0 if it could not be
+ */
+static int spill_evict(kb_t *kb, HashTable *ht, Node *item, char **buf, size_t *size, Response **retired) {
+	Response *old = item->responses;
+	if (old->len + 1 > *size) {
+		char *grown = (char *) realloc(*buf, old->len + 1);
+		if (grown == NULL) return 0;
+		*buf = grown;
+		*size = old->len + 1;
+	}
+	response_copy(ht->responses, old, *buf, *size);
+	if (spill_write(kb->spill_fd, *buf, old->len, kb->spill_end) != 0) return 0;
+	Response *stub = response_spilled(ht->responses, old->len, kb->spill_end, kb->spill_fd);
+	if (stub == NULL) return 0;
+	kb->spill_end += old->len;
+	__atomic_store_n(&item->responses, stub, __ATOMIC_RELEASE); //lookups see the stub or the old response, both complete.
+	spill_retire(ht, old, retired);
+	kb->evictions++;
+	return 1;
+}
+
+
+/*
+ * Copy the live text of the spill file to a new one once the file holds
+ * more than twice as much as the stubs still point to. All the text is
+ * copied before any stub is replaced, so a failure leaves every stub on the
+ * old file.
+ *
+ * Input:
+ *   ht      - the table
+ *   retired - the list of responses to free
+ *
+ * Returns: the old spill file, to close once no lookup can read it anymore, or -1 if it was kept
+ */
+static int spill_compact(kb_t *kb, HashTable *ht, Response **retired) {
+	if (kb->spill_end < SPILL_COMPACT_MIN || (size_t) kb->spill_end <= 2 * ht->responses->spilled_bytes) return -1;
+	int fd = spill_open();
+	if (fd < 0) return -1;
+	char *buf = NULL;
+	size_t size = 0;
+	long end = 0;
+	Response *stubs = NULL; //the new stubs, in the order of the items, chained by their unused links.
+	Response **tail = &stubs;
+	HtIter iter;
+	Node *item;
+	ht_iter_init(&iter);
+	while ((item = ht_next(ht, &iter)) != NULL) {
+		Response *old = item->responses;
+		if (old->clen != RESPONSE_SPILLED) continue;
+		if (old->len + 1 > size) {
+			char *grown = (char *) realloc(buf, old->len + 1);
+			if (grown == NULL) break;
+			buf = grown;
+			size = old->len + 1;
+		}
+		Response *stub = NULL;
+		if (response_copy(ht->responses, old, buf, size) == old->len && spill_write(fd, buf, old->len, end) == 0)
+			stub = response_spilled(ht->responses, old->len, end, fd);
+		if (stub == NULL) break;
+		end += old->len;
+		*tail = stub;
+		tail = &stub->next;
+	}
+	free(buf);
+	if (item != NULL) { //keep the old file and try again after the next eviction.
+		while (stubs != NULL) {
+			Response *next = stubs->next;
+			free(response_retire(ht->responses, stubs));
+			stubs = next;
+		}
+		close(fd);
+		return -1;
+	}
+	ht_iter_init(&iter);
+	while ((item = ht_next(ht, &iter)) != NULL) {
+		Response *old = item->responses;
+		if (old->clen != RESPONSE_SPILLED) continue;
+		Response *stub = stubs;
+		stubs = stub->next;
+		stub->next = NULL;
+		__atomic_store_n(&item->responses, stub, __ATOMIC_RELEASE);
+		spill_retire(ht, old, retired);
+	}
+	int old = kb->spill_fd;
+	kb->spill_fd = fd;
+	kb->spill_end = end;
+	return old;
+}
+
+
+/*
+ * Evict the coldest responses of the knowledge base until they fit in its
+ * budget. Called with the lock held after anything that adds responses.
+ *
+ * Returns: the number of responses evicted
+ */
+int kb_evict(kb_t *kb) {
+	HashTable *ht = kb->ht;
+	if (kb->budget == 0 || kb->spill_fd < 0 || kb->readonly || ht == NULL) return 0;
+	if (kb->stalled > 0 && spill_resident(ht) <= kb->stalled + kb->stalled / SPILL_STALL_GROWTH) return 0; //the hand just went round in vain.
+	char *buf = NULL; //buffer the evicted responses are copied into.
+	size_t size = 0;
+	Response *retired = NULL;
+	int evicted = 0;
+	/*a turn of the hand that neither evicts nor clears a ref bit will not on the next turn either, so the
+	budget cannot be met; two turns are the most it takes otherwise.*/
+	long idle = 0; //slots visited since the hand last evicted or cleared a bit.
+	for (long steps = 0; spill_resident(ht) > kb->budget && steps < 2L * ht->size && idle < ht->size; steps++, idle++) {
+		if (kb->clock_hand >= ht->size) kb->clock_hand = 0; //the table may have grown or shrunk since.
+		int i = kb->clock_hand++;
+		Node *item = ht->items[i].responses != NULL ? &ht->items[i] : NULL;
+		LinkedList *l = ht->obuckets[i];
+		for (; item != NULL || l != NULL; item = NULL) {
+			if (item == NULL) {
+				item = &l->item;
+				l = l->next;
+			}
+			if ((item->flags & NODE_TOMBSTONE) || item->intent == INTENT_ALIAS || item->responses->clen == RESPONSE_SPILLED || item->responses->len < SPILL_MIN_LEN) continue; //aliases are read on the way to other entries, keep them in memory.
+			if (item->responses->refcount > 1) continue; //shared with other entries, so evicting it here frees nothing.
+			if (__atomic_load_n(&item->ref, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&item->ref, 0, __ATOMIC_RELAXED); //a second chance.
+				idle = -1;
+				continue;
+			}
+			if (spill_evict(kb, ht, item, &buf, &size, &retired)) {
+				evicted++;
+				idle = -1;
+			}
+		}
+	}
+	kb->stalled = spill_resident(ht) > kb->budget ? spill_resident(ht) : 0;
+	free(buf);
+	int old_fd = spill_compact(kb, ht, &retired);
+	if (retired != NULL || old_fd >= 0) {
+		kb_synchronize(kb); //lookups may still be reading what was retired.
+		while (retired != NULL) {
+			Response *next = retired->next;
+			free(retired);
+			retired = next;
+		}
+		if (old_fd >= 0) close(old_fd);
+	}
+	return evicted;
+}
+
+
+/*
+ * Bring an evicted response back into memory after a lookup hit its stub.
+ * Called without the lock, and outside kb_enter() and kb_leave().
+ *
+ * Input:
+ *   tag    - the tag of the intent
+ *   entity - the entity
+ */
+void kb_refault(kb_t *kb, int tag, const char *entity) {
+	if (kb->readonly) return; //a shared base is left as it is.
+	pthread_mutex_lock(&kb->lock);
+	HashTable *ht = kb->ht;
+	Node *item = ht ? ht_search(ht, tag, entity) : NULL;
+	if (item == NULL || item->responses->clen != RESPONSE_SPILLED) { //another lookup brought it back first, or it is gone.
+		pthread_mutex_unlock(&kb->lock);
+		return;
+	}
+	Response *stub = item->responses;
+	char *buf = (char *) malloc(stub->len + 1);
+	Response *r = NULL;
+	if (buf != NULL && response_copy(ht->responses, stub, buf, stub->len + 1) == stub->len)
+		r = response_intern(ht->responses, buf);
+	free(buf);
+	if (r != NULL) {
+		Response *retired = NULL;
+		__atomic_store_n(&item->ref, 1, __ATOMIC_RELAXED); //it was just asked for, so it is not the next to go.
+		__atomic_store_n(&item->responses, r, __ATOMIC_RELEASE);
+		spill_retire(ht, stub, &retired);
+		kb->refaults++;
+		kb_evict(kb); //the response takes memory again, which may push others out.
+		if (retired != NULL) {
+			kb_synchronize(kb); //the lookup that hit the stub is over, but others may be reading it.
+			free(retired);
+		}
+	}
+	pthread_mutex_unlock(&kb->lock);
+}
+
+
+/*
+ * Close the spill file of a knowledge base. Called by kb_free() once its
+ * table is freed.
+ */
+void spill_free(kb_t *kb) {
+	if (kb->spill_fd >= 0) close(kb->spill_fd);
+}
+
+
+/*
+ * Limit the memory the responses of the knowledge base take, evicting the
+ * coldest to a spill file at once if they take more.
+ *
+ * Input:
+ *   bytes - the budget, or 0 for no limit
+ *
+ * Returns:
+ *   KB_OK, if the budget is set
+ *   KB_INVALID, if it is below the floor knowledge_stats() reports, which no eviction can reach
+ *   KB_IOERR, if the spill file could not be created
+ *   KB_READONLY, if the knowledge base is shared as a base
+ */
+int knowledge_set_budget(kb_t *kb, size_t bytes) {
+	if (kb->readonly) {
+		return KB_READONLY;
+	}
+	pthread_mutex_lock(&kb->lock);
+	if (bytes > 0 && kb->ht != NULL && bytes < spill_floor(kb->ht)) {
+		pthread_mutex_unlock(&kb->lock);
+		return KB_INVALID;
+	}
+	if (bytes > 0 && kb->spill_fd < 0) kb->spill_fd = spill_open();
+	int result = bytes > 0 && kb->spill_fd < 0 ? KB_IOERR : KB_OK;
+	if (result == KB_OK) {
+		kb->budget = bytes;
+		kb->stalled = 0;
+		kb_evict(kb);
+	}
+	pthread_mutex_unlock(&kb->lock);
+	return result;
+}
+
+#else
+
+size_t spill_read(const Spilled *spilled, char *buf, size_t len) {
+	// Nothing is ever evicted without a spill file.
+	buf[0] = '\0';
+	return 0;
+}
+
+static size_t spill_resident(HashTable *ht) {
+	return ht->responses->bytes + ht->responses->count * sizeof(Response) + ht->responses->spilled * (sizeof(Response) + sizeof(Spilled));
+}
+
+static size_t spill_floor(HashTable *ht) {
+	return (ht->responses->count + ht->responses->spilled) * (sizeof(Response) + sizeof(Spilled));
+}
+
+int kb_evict(kb_t *kb) {
+	return 0;
+}
+
+void kb_refault(kb_t *kb, int tag, const char *entity) {
+}
+
+void spill_free(kb_t *kb) {
+}
+
+int knowledge_set_budget(kb_t *kb, size_t bytes) {
+	// Spill files need pread() and pwrite(); without them only "no limit" is accepted.
+	return bytes == 0 ? KB_OK : KB_IOERR;
+}
+
+#endif
+
+
+/*
+ * Get figures on the memory the knowledge base takes and on its evictions.
+ *
+ * Output:
+ *   stats - the figures
+ */
+void knowledge_stats(kb_t *kb, kb_stats_t *stats) {
+	memset(stats, 0, sizeof(kb_stats_t));
+	pthread_mutex_lock(&kb->lock);
+	HashTable *ht = kb->ht;
+	if (ht != NULL) {
+		stats->entries = ht->count;
+		stats->resident_bytes = spill_resident(ht);
+		stats->floor_bytes = spill_floor(ht);
+		stats->spilled = ht->responses->spilled;
+		stats->spilled_bytes = ht->responses->spilled_bytes;
+	}
+	stats->budget = kb->budget;
+	stats->evictions = kb->evictions;
+	stats->refaults = kb->refaults;
+	stats->seconds = difftime(time(NULL), kb->created);
+	pthread_mutex_unlock(&kb->lock);
+}
@@ -0,0 +1,260 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements tracing the stages of each request, for
+ * "chatbot --trace FILE".
+ *
+ * Once trace_start() is called, every stage timed with TRACE_BEGIN() and
+ * TRACE_END() (see trace.h) is recorded by the thread that ran it in a ring
+ * buffer of its own, so recording takes no lock and shares no cache line
+ * with other threads. Each ring keeps the last TRACE_RING events, and a
+ * histogram of every event since the start. trace_write() writes the events
+ * in the Chrome trace event format, to open in chrome://tracing or Perfetto,
+ * or the histograms as a table of percentiles per stage, which shows where
+ * the tail latency comes from.
+ *
+ * Events are timed with the CPU's time stamp counter where there is one,
+ * which costs a few nanoseconds to read, and converted to nanoseconds when
+ * they are written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "trace.h"
+#include "alloc.h"
+
+#define TRACE_RING (1 << 16) //Number of events each thread keeps, a power of two.
+#define TRACE_SUB 4 //Buckets of the histograms in each power of two, a power of two.
+#define TRACE_BUCKETS (64 * TRACE_SUB) //Buckets of the histograms, enough for any 64 bit duration.
+
+static const char *trace_names[TRACE_STAGES] = {"read", "split", "dispatch", "key", "search", "copy", "format"}; //Names of the stages, indexed by stage.
+
+typedef struct TraceEvent TraceEvent; //A stage of a request.
+struct TraceEvent {
+	unsigned long long start; //When the stage began, in ticks of trace_now().
+	unsigned long long ticks; //How long it took.
+	unsigned int request; //The request it belongs to, numbered by thread.
+	int stage;
+};
+
+typedef struct TraceRing TraceRing; //What one thread has recorded.
+struct TraceRing {
+	unsigned long long recorded; //Number of events recorded; the latest TRACE_RING are in events.
+	unsigned int request; //The request the thread is working on.
+	int tid; //The number of the thread in the trace.
+	TraceRing *next; //The ring of the thread that started recording before this one.
+	unsigned long long total[TRACE_STAGES]; //Ticks spent in each stage.
+	unsigned long long max[TRACE_STAGES]; //Longest time spent in each stage.
+	unsigned long histogram[TRACE_STAGES][TRACE_BUCKETS]; //Events of each stage by duration, see trace_bucket().
+	TraceEvent events[TRACE_RING];
+};
+
+int trace_enabled = 0;
+static __thread TraceRing *trace_ring = NULL; //The ring of the calling thread, created by its first event.
+static _Atomic(TraceRing *) trace_rings = NULL; //Every ring, newest first.
+static atomic_int trace_threads = 0; //Number of rings created.
+static unsigned long long trace_start_ticks; //trace_now() when the trace started.
+static double trace_start_ns; //The monotonic clock when the trace started, to calibrate the ticks.
+
+
+/*
+ * Get the monotonic clock in nanoseconds.
+ */
+static double trace_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Get the bucket of a histogram a duration falls in. Durations below
+ * TRACE_SUB ticks have a bucket each; above, each power of two is split into
+ * TRACE_SUB buckets, so a bucket is never wider than 1/TRACE_SUB of what it
+ * holds.
+ */
+static int trace_bucket(unsigned long long ticks) {
+	if (ticks < TRACE_SUB) return (int) ticks;
+	int log = 63 - __builtin_clzll(ticks);
+	int shift = log - __builtin_ctz(TRACE_SUB);
+	return (log - __builtin_ctz(TRACE_SUB) + 1) * TRACE_SUB + (int) ((ticks >> shift) & (TRACE_SUB - 1));
+}
+
+
+/*
+ * Get the shortest duration in a bucket of a histogram.
+ */
+static unsigned long long trace_bucket_start(int bucket) {
+	if (bucket < TRACE_SUB) return bucket;
+	int shift = bucket / TRACE_SUB - 1;
+	return (unsigned long long) (TRACE_SUB + bucket % TRACE_SUB) << shift;
+}
+
+
+/*
+ * Create the ring of the calling thread.
+ *
+ * Returns: the ring, or NULL if there was a memory allocation failure
+ */
+static TraceRing *trace_ring_create() {
+	TraceRing *ring = (TraceRing *) calloc(1, sizeof(TraceRing));
+	if (ring == NULL) return NULL;
+	ring->tid = atomic_fetch_add(&trace_threads, 1) + 1;
+	ring->next = atomic_load(&trace_rings);
+	while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring)); //threads may start recording at once.
+	trace_ring = ring;
+	return ring;
+}
+
+
+/*
+ * Record a stage that has just ended. Called by TRACE_END().
+ *
+ * Input:
+ *   stage - the stage
+ *   start - when it began, from TRACE_BEGIN()
+ */
+void trace_record(int stage, unsigned long long start) {
+	unsigned long long ticks = trace_now() - start;
+	TraceRing *ring = trace_ring;
+	if (ring == NULL && (ring = trace_ring_create()) == NULL) return;
+	TraceEvent *event = &ring->events[ring->recorded++ & (TRACE_RING - 1)];
+	event->start = start;
+	event->ticks = ticks;
+	event->request = ring->request;
+	event->stage = stage;
+	ring->total[stage] += ticks;
+	if (ticks > ring->max[stage]) ring->max[stage] = ticks;
+	ring->histogram[stage][trace_bucket(ticks)]++;
+}
+
+
+/*
+ * Start a new request in the calling thread. Called by TRACE_REQUEST().
+ */
+void trace_request() {
+	TraceRing *ring = trace_ring;
+	if (ring == NULL && (ring = trace_ring_create()) == NULL) return;
+	ring->request++;
+}
+
+
+/*
+ * Start tracing. Call it before starting the threads to trace.
+ */
+void trace_start() {
+	trace_start_ns = trace_clock();
+	trace_start_ticks = trace_now();
+	trace_enabled = 1;
+}
+
+
+/*
+ * Write the events of every thread in the Chrome trace event format.
+ */
+static void trace_write_chrome(FILE *f, double ns_per_tick) {
+	const char *separator = "";
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (TraceRing *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+		unsigned long long first = ring->recorded > TRACE_RING ? ring->recorded - TRACE_RING : 0; //older events were overwritten.
+		for (unsigned long long i = first; i < ring->recorded; i++) {
+			TraceEvent *event = &ring->events[i & (TRACE_RING - 1)];
+			fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"chatbot\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%u}}",
+				separator, trace_names[event->stage], ring->tid,
+				(double) (event->start - trace_start_ticks) * ns_per_tick / 1000, event->ticks * ns_per_tick / 1000, event->request);
+			separator = ",\n";
+		}
+	}
+	fprintf(f, "\n]}\n");
+}
+
+
+/*
+ * Get a percentile of a histogram.
+ *
+ * Returns: the upper bound of the bucket holding the percentile, in ticks
+ */
+static unsigned long long trace_percentile(const unsigned long *histogram, unsigned long count, double percent) {
+	unsigned long rank = (unsigned long) (count * percent / 100);
+	unsigned long seen = 0;
+	for (int b = 0; b < TRACE_BUCKETS; b++) {
+		seen += histogram[b];
+		if (seen > rank) return b + 1 < TRACE_BUCKETS ? trace_bucket_start(b + 1) - 1 : ~0ULL;
+	}
+	return 0;
+}
+
+
+/*
+ * Write the histograms of every thread, merged, as a table of percentiles
+ * per stage.
+ */
+static void trace_write_histograms(FILE *f, double ns_per_tick) {
+	static const double percents[] = {50, 90, 99, 99.9};
+	fprintf(f, "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean ns", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+	for (int stage = 0; stage < TRACE_STAGES; stage++) {
+		unsigned long histogram[TRACE_BUCKETS] = {0};
+		unsigned long long total = 0, max = 0;
+		unsigned long count = 0;
+		for (TraceRing *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+			for (int b = 0; b < TRACE_BUCKETS; b++) {
+				histogram[b] += ring->histogram[stage][b];
+				count += ring->histogram[stage][b];
+			}
+			total += ring->total[stage];
+			if (ring->max[stage] > max) max = ring->max[stage];
+		}
+		if (count == 0) continue;
+		fprintf(f, "%-10s %10lu %10.0f", trace_names[stage], count, total * ns_per_tick / count);
+		for (int p = 0; p < 4; p++) {
+			unsigned long long ticks = trace_percentile(histogram, count, percents[p]);
+			fprintf(f, " %10.0f", (ticks < max ? ticks : max) * ns_per_tick); //the bucket may reach past the longest event.
+		}
+		fprintf(f, " %10.0f\n", max * ns_per_tick);
+	}
+}
+
+
+/*
+ * Write what has been traced so far. Threads may go on recording meanwhile,
+ * but the events they record while the trace is written may come out
+ * garbled; write it once they are done for an exact trace.
+ *
+ * Input:
+ *   f      - the file
+ *   format - TRACE_FORMAT_CHROME for every event in the Chrome trace event format,
+ *            TRACE_FORMAT_HISTOGRAM for a table of the percentiles of each stage
+ *
+ * Returns: KB_OK, or KB_IOERR if the file could not be written
+ */
+int trace_write(FILE *f, int format) {
+	double ns_per_tick = 1;
+#if defined(__x86_64__) || defined(__i386__)
+	double ns = trace_clock() - trace_start_ns;
+	while (ns < 1e7) //calibrate over 10 ms at least.
+		ns = trace_clock() - trace_start_ns;
+	unsigned long long ticks = trace_now() - trace_start_ticks;
+	if (ticks > 0) ns_per_tick = ns / ticks;
+#endif
+	if (format == TRACE_FORMAT_CHROME) trace_write_chrome(f, ns_per_tick);
+	else trace_write_histograms(f, ns_per_tick);
+	return fflush(f) != 0 || ferror(f) ? KB_IOERR : KB_OK;
+}
+
+
+/*
+ * Stop tracing and free what was traced. No thread may be recording.
+ */
+void trace_free() {
+	trace_enabled = 0;
+	TraceRing *ring = atomic_exchange(&trace_rings, NULL);
+	while (ring != NULL) {
+		TraceRing *next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	trace_ring = NULL;
+}
@@ -0,0 +1,59 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file contains the macros that time the stages of a request for
+ * "chatbot --trace" (see trace.c). It is internal to the chatbot; programs
+ * using the library start and write traces with the functions in chat1002.h.
+ *
+ * Each stage is timed with TRACE_BEGIN(t) before it and TRACE_END(stage, t)
+ * after it. While tracing is off, they cost one predictable branch. Building
+ * with -DNO_TRACE removes them altogether.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+#include <time.h>
+#include "chat1002.h"
+
+/* the stages of a request */
+#define TRACE_READ     0 //Reading the line.
+#define TRACE_SPLIT    1 //Splitting it into words.
+#define TRACE_DISPATCH 2 //Finding the intent and carrying it out, which includes the stages below.
+#define TRACE_KEY      3 //Finding the intent tag of a question.
+#define TRACE_SEARCH   4 //Looking up the entity in the table.
+#define TRACE_COPY     5 //Copying out (and decompressing) the response.
+#define TRACE_FORMAT   6 //Formatting and writing the response.
+#define TRACE_STAGES   7
+
+extern int trace_enabled; //Set by trace_start().
+
+/* functions defined in trace.c */
+void trace_record(int stage, unsigned long long start);
+void trace_request();
+
+/* Read the clock of the trace: the CPU's time stamp counter where there is one, else nanoseconds. */
+static inline unsigned long long trace_now() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+#ifndef NO_TRACE
+
+#define TRACE_BEGIN(t) unsigned long long t = trace_enabled ? trace_now() : 0
+#define TRACE_END(stage, t) do { if (trace_enabled) trace_record(stage, t); } while (0)
+#define TRACE_REQUEST() do { if (trace_enabled) trace_request(); } while (0)
+
+#else
+
+#define TRACE_BEGIN(t) do { } while (0)
+#define TRACE_END(stage, t) do { } while (0)
+#define TRACE_REQUEST() do { } while (0)
+
+#endif
+
+#endif
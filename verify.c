@@ -0,0 +1,187 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the checksums of ini files. kb_write() ends every ini
+ * file it writes with a trailer, such as
+ *
+ *   [end entries=1048576 crc32=89abcdef]
+ *
+ * giving the number of lines before it other than section headers, and the
+ * CRC-32 of every byte before it (the CRC of zlib, so "python3 -c 'import
+ * zlib...'" or any crc32 tool gives the same). kb_read_table() sums the lines
+ * as it reads them, and fails with KB_CORRUPT if they do not add up to the
+ * trailer; knowledge_read() reads into a staging table, so it then keeps
+ * nothing of the file. A file of several saves put one after another checks
+ * each against its own trailer. Files without a trailer, written by hand or
+ * by older chatbots, or with lines after their last, are read as they always
+ * were, but reported as unverified.
+ *
+ * "verify FILE" and "chatbot --verify FILE" check a file against its trailer
+ * without storing anything: the file is read a chunk at a time, each line
+ * found with memchr() and the CRC taken over whole chunks at once, so a large
+ * export is checked as fast as it can be read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "knowledge.h"
+#include "alloc.h"
+
+#define VERIFY_CHUNK (1 << 20) //Bytes knowledge_verify() reads at a time, more for longer lines.
+#define CRC32_POLY 0xedb88320u //The CRC-32 polynomial of zlib, bit reversed.
+
+static unsigned int crc32_table[8][256]; //The CRC of each byte, then of each byte followed by 1 to 7 zero bytes.
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * Fill in the CRC tables. Called once, by crc32_update().
+ */
+static void crc32_init() {
+	for (unsigned int i = 0; i < 256; i++) {
+		unsigned int crc = i;
+		for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crc32_table[0][i] = crc;
+	}
+	for (unsigned int i = 0; i < 256; i++)
+		for (int k = 1; k < 8; k++) crc32_table[k][i] = (crc32_table[k - 1][i] >> 8) ^ crc32_table[0][crc32_table[k - 1][i] & 0xff];
+}
+
+
+/*
+ * Add bytes to a CRC-32, eight at a time (slicing by 8).
+ *
+ * Input:
+ *   crc  - the CRC of the bytes before, 0 for none
+ *   data - the bytes
+ *   len  - the number of bytes
+ *
+ * Returns: the CRC of the bytes before followed by these
+ */
+unsigned int crc32_update(unsigned int crc, const char *data, size_t len) {
+	pthread_once(&crc32_once, crc32_init);
+	const unsigned char *p = (const unsigned char *) data;
+	crc = ~crc;
+	for (; len >= 8; len -= 8, p += 8) {
+		unsigned int lo = crc ^ ((unsigned int) p[0] | (unsigned int) p[1] << 8 | (unsigned int) p[2] << 16 | (unsigned int) p[3] << 24);
+		unsigned int hi = (unsigned int) p[4] | (unsigned int) p[5] << 8 | (unsigned int) p[6] << 16 | (unsigned int) p[7] << 24;
+		crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^ crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24]
+			^ crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^ crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+	}
+	for (; len > 0; len--, p++) crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p) & 0xff];
+	return ~crc;
+}
+
+
+/*
+ * Recognise the trailer of an ini file.
+ *
+ * Input:
+ *   line - the line, which may still end in its line break
+ *   len  - its length
+ *
+ * Output:
+ *   trailer - the entries and checksum the trailer gives
+ *
+ * Returns: 1 if the line is a trailer, 0 if not
+ */
+int ini_trailer(const char *line, size_t len, IniSum *trailer) {
+	char copy[64]; //a trailer is short, anything longer is not one.
+	if (len < 5 || len >= sizeof(copy) || memcmp(line, "[end ", 5) != 0) return 0;
+	memcpy(copy, line, len);
+	copy[len] = '\0';
+	int end = 0;
+	return sscanf(copy, "[end entries=%ld crc32=%x]%n", &trailer->entries, &trailer->crc, &end) == 2 && end > 0;
+}
+
+
+/*
+ * Check an ini file written by knowledge_write() or saved by "save", without
+ * storing any of it.
+ *
+ * Input:
+ *   f - the file
+ *
+ * Output:
+ *   entries  - the number of lines in the file other than section headers
+ *   checksum - the CRC-32 of the file up to its last trailer, or of all of it if it has none
+ *
+ * Returns:
+ *   KB_OK, if the file ends with a trailer, and each trailer matches what comes before it
+ *   KB_NOTFOUND, if the file has no trailer, or lines that follow its last, which nothing vouches for
+ *   KB_CORRUPT, if a trailer does not match what comes before it
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_IOERR, if the file could not be read
+ */
+int knowledge_verify(FILE *f, long *entries, unsigned int *checksum) {
+	size_t size = VERIFY_CHUNK;
+	char *buf = (char *) malloc(size);
+	if (buf == NULL) {
+		return KB_NOMEM;
+	}
+	IniSum sum = { 0, 0 }; //since the start or the last trailer.
+	IniSum trailer;
+	long total = 0;
+	unsigned int last = 0; //the CRC the last trailer vouched for.
+	int trailers = 0;
+	int corrupt = 0;
+	int result = KB_OK;
+	size_t have = 0; //bytes at the start of buf: a line begun in the previous chunk.
+	int eof = 0;
+	while (!eof) {
+		if (have == size) { //a line longer than the buffer.
+			char *grown = (char *) realloc(buf, size * 2);
+			if (grown == NULL) {
+				result = KB_NOMEM;
+				break;
+			}
+			buf = grown;
+			size *= 2;
+		}
+		size_t got = fread(buf + have, 1, size - have, f);
+		if (got < size - have) {
+			if (ferror(f)) {
+				result = KB_IOERR;
+				break;
+			}
+			eof = 1;
+		}
+		size_t end = have + got;
+		size_t start = 0; //start of the next line.
+		size_t pending = 0; //start of the bytes not in sum.crc yet.
+		while (start < end) {
+			char *nl = (char *) memchr(buf + start, '\n', end - start);
+			if (nl == NULL && !eof) break; //the rest of the line is in the next chunk.
+			size_t stop = nl != NULL ? (size_t) (nl - buf) + 1 : end;
+			size_t len = stop - start;
+			while (len > 0 && (buf[start + len - 1] == '\n' || buf[start + len - 1] == '\r')) len--;
+			if (len > 0 && buf[start] == '[' && ini_trailer(buf + start, len, &trailer)) {
+				sum.crc = crc32_update(sum.crc, buf + pending, start - pending);
+				if (trailer.entries != sum.entries || trailer.crc != sum.crc) corrupt = 1;
+				last = sum.crc;
+				trailers++;
+				sum.entries = 0;
+				sum.crc = 0;
+				pending = stop;
+			} else if (len > 0 && buf[start] != '[') {
+				sum.entries++;
+				total++;
+			}
+			start = stop;
+		}
+		sum.crc = crc32_update(sum.crc, buf + pending, start - pending);
+		memmove(buf, buf + start, end - start);
+		have = end - start;
+	}
+	free(buf);
+	*entries = total;
+	*checksum = trailers > 0 && sum.entries == 0 ? last : sum.crc;
+	if (result != KB_OK) {
+		return result;
+	}
+	if (corrupt) {
+		return KB_CORRUPT;
+	}
+	return trailers > 0 && sum.entries == 0 ? KB_OK : KB_NOTFOUND;
+}
@@ -0,0 +1,193 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements hot reloading of a knowledge base from its file.
+ *
+ * kb_watch() starts a thread that waits with inotify for the file to be
+ * written or replaced, then reads it with knowledge_reload(), which swaps the
+ * new knowledge in at once while lookups carry on with the old. The directory
+ * of the file is watched rather than the file itself, so that editors that
+ * save by writing a new file and renaming it over the old one are noticed.
+ *
+ * Hot reloading needs inotify, so on other systems kb_watch() returns NULL.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+#include "alloc.h"
+
+#ifdef __linux__
+
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#define WATCH_SETTLE_MS 50 //Wait for the file to stay unchanged this long before reloading it.
+
+struct kb_watch {
+	kb_t *kb;
+	char *filename; //The file, as given to kb_watch().
+	const char *name; //The name of the file within its directory, pointing into filename.
+	int fd; //The inotify instance.
+	int stop[2]; //A pipe, written to by kb_unwatch() to stop the thread.
+	pthread_t thread;
+};
+
+
+/*
+ * Check whether a batch of inotify events mentions the watched file.
+ *
+ * Input:
+ *   buf - the events
+ *   len - the number of bytes of events
+ *
+ * Returns: 1 if the file was written or replaced, 0 otherwise
+ */
+static int watch_changed(kb_watch_t *watch, const char *buf, ssize_t len) {
+	int changed = 0;
+	for (const char *p = buf; p < buf + len; ) {
+		const struct inotify_event *event = (const struct inotify_event *) p;
+		if (event->len > 0 && strcmp(event->name, watch->name) == 0)
+			changed = 1;
+		p += sizeof(struct inotify_event) + event->len;
+	}
+	return changed;
+}
+
+
+/*
+ * The watching thread. Reloads the knowledge base each time the file settles
+ * after a change, until kb_unwatch() writes to the stop pipe.
+ */
+static void *watch_thread(void *arg) {
+	kb_watch_t *watch = (kb_watch_t *) arg;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = { { watch->fd, POLLIN, 0 }, { watch->stop[0], POLLIN, 0 } };
+	int pending = 0; //set once the file has changed but was not reloaded yet.
+
+	for (;;) {
+		if (poll(fds, 2, pending ? WATCH_SETTLE_MS : -1) < 0)
+			continue; //interrupted by a signal.
+		if (fds[1].revents)
+			break;
+		if (fds[0].revents & POLLIN) {
+			ssize_t len = read(watch->fd, buf, sizeof(buf));
+			if (len > 0 && watch_changed(watch, buf, len))
+				pending = 1; //wait for the writer to finish before reloading.
+			continue;
+		}
+		if (pending) { //quiet for WATCH_SETTLE_MS, reload the file.
+			FILE *f = fopen(watch->filename, "r");
+			if (f != NULL) { //it may be gone for a moment while being replaced, the next event will bring it back.
+				int result = knowledge_reload(watch->kb, f);
+				if (result == KB_CORRUPT)
+					fprintf(stderr, "%s does not match its checksum, kept the knowledge read before\n", watch->filename);
+				else if (result < 0)
+					fprintf(stderr, "Could not reload %s\n", watch->filename);
+				fclose(f);
+			}
+			pending = 0;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Start reloading a knowledge base whenever its file changes. The current
+ * contents of the file are not read; do that first with knowledge_read().
+ *
+ * Input:
+ *   kb       - the knowledge base, which must outlive the watch
+ *   filename - the file
+ *
+ * Returns: the watch, or NULL if the file's directory cannot be watched
+ */
+kb_watch_t *kb_watch(kb_t *kb, const char *filename) {
+	kb_watch_t *watch = (kb_watch_t *) calloc(1, sizeof(kb_watch_t));
+	if (watch == NULL) {
+		return NULL;
+	}
+	watch->kb = kb;
+	watch->fd = -1;
+	watch->stop[0] = watch->stop[1] = -1;
+
+	/* split the file name into its directory and its name */
+	size_t len = strlen(filename);
+	watch->filename = (char *) malloc(len + 2);
+	char *dir = (char *) malloc(len + 2);
+	if (watch->filename == NULL || dir == NULL) {
+		goto fail;
+	}
+	strcpy(watch->filename, filename);
+	const char *slash = strrchr(filename, '/');
+	watch->name = slash ? watch->filename + (slash - filename) + 1 : watch->filename;
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (slash == filename)
+		strcpy(dir, "/");
+	else {
+		memcpy(dir, filename, slash - filename);
+		dir[slash - filename] = '\0';
+	}
+
+	watch->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (watch->fd < 0 || inotify_add_watch(watch->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		goto fail;
+	}
+	if (pipe(watch->stop) != 0) {
+		watch->stop[0] = watch->stop[1] = -1;
+		goto fail;
+	}
+	if (pthread_create(&watch->thread, NULL, watch_thread, watch) != 0) {
+		goto fail;
+	}
+	free(dir);
+	return watch;
+
+fail:
+	free(dir);
+	if (watch->stop[0] >= 0) {
+		close(watch->stop[0]);
+		close(watch->stop[1]);
+	}
+	if (watch->fd >= 0)
+		close(watch->fd);
+	free(watch->filename);
+	free(watch);
+	return NULL;
+}
+
+
+/*
+ * Stop watching, waiting for a reload in progress to finish.
+ *
+ * Input:
+ *   watch - the watch, or NULL
+ */
+void kb_unwatch(kb_watch_t *watch) {
+	if (watch == NULL) return;
+	ssize_t written = write(watch->stop[1], "", 1); //wake the thread, the pipe is empty so this cannot block.
+	(void) written;
+	pthread_join(watch->thread, NULL);
+	close(watch->stop[0]);
+	close(watch->stop[1]);
+	close(watch->fd);
+	free(watch->filename);
+	free(watch);
+}
+
+#else
+
+kb_watch_t *kb_watch(kb_t *kb, const char *filename) {
+	// Hot reloading needs inotify.
+	return NULL;
+}
+
+void kb_unwatch(kb_watch_t *watch) {
+}
+
+#endif